@@ -0,0 +1,188 @@
+/**
+ * Checks and microbenchmarks for the coroutines.
+ *
+ * First runs a few handlers over pipes from an epoll loop, the way the
+ * server drives them, checking every message arrives in order. Then
+ * times a resume/yield round trip and creating and freeing a coroutine,
+ * which reuses a pooled stack.
+ *
+ * Usage: coro_bench [-n iterations]
+ */
+#define _GNU_SOURCE
+#include "../src/coro.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NHANDLERS 8
+#define NMESSAGES 100
+
+typedef struct {
+    int fd;
+    int received;
+} echo_t;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Handler reading fixed-size messages in straight-line code.
+ */
+static void reader(coro_t *co, void *arg) {
+    echo_t *e = arg;
+    char buf[16];
+
+    for (int i = 0; i < NMESSAGES; i++) {
+        size_t got = 0;
+        while (got < sizeof(buf)) {
+            ssize_t n = coro_read(co, e->fd, buf + got, sizeof(buf) - got);
+            if (n <= 0) {
+                fprintf(stderr, "coro_read: unexpected end\n");
+                exit(1);
+            }
+            got += n;
+        }
+        char want[16];
+        snprintf(want, sizeof(want), "message %07d", i);
+        if (memcmp(buf, want, sizeof(buf)) != 0) {
+            fprintf(stderr, "message %d out of order\n", i);
+            exit(1);
+        }
+        e->received++;
+    }
+}
+
+/**
+ * Runs NHANDLERS readers from an epoll loop while writing to them in
+ * round-robin, checking all messages arrive.
+ */
+static void check_event_loop(void) {
+    int epfd = epoll_create1(0);
+    int wfds[NHANDLERS];
+    echo_t echoes[NHANDLERS];
+    coro_t *cos[NHANDLERS];
+    int running = NHANDLERS;
+
+    for (int i = 0; i < NHANDLERS; i++) {
+        int p[2];
+        if (pipe2(p, O_NONBLOCK) != 0) {
+            perror("pipe2");
+            exit(1);
+        }
+        wfds[i] = p[1];
+        echoes[i].fd = p[0];
+        echoes[i].received = 0;
+        cos[i] = coro_new(reader, &echoes[i]);
+
+        // First run, until it waits for data
+        coro_resume(cos[i]);
+        int fd;
+        uint32_t events;
+        if (!coro_waiting(cos[i], &fd, &events)) {
+            fprintf(stderr, "reader not waiting\n");
+            exit(1);
+        }
+        struct epoll_event ev = { .events = events, .data.ptr = cos[i] };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    for (int m = 0; running > 0; m++) {
+        // Each message in two halves, so readers also wait mid-message
+        for (int i = 0; i < NHANDLERS && m < NMESSAGES; i++) {
+            char msg[17];
+            snprintf(msg, sizeof(msg), "message %07d", m);
+            if (write(wfds[i], msg, 5) != 5 || write(wfds[i], msg + 5, 11) != 11) {
+                perror("write");
+                exit(1);
+            }
+        }
+
+        struct epoll_event evs[NHANDLERS];
+        int n = epoll_wait(epfd, evs, NHANDLERS, 1000);
+        for (int i = 0; i < n; i++) {
+            coro_t *co = evs[i].data.ptr;
+            if (!coro_resume(co)) {
+                running--;
+                for (int j = 0; j < NHANDLERS; j++) {
+                    if (cos[j] == co)
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, echoes[j].fd, NULL);
+                }
+            }
+        }
+        if (n == 0) {
+            fprintf(stderr, "handlers stalled\n");
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < NHANDLERS; i++) {
+        if (echoes[i].received != NMESSAGES) {
+            fprintf(stderr, "handler %d got %d messages\n", i, echoes[i].received);
+            exit(1);
+        }
+        coro_free(cos[i]);
+        close(echoes[i].fd);
+        close(wfds[i]);
+    }
+    close(epfd);
+    printf("event loop: %d handlers x %d messages ok\n", NHANDLERS, NMESSAGES);
+}
+
+static void yielder(coro_t *co, void *arg) {
+    (void) arg;
+    for (;;)
+        coro_yield(co);
+}
+
+static void noop(coro_t *co, void *arg) {
+    (void) co;
+    (void) arg;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = 10000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (iterations <= 0)
+        iterations = 1;
+
+    check_event_loop();
+
+    coro_t *co = coro_new(yielder, NULL);
+    uint64_t start = now_ns();
+    for (long i = 0; i < iterations; i++)
+        coro_resume(co);
+    printf("resume + yield:   %8.1f ns\n", (double) (now_ns() - start) / iterations);
+    coro_free(co);
+
+    long creates = iterations / 10 + 1;
+    start = now_ns();
+    for (long i = 0; i < creates; i++) {
+        co = coro_new(noop, NULL);
+        coro_resume(co);
+        coro_free(co);
+    }
+    printf("create, run, free: %7.1f ns\n", (double) (now_ns() - start) / creates);
+
+    return 0;
+}
@@ -0,0 +1,389 @@
+/**
+ * Microbenchmarks for the hash table operations.
+ *
+ * For every table size, key length and hit ratio, times hash_insert,
+ * hash_search, hash_contains and hash_remove and reports nanoseconds,
+ * cache misses and heap allocations per operation.
+ *
+ * Tables are accessed through table_ops_t, so other table designs can be
+ * measured with the same workload by adding an entry to tables[].
+ *
+ * Allocations, heap and mmap(2), are counted by wrapping them at link
+ * time (-Wl,--wrap), cache misses through perf_event_open(2) when the
+ * kernel allows it.
+ */
+#include "../src/hash_table.h"
+#include "../src/huge_alloc.h"
+#include "../src/shm_table.h"
+
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN_OPS   200000    // minimum operations timed per measurement
+#define MAX_PROBE 1000000   // maximum lookups timed per measurement
+#define SHM_SIZE  (16ull << 30)  // shared region, only touched as it fills
+
+
+/**
+ * Common interface for the table designs under test.
+ */
+typedef struct {
+    const char *name;
+    void *(*create)(void);
+    void  (*destroy)(void *t);
+    void  (*insert)(void *t, const char *key, const char *value);
+    char *(*search)(void *t, const char *key);  // returns a copy or NULL
+    int   (*contains)(void *t, const char *key);
+    void  (*remove)(void *t, const char *key);
+} table_ops_t;
+
+static void *hasht_create(void) { return new_hash_table(); }
+static void  hasht_destroy(void *t) { free_hash_table(t); }
+static void  hasht_insert(void *t, const char *k, const char *v) { hash_insert(t, k, v); }
+static char *hasht_search(void *t, const char *k) { return hash_search(t, k); }
+static int   hasht_contains(void *t, const char *k) { return hash_contains(t, k); }
+static void  hasht_remove(void *t, const char *k) { hash_remove(t, k); }
+
+static void *shm_create(void) { return shm_table_create(SHM_SIZE, 0); }
+static void  shm_destroy(void *t) { shm_table_free(t); }
+static void  shm_insert(void *t, const char *k, const char *v) { shm_table_insert(t, k, v); }
+static char *shm_search(void *t, const char *k) { return shm_table_search(t, k); }
+static int   shm_contains(void *t, const char *k) { return shm_table_contains(t, k); }
+static void  shm_remove(void *t, const char *k) { shm_table_remove(t, k); }
+
+static const table_ops_t tables[] = {
+    { "hasht", hasht_create, hasht_destroy, hasht_insert,
+      hasht_search, hasht_contains, hasht_remove },
+    { "shm", shm_create, shm_destroy, shm_insert,
+      shm_search, shm_contains, shm_remove },
+};
+
+
+/* Allocation counting, see the -Wl,--wrap flags in the Makefile */
+static uint64_t nallocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+void *__real_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off);
+
+void *__wrap_malloc(size_t size) {
+    nallocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    nallocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    nallocs++;
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s) {
+    nallocs++;
+    return __real_strdup(s);
+}
+
+// Large bucket arrays are mapped directly, see huge_calloc()
+void *__wrap_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off) {
+    void *p = __real_mmap(addr, len, prot, flags, fd, off);
+    if (p != MAP_FAILED)
+        nallocs++;
+    return p;
+}
+
+
+/**
+ * Counters sampled around every timed loop.
+ */
+typedef struct {
+    uint64_t ns;
+    uint64_t misses;
+    uint64_t allocs;
+} sample_t;
+
+static int perf_fd = -1;  // cache miss counter, -1 if unavailable
+
+static void perf_init(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    perf_fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd < 0)
+        fprintf(stderr, "perf_event_open: cache misses not available\n");
+}
+
+static uint64_t perf_read(void) {
+    uint64_t v = 0;
+    if (perf_fd >= 0 && read(perf_fd, &v, sizeof(v)) != sizeof(v))
+        v = 0;
+    return v;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void sample_start(sample_t *s) {
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    s->allocs = nallocs;
+    s->ns = now_ns();
+}
+
+/**
+ * Adds the counters elapsed since sample_start() to acc.
+ */
+static void sample_stop(const sample_t *s, sample_t *acc) {
+    uint64_t ns = now_ns();
+    if (perf_fd >= 0)
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    acc->ns += ns - s->ns;
+    acc->misses += perf_read();
+    acc->allocs += nallocs - s->allocs;
+}
+
+static void report(const char *table, const char *op, size_t size, int keylen,
+                   int hit, uint64_t ops, const sample_t *acc) {
+    char hitstr[16] = "-";
+    if (hit >= 0)
+        snprintf(hitstr, sizeof(hitstr), "%d", hit);
+
+    printf("%-8s %-9s %10zu %6d %5s %10" PRIu64 " %9.1f ",
+           table, op, size, keylen, hitstr, ops, (double) acc->ns / ops);
+    if (perf_fd >= 0)
+        printf("%10.2f ", (double) acc->misses / ops);
+    else
+        printf("%10s ", "-");
+    printf("%9.2f\n", (double) acc->allocs / ops);
+    fflush(stdout);
+}
+
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+/**
+ * xorshift64* pseudo random generator, fixed seed so runs are comparable.
+ */
+static uint64_t rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+/**
+ * Returns an array of n distinct keys of length keylen, stored one after
+ * the other (each with its terminator). Keys of different prefixes never
+ * collide, which is how present and absent keys are told apart.
+ */
+static char *make_keys(size_t n, int keylen, char prefix) {
+    char *keys = malloc(n * (size_t) (keylen + 1));
+    if (keys == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        char *k = keys + i * (size_t) (keylen + 1);
+        memset(k, 'x', (size_t) keylen);
+        k[keylen] = '\0';
+        k[0] = prefix;
+
+        // Index digits at the end, the padding in between
+        size_t v = i;
+        for (int j = keylen - 1; j > 0 && (v > 0 || j == keylen - 1); j--) {
+            k[j] = (char) ('0' + v % 10);
+            v /= 10;
+        }
+    }
+
+    return keys;
+}
+
+/**
+ * Runs all the measurements for a table design with the given table
+ * size and key length.
+ */
+static void bench_table(const table_ops_t *ops, size_t size, int keylen,
+                        const int *hits, int nhits) {
+    size_t stride = (size_t) keylen + 1;
+    char *keys = make_keys(size, keylen, 'h');
+
+    // Insert and remove in random order
+    size_t *order = malloc(size * sizeof(size_t));
+    for (size_t i = 0; i < size; i++)
+        order[i] = i;
+    for (size_t i = size - 1; i > 0; i--) {
+        size_t j = rng() % (i + 1);
+        size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    // Lookups: absent keys come from a pool of their own
+    size_t nprobe = (size > MIN_OPS) ? size : MIN_OPS;
+    if (nprobe > MAX_PROBE)
+        nprobe = MAX_PROBE;
+    size_t nmiss = (size < nprobe) ? size : nprobe;
+    char *misses = make_keys(nmiss, keylen, 'm');
+    const char **probes = malloc(nprobe * sizeof(char *));
+
+    // Small tables are built several times to time enough operations
+    int rounds = (int) ((MIN_OPS + size - 1) / size);
+    sample_t ins = {0}, rem = {0}, s;
+
+    for (int r = 0; r < rounds; r++) {
+        void *t = ops->create();
+
+        sample_start(&s);
+        for (size_t i = 0; i < size; i++)
+            ops->insert(t, keys + order[i] * stride, "v");
+        sample_stop(&s, &ins);
+
+        for (int h = 0; r == 0 && h < nhits; h++) {
+            for (size_t i = 0; i < nprobe; i++) {
+                if ((int) (rng() % 100) < hits[h])
+                    probes[i] = keys + (rng() % size) * stride;
+                else
+                    probes[i] = misses + (rng() % nmiss) * stride;
+            }
+
+            sample_t acc = {0};
+            sample_start(&s);
+            for (size_t i = 0; i < nprobe; i++)
+                free(ops->search(t, probes[i]));
+            sample_stop(&s, &acc);
+            report(ops->name, "search", size, keylen, hits[h], nprobe, &acc);
+
+            memset(&acc, 0, sizeof(acc));
+            int found = 0;
+            sample_start(&s);
+            for (size_t i = 0; i < nprobe; i++)
+                found += ops->contains(t, probes[i]);
+            sample_stop(&s, &acc);
+            report(ops->name, "contains", size, keylen, hits[h], nprobe, &acc);
+
+            if (found < 0)  // keeps the loop from being optimized away
+                abort();
+        }
+
+        sample_start(&s);
+        for (size_t i = 0; i < size; i++)
+            ops->remove(t, keys + order[i] * stride);
+        sample_stop(&s, &rem);
+
+        ops->destroy(t);
+    }
+
+    uint64_t n = (uint64_t) rounds * size;
+    report(ops->name, "insert", size, keylen, -1, n, &ins);
+    report(ops->name, "remove", size, keylen, -1, n, &rem);
+
+    free(probes);
+    free(misses);
+    free(order);
+    free(keys);
+}
+
+/**
+ * Parses a comma separated list of at most max integers into out.
+ * Returns the number of integers read.
+ */
+static int parse_list(char *s, int *out, int max) {
+    int n = 0;
+    for (char *tok = strtok(s, ","); tok != NULL && n < max; tok = strtok(NULL, ","))
+        out[n++] = atoi(tok);
+    return n;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -N <n>      largest table size; sizes go from 16 up by x16 (default 1048576)\n"
+        "  -k <l,...>  key lengths (default 16,64)\n"
+        "  -r <h,...>  lookup hit ratios, in percent (default 100,50,0)\n"
+        "  -t <name>   only benchmark the named table design\n"
+        "  -P <mode>   back large bucket arrays with off, thp or hugetlb pages (default off)\n",
+        prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    size_t maxsize = 1 << 20;
+    int keylens[16] = { 16, 64 }, nkeylens = 2;
+    int hits[16] = { 100, 50, 0 }, nhits = 3;
+    const char *only = NULL;
+    huge_mode_t pages = HUGE_PAGES_OFF;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "N:k:r:t:P:")) != -1) {
+        switch (opt) {
+        case 'N': maxsize = strtoul(optarg, NULL, 10); break;
+        case 'k': nkeylens = parse_list(optarg, keylens, 16); break;
+        case 'r': nhits = parse_list(optarg, hits, 16); break;
+        case 't': only = optarg; break;
+        case 'P':
+            if (huge_parse_mode(optarg, &pages) != 0)
+                usage(argv[0]);
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (maxsize < 16 || nkeylens == 0 || nhits == 0)
+        usage(argv[0]);
+    int digits = 1;  // key lengths need room for a prefix and the index
+    for (size_t v = maxsize; v >= 10; v /= 10)
+        digits++;
+    for (int i = 0; i < nkeylens; i++) {
+        if (keylens[i] < digits + 1 || keylens[i] > 4096)
+            usage(argv[0]);
+    }
+
+    init_hash();
+    huge_set_mode(pages);
+    perf_init();
+
+    printf("%-8s %-9s %10s %6s %5s %10s %9s %10s %9s\n", "table", "op", "size",
+           "keylen", "hit%", "ops", "ns/op", "misses/op", "allocs/op");
+
+    for (size_t i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+        if (only != NULL && strcmp(only, tables[i].name) != 0)
+            continue;
+
+        for (int k = 0; k < nkeylens; k++) {
+            size_t size = 16;
+            for (;;) {
+                bench_table(&tables[i], size, keylens[k], hits, nhits);
+                if (size == maxsize)
+                    break;
+                size = (size * 16 > maxsize) ? maxsize : size * 16;
+            }
+        }
+    }
+
+    return 0;
+}
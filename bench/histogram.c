@@ -0,0 +1,143 @@
+#include "histogram.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+
+
+/**
+ * Returns the bucket index holding value v.
+ */
+static int bucket_index(uint64_t v) {
+    if (v < HIST_SUB_COUNT)
+        return (int) v;
+
+    int msb = 63 - __builtin_clzll(v);  // position of the highest set bit
+    int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int) ((v >> shift) - HIST_SUB_COUNT);
+}
+
+/**
+ * Returns the highest value that falls in the bucket with the given
+ * index, which is the value reported for every sample in it.
+ */
+static uint64_t bucket_value(int i) {
+    int group = i >> HIST_SUB_BITS;
+    if (group == 0)
+        return (uint64_t) i;
+
+    int shift = group - 1;
+    uint64_t low = ((uint64_t) (i & (HIST_SUB_COUNT - 1)) + HIST_SUB_COUNT) << shift;
+    return low + ((uint64_t) 1 << shift) - 1;
+}
+
+/**
+ * Resets the histogram to hold no values.
+ */
+void hist_init(hist_t *h) {
+    memset(h, 0, sizeof(hist_t));
+    h->min = UINT64_MAX;
+}
+
+/**
+ * Records a single value into the histogram.
+ */
+void hist_record(hist_t *h, uint64_t v) {
+    h->counts[bucket_index(v)]++;
+    h->total++;
+    if (v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->sum += (double) v;
+    h->sumsq += (double) v * (double) v;
+}
+
+/**
+ * Adds all the values recorded in src to dst.
+ */
+void hist_merge(hist_t *dst, const hist_t *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->sum += src->sum;
+    dst->sumsq += src->sumsq;
+}
+
+/**
+ * Returns the value at percentile p (in the range [0, 100]), that is,
+ * the smallest recorded value such that p percent of the values are
+ * less or equal to it. Returns 0 on an empty histogram.
+ */
+uint64_t hist_percentile(const hist_t *h, double p) {
+    if (h->total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) ceil(p / 100.0 * (double) h->total);
+    if (rank == 0)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = bucket_value(i);
+            return (v > h->max) ? h->max : v;
+        }
+    }
+
+    return h->max;
+}
+
+double hist_mean(const hist_t *h) {
+    return (h->total == 0) ? 0.0 : h->sum / (double) h->total;
+}
+
+double hist_stdev(const hist_t *h) {
+    if (h->total == 0)
+        return 0.0;
+
+    double mean = hist_mean(h);
+    double var = h->sumsq / (double) h->total - mean * mean;
+    return (var > 0.0) ? sqrt(var) : 0.0;
+}
+
+/**
+ * Writes the percentile distribution of the histogram in the text format
+ * of HdrHistogram (.hgrm), which its plotting tools read. Values are
+ * divided by unit, e.g. 1000 to write nanosecond samples in microseconds.
+ */
+void hist_write_percentiles(const hist_t *h, FILE *f, double unit) {
+    fprintf(f, "%12s %14s %10s %14s\n\n",
+            "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+    // Halve the distance to 100% every 5 lines, as HdrHistogram does
+    double p = 0.0;
+    while (h->total > 0) {
+        uint64_t v = hist_percentile(h, p);
+        uint64_t below = 0;
+        for (int i = 0; i < HIST_BUCKETS && bucket_value(i) <= v; i++)
+            below += h->counts[i];
+
+        if (v == h->max || p >= 100.0) {
+            fprintf(f, "%12.3f %14.12f %10" PRIu64 "\n", v / unit, 1.0, h->total);
+            break;
+        }
+        fprintf(f, "%12.3f %14.12f %10" PRIu64 " %14.2f\n",
+                v / unit, p / 100.0, below, 1.0 / (1.0 - p / 100.0));
+
+        int halvings = (int) log2(100.0 / (100.0 - p));
+        p += 100.0 / (5.0 * (double) (2 << halvings));
+    }
+
+    fprintf(f, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n",
+            hist_mean(h) / unit, hist_stdev(h) / unit);
+    fprintf(f, "#[Max     = %12.3f, Total count    = %12" PRIu64 "]\n",
+            h->max / unit, h->total);
+    fprintf(f, "#[Buckets = %12d, SubBuckets     = %12d]\n",
+            HIST_BUCKETS / HIST_SUB_COUNT, HIST_SUB_COUNT);
+}
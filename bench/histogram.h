@@ -0,0 +1,40 @@
+#ifndef _HTTP_HISTOGRAM_H
+#define _HTTP_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Log-linear histogram, in the spirit of HdrHistogram.
+ *
+ * Values below 2^HIST_SUB_BITS get an exact bucket each; above that every
+ * power of two range is split in 2^HIST_SUB_BITS linear sub-buckets, so a
+ * recorded value is reported with a relative error under 1%, for any
+ * magnitude up to 2^64 - 1.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;   // number of recorded values
+    uint64_t min;
+    uint64_t max;
+    double   sum;     // sum of values, for the mean
+    double   sumsq;   // sum of squared values, for the standard deviation
+} hist_t;
+
+
+void hist_init(hist_t *h);
+void hist_record(hist_t *h, uint64_t v);
+void hist_merge(hist_t *dst, const hist_t *src);
+
+uint64_t hist_percentile(const hist_t *h, double p);
+double   hist_mean(const hist_t *h);
+double   hist_stdev(const hist_t *h);
+
+void hist_write_percentiles(const hist_t *h, FILE *f, double unit);
+
+
+#endif  // _HTTP_HISTOGRAM_H
@@ -0,0 +1,770 @@
+/**
+ * HTTP/1.1 load generator used to benchmark http_server.
+ *
+ * Each thread drives its share of the connections from its own epoll
+ * instance. In closed-loop mode every connection keeps a fixed number of
+ * requests in flight (the pipeline depth), sending a new one as soon as a
+ * response completes. In open-loop mode (-R) requests are issued at a
+ * fixed aggregate rate regardless of how fast the server answers.
+ *
+ * Open-loop latency is measured from the time each request was due
+ * according to the schedule, not from when it was actually written. A
+ * stalled server delays the requests queued behind it, and that waiting
+ * shows up in the percentiles instead of being silently omitted
+ * (coordinated omission). Closed-loop latency is measured from the send,
+ * so it hides queueing delays and is only fit for throughput numbers.
+ */
+#include "histogram.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RBUF_SIZE   (64 * 1024)
+#define MAX_EVENTS  256
+#define MAX_REQUEST 4096
+#define RETRY_NS    (10 * 1000000ull)  // delay between connect attempts
+#define LOG_NS      1000000000ull       // length of the intervals logged by -L
+
+/* Connection states */
+#define CONN_CONNECTING 0
+#define CONN_OPEN       1
+
+
+typedef struct thread thread_t;
+
+/**
+ * A single client connection and its in-flight requests.
+ */
+typedef struct {
+    thread_t *t;
+    int fd;
+    int state;
+    uint64_t retry_at;  // when to reconnect after a failed connect
+
+    // Send side. Requests are identical, so pending output is just a
+    // window into the thread's buffer of repeated requests.
+    size_t woff;        // offset of the next byte to write, mod request length
+    size_t wleft;       // bytes queued but not yet written
+
+    // In-flight requests: ring of the times each one was issued, or was
+    // due to be issued when running open-loop.
+    uint64_t *sent_at;
+    int head;
+    int inflight;
+
+    // Open-loop schedule
+    uint64_t next_send;     // time at which the next request is due
+    uint64_t interval;      // time between requests on this connection
+
+    // Receive side
+    char   rbuf[RBUF_SIZE];
+    size_t rlen;
+    int    in_body;         // parsing headers (0) or skipping the body (1)
+    int    body_to_close;   // body is delimited by the connection closing
+    size_t body_left;       // body bytes still to skip
+    int    resp_close;      // server asked to close after this response
+    int    resp_status;
+} conn_t;
+
+/**
+ * Per-thread state. Results are merged by the main thread once all
+ * threads are done, so nothing here is shared while running.
+ */
+struct thread {
+    pthread_t tid;
+    int epfd;
+    conn_t *conns;
+    int nconns;
+
+    char  *wbuf;        // request repeated (depth + 1) times
+    size_t req_len;
+
+    hist_t latency;     // nanoseconds
+    hist_t interval;    // latencies since the last log interval boundary
+    uint64_t interval_end;
+    uint64_t completed;
+    uint64_t pending;   // open-loop requests in flight or overdue at the end
+    uint64_t bytes;
+    uint64_t non2xx;
+    uint64_t err_connect, err_read, err_write, err_parse;
+};
+
+/* Benchmark configuration, set once in main() */
+static struct {
+    int threads;
+    int connections;
+    int duration;       // seconds
+    int depth;          // pipeline depth
+    double rate;        // requests per second in total, 0 for closed-loop
+    int keepalive;
+    const char *host;
+    const char *port;
+    const char *path;
+    const char *header; // optional extra header line
+    const char *log;    // histogram log file, or NULL
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    uint64_t start;
+    uint64_t stop_at;
+} cfg;
+
+/**
+ * Latency histograms of each log interval across all threads, merged
+ * by every thread as it crosses an interval boundary.
+ */
+static hist_t *intervals;
+static int nintervals;
+static pthread_mutex_t intervals_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Starts a non-blocking connect for the given connection and registers
+ * it in the thread epoll instance. Returns 0 on success, -1 on error.
+ */
+static int conn_open(conn_t *c) {
+    c->fd = socket(cfg.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->state = CONN_CONNECTING;
+    c->woff = c->wleft = 0;
+    c->head = c->inflight = 0;
+    c->rlen = 0;
+    c->in_body = c->body_to_close = 0;
+    c->body_left = 0;
+
+    if (connect(c->fd, (struct sockaddr *) &cfg.addr, cfg.addrlen) < 0
+            && errno != EINPROGRESS) {
+        c->t->err_connect++;
+        close(c->fd);
+        c->fd = -1;
+        c->retry_at = now_ns() + RETRY_NS;
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = c };
+    if (epoll_ctl(c->t->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    return 0;
+}
+
+/**
+ * Closes the connection, dropping its in-flight requests, and opens
+ * a new one in its place.
+ */
+static void conn_reopen(conn_t *c) {
+    if (c->fd >= 0)
+        close(c->fd);  // also removes it from the epoll set
+    c->fd = -1;
+    conn_open(c);
+}
+
+/**
+ * Writes as much of the pending output as the socket takes.
+ * Returns 0 on success, -1 if the connection failed.
+ */
+static int conn_flush(conn_t *c) {
+    thread_t *t = c->t;
+
+    while (c->wleft > 0) {
+        ssize_t w = write(c->fd, t->wbuf + c->woff, c->wleft);
+        if (w < 0) {
+            if (errno == EAGAIN)
+                break;
+            t->err_write++;
+            return -1;
+        }
+        c->woff = (c->woff + (size_t) w) % t->req_len;
+        c->wleft -= (size_t) w;
+    }
+
+    // Only ask for writability while there is something left to write
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (c->wleft > 0)
+        ev.events |= EPOLLOUT;
+    epoll_ctl(t->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+
+    return 0;
+}
+
+/**
+ * Queues one request on the connection, stamped with the given issue time.
+ */
+static void conn_queue_request(conn_t *c, uint64_t issued) {
+    int tail = (c->head + c->inflight) % cfg.depth;
+    c->sent_at[tail] = issued;
+    c->inflight++;
+    c->wleft += c->t->req_len;
+}
+
+/**
+ * Accounts for a fully received response.
+ */
+static void conn_complete_response(conn_t *c, uint64_t now) {
+    thread_t *t = c->t;
+
+    hist_record(&t->latency, now - c->sent_at[c->head]);
+    if (intervals != NULL)
+        hist_record(&t->interval, now - c->sent_at[c->head]);
+    c->head = (c->head + 1) % cfg.depth;
+    c->inflight--;
+
+    t->completed++;
+    if (c->resp_status < 200 || c->resp_status > 299)
+        t->non2xx++;
+}
+
+/**
+ * Parses the status line and headers at the start of the read buffer.
+ * Returns the length of the header block, 0 if it is not complete yet,
+ * or -1 on a malformed or unsupported response.
+ */
+static int parse_response_head(conn_t *c) {
+    char *end = NULL;
+    for (size_t i = 3; i < c->rlen; i++) {
+        if (memcmp(c->rbuf + i - 3, "\r\n\r\n", 4) == 0) {
+            end = c->rbuf + i + 1;
+            break;
+        }
+    }
+    if (end == NULL)
+        return (c->rlen == RBUF_SIZE) ? -1 : 0;
+
+    if (c->rlen < 12 || strncmp(c->rbuf, "HTTP/1.", 7) != 0)
+        return -1;
+    c->resp_status = atoi(c->rbuf + 9);
+    c->resp_close = (c->rbuf[7] == '0');  // HTTP/1.0 closes by default
+
+    int has_length = 0;
+    c->body_left = 0;
+
+    // Scan header lines, starting after the status line
+    char *line = (char *) memchr(c->rbuf, '\n', (size_t) (end - c->rbuf)) + 1;
+    while (line < end - 2) {
+        char *eol = memchr(line, '\n', (size_t) (end - line));
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            c->body_left = strtoul(line + 15, NULL, 10);
+            has_length = 1;
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            char *v = line + 11;
+            while (*v == ' ')
+                v++;
+            if (strncasecmp(v, "close", 5) == 0)
+                c->resp_close = 1;
+            else if (strncasecmp(v, "keep-alive", 10) == 0)
+                c->resp_close = 0;
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            return -1;  // chunked bodies are not supported
+        }
+        line = eol + 1;
+    }
+
+    int bodyless = (c->resp_status < 200 || c->resp_status == 204
+                    || c->resp_status == 304);
+    c->body_to_close = !has_length && !bodyless;
+    if (c->body_to_close)
+        c->resp_close = 1;
+
+    return (int) (end - c->rbuf);
+}
+
+/**
+ * Consumes the buffered input, completing as many responses as possible.
+ * Returns 1 if the connection has to be reopened, 0 otherwise.
+ */
+static int conn_process_input(conn_t *c, uint64_t now) {
+    size_t off = 0;
+
+    while (off < c->rlen) {
+        if (!c->in_body) {
+            // Parse the header block from the start of the buffer
+            if (off > 0) {
+                memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+                c->rlen -= off;
+                off = 0;
+            }
+            int n = parse_response_head(c);
+            if (n < 0) {
+                c->t->err_parse++;
+                return 1;
+            }
+            if (n == 0)
+                break;
+            off = (size_t) n;
+            c->in_body = 1;
+        }
+
+        if (c->body_to_close) {  // discard until the server closes
+            off = c->rlen;
+            break;
+        }
+
+        size_t avail = c->rlen - off;
+        size_t skip = (avail < c->body_left) ? avail : c->body_left;
+        off += skip;
+        c->body_left -= skip;
+        if (c->body_left > 0)
+            break;
+
+        // Response complete
+        c->in_body = 0;
+        if (c->inflight == 0) {  // response without a request
+            c->t->err_parse++;
+            return 1;
+        }
+        conn_complete_response(c, now);
+        if (c->resp_close || !cfg.keepalive)
+            return 1;
+        if (cfg.rate == 0)
+            conn_queue_request(c, now);
+    }
+
+    // Keep the unparsed tail at the start of the buffer
+    if (off > 0) {
+        memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+        c->rlen -= off;
+    }
+
+    return 0;
+}
+
+/**
+ * Handles readiness of a connection.
+ */
+static void conn_event(conn_t *c, uint32_t events) {
+    thread_t *t = c->t;
+    uint64_t now = now_ns();
+
+    if (c->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            t->err_connect++;
+            close(c->fd);
+            c->fd = -1;
+            c->retry_at = now + RETRY_NS;
+            return;  // retried from the thread loop
+        }
+        c->state = CONN_OPEN;
+        if (cfg.rate == 0) {  // closed-loop: fill the pipeline
+            for (int i = 0; i < cfg.depth; i++)
+                conn_queue_request(c, now);
+        }
+        if (conn_flush(c) < 0)
+            conn_reopen(c);
+        return;
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        for (;;) {
+            ssize_t r = read(c->fd, c->rbuf + c->rlen, RBUF_SIZE - c->rlen);
+            if (r < 0) {
+                if (errno == EAGAIN)
+                    break;
+                t->err_read++;
+                conn_reopen(c);
+                return;
+            }
+            if (r == 0) {  // closed by the server
+                if (c->in_body && c->body_to_close && c->inflight > 0)
+                    conn_complete_response(c, now);
+                else if (c->inflight > 0)
+                    t->err_read++;
+                conn_reopen(c);
+                return;
+            }
+            t->bytes += (uint64_t) r;
+            c->rlen += (size_t) r;
+            if (conn_process_input(c, now)) {
+                conn_reopen(c);
+                return;
+            }
+        }
+    }
+
+    if (conn_flush(c) < 0)
+        conn_reopen(c);
+}
+
+/**
+ * Issues the open-loop requests that are due, and returns the epoll
+ * timeout (in milliseconds) until the next one.
+ */
+static int issue_scheduled(thread_t *t, uint64_t now) {
+    uint64_t next = cfg.stop_at;
+
+    for (int i = 0; i < t->nconns; i++) {
+        conn_t *c = &t->conns[i];
+        if (c->state != CONN_OPEN)
+            continue;
+
+        // Overdue requests keep the time they were due at
+        int queued = 0;
+        while (c->next_send <= now && c->inflight < cfg.depth) {
+            conn_queue_request(c, c->next_send);
+            c->next_send += c->interval;
+            queued = 1;
+        }
+        if (queued && conn_flush(c) < 0) {
+            conn_reopen(c);
+            continue;
+        }
+        // With the pipeline full, a response has to arrive first
+        if (c->inflight < cfg.depth && c->next_send < next)
+            next = c->next_send;
+    }
+
+    if (next <= now)
+        return 0;
+    return (int) ((next - now + 999999) / 1000000);
+}
+
+/**
+ * Merges the thread latencies of the log interval that ends at
+ * t->interval_end into the shared log, and starts the next one.
+ */
+static void flush_interval(thread_t *t) {
+    int i = (int) ((t->interval_end - cfg.start) / LOG_NS) - 1;
+    if (i >= nintervals)
+        i = nintervals - 1;
+
+    pthread_mutex_lock(&intervals_lock);
+    hist_merge(&intervals[i], &t->interval);
+    pthread_mutex_unlock(&intervals_lock);
+
+    hist_init(&t->interval);
+    t->interval_end += LOG_NS;
+}
+
+static void *thread_main(void *arg) {
+    thread_t *t = (thread_t *) arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (int i = 0; i < t->nconns; i++) {
+        conn_t *c = &t->conns[i];
+        if (cfg.rate > 0) {
+            // Spread the connections evenly over one interval
+            c->interval = (uint64_t) (1e9 * cfg.connections / cfg.rate);
+            c->next_send = cfg.start + c->interval * (uint64_t) i / (uint64_t) t->nconns;
+        }
+        conn_open(c);
+    }
+    t->interval_end = cfg.start + LOG_NS;
+
+    for (;;) {
+        uint64_t now = now_ns();
+        while (intervals != NULL && now >= t->interval_end)
+            flush_interval(t);
+        if (now >= cfg.stop_at)
+            break;
+
+        int timeout = 100;
+        if (cfg.rate > 0) {
+            int due = issue_scheduled(t, now);
+            if (due < timeout)
+                timeout = due;
+        }
+
+        int n = epoll_wait(t->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++)
+            conn_event((conn_t *) events[i].data.ptr, events[i].events);
+
+        // Retry connections that failed to connect
+        now = now_ns();
+        for (int i = 0; i < t->nconns; i++) {
+            if (t->conns[i].fd < 0 && now >= t->conns[i].retry_at)
+                conn_open(&t->conns[i]);
+        }
+    }
+
+    if (intervals != NULL && t->interval.total > 0)
+        flush_interval(t);
+
+    for (int i = 0; i < t->nconns; i++) {
+        conn_t *c = &t->conns[i];
+        if (cfg.rate > 0 && c->fd >= 0) {
+            t->pending += (uint64_t) c->inflight;
+            if (c->next_send < cfg.stop_at)
+                t->pending += (cfg.stop_at - c->next_send) / c->interval + 1;
+        }
+        if (c->fd >= 0)
+            close(c->fd);
+    }
+
+    return NULL;
+}
+
+/**
+ * Splits an URL of the form http://host[:port][/path] into the
+ * configuration. Returns 0 on success, -1 if it is not valid.
+ */
+static int parse_url(char *url) {
+    if (strncmp(url, "http://", 7) != 0)
+        return -1;
+
+    char *host = url + 7;
+    char *slash = strchr(host, '/');
+    cfg.path = "/";
+    if (slash != NULL) {
+        cfg.path = strdup(slash);
+        *slash = '\0';
+    }
+
+    char *colon = strrchr(host, ':');
+    cfg.port = "80";
+    if (colon != NULL) {
+        cfg.port = colon + 1;
+        *colon = '\0';
+    }
+    cfg.host = host;
+
+    return (*cfg.host == '\0') ? -1 : 0;
+}
+
+static void resolve_address(void) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+
+    int err = getaddrinfo(cfg.host, cfg.port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "%s:%s: %s\n", cfg.host, cfg.port, gai_strerror(err));
+        exit(1);
+    }
+    memcpy(&cfg.addr, res->ai_addr, res->ai_addrlen);
+    cfg.addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options] http://host[:port][/path]\n"
+        "  -t <n>   threads (default 1)\n"
+        "  -c <n>   connections, in total (default 10)\n"
+        "  -d <s>   duration in seconds (default 10)\n"
+        "  -p <n>   pipeline depth, requests in flight per connection (default 1)\n"
+        "  -R <r>   open-loop: total request rate per second (default closed-loop)\n"
+        "  -H <h>   extra request header line, e.g. \"Accept: */*\"\n"
+        "  -K       disable keep-alive, one request per connection\n"
+        "  -L <f>   write per-second latency percentiles to <f>, and the full\n"
+        "           percentile distribution in HdrHistogram format to <f>.hgrm\n",
+        prog);
+    exit(1);
+}
+
+/**
+ * Writes the interval log and the percentile distribution of the whole
+ * run. Latencies are written in microseconds.
+ */
+static void write_logs(const hist_t *all) {
+    FILE *f = fopen(cfg.log, "w");
+    if (f == NULL) {
+        perror(cfg.log);
+        exit(1);
+    }
+
+    fprintf(f, "#[Latency log of http_bench, in microseconds, measured from the %s]\n",
+            cfg.rate > 0 ? "intended send time" : "send time");
+    fprintf(f, "\"StartTimestamp\",\"Interval_Length\",\"Count\","
+               "\"P50\",\"P90\",\"P99\",\"P99.9\",\"Max\"\n");
+    for (int i = 0; i < nintervals; i++) {
+        const hist_t *h = &intervals[i];
+        fprintf(f, "%.3f,%.3f,%" PRIu64 ",%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                (double) i * LOG_NS / 1e9, LOG_NS / 1e9, h->total,
+                hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+                hist_percentile(h, 99) / 1e3, hist_percentile(h, 99.9) / 1e3,
+                h->max / 1e3);
+    }
+    fclose(f);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.hgrm", cfg.log);
+    f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    hist_write_percentiles(all, f, 1e3);
+    fclose(f);
+}
+
+static void print_results(thread_t *threads, double elapsed) {
+    hist_t *lat = malloc(sizeof(hist_t));
+    hist_init(lat);
+    uint64_t completed = 0, bytes = 0, non2xx = 0, pending = 0;
+    uint64_t econn = 0, eread = 0, ewrite = 0, eparse = 0;
+
+    for (int i = 0; i < cfg.threads; i++) {
+        thread_t *t = &threads[i];
+        hist_merge(lat, &t->latency);
+        completed += t->completed;
+        bytes += t->bytes;
+        non2xx += t->non2xx;
+        pending += t->pending;
+        econn += t->err_connect;
+        eread += t->err_read;
+        ewrite += t->err_write;
+        eparse += t->err_parse;
+    }
+
+    printf("  Requests:     %" PRIu64 " (%.1f req/s)\n", completed, completed / elapsed);
+    printf("  Transfer:     %.2f MB (%.2f MB/s)\n", bytes / 1e6, bytes / 1e6 / elapsed);
+    printf("  Non-2xx:      %" PRIu64 "\n", non2xx);
+    printf("  Errors:       connect %" PRIu64 ", read %" PRIu64
+           ", write %" PRIu64 ", parse %" PRIu64 "\n",
+           econn, eread, ewrite, eparse);
+    if (cfg.rate > 0) {
+        printf("  Behind:       %" PRIu64 " requests in flight or overdue at the end\n",
+               pending);
+    }
+    printf("\n  Latency (us), from the %s\n", cfg.rate > 0 ? "intended send time" : "send time");
+    printf("    mean %.1f, stdev %.1f, min %.1f, max %.1f\n",
+           hist_mean(lat) / 1e3, hist_stdev(lat) / 1e3,
+           lat->total ? lat->min / 1e3 : 0.0, lat->max / 1e3);
+
+    static const double pcts[] = { 50, 75, 90, 99, 99.9, 99.99, 100 };
+    for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+        printf("    %7.3f%%   %10.1f\n", pcts[i], hist_percentile(lat, pcts[i]) / 1e3);
+
+    if (cfg.log != NULL)
+        write_logs(lat);
+
+    free(lat);
+}
+
+int main(int argc, char *argv[]) {
+    cfg.threads = 1;
+    cfg.connections = 10;
+    cfg.duration = 10;
+    cfg.depth = 1;
+    cfg.keepalive = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:c:d:p:R:H:KL:")) != -1) {
+        switch (opt) {
+        case 't': cfg.threads = atoi(optarg); break;
+        case 'c': cfg.connections = atoi(optarg); break;
+        case 'd': cfg.duration = atoi(optarg); break;
+        case 'p': cfg.depth = atoi(optarg); break;
+        case 'R': cfg.rate = atof(optarg); break;
+        case 'H': cfg.header = optarg; break;
+        case 'K': cfg.keepalive = 0; break;
+        case 'L': cfg.log = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || parse_url(argv[optind]) < 0)
+        usage(argv[0]);
+    if (cfg.threads < 1 || cfg.connections < cfg.threads || cfg.duration < 1
+            || cfg.depth < 1 || cfg.rate < 0)
+        usage(argv[0]);
+    if (!cfg.keepalive)
+        cfg.depth = 1;
+
+    resolve_address();
+
+    // Build the request once; every connection sends copies of it
+    char req[MAX_REQUEST];
+    int req_len = snprintf(req, sizeof(req),
+                           "GET %s HTTP/1.1\r\nHost: %s:%s\r\n%s%s%s\r\n",
+                           cfg.path, cfg.host, cfg.port,
+                           cfg.keepalive ? "" : "Connection: close\r\n",
+                           cfg.header ? cfg.header : "",
+                           cfg.header ? "\r\n" : "");
+    if (req_len < 0 || req_len >= MAX_REQUEST) {
+        fprintf(stderr, "request too long\n");
+        exit(1);
+    }
+
+    thread_t *threads = calloc((size_t) cfg.threads, sizeof(thread_t));
+    for (int i = 0; i < cfg.threads; i++) {
+        thread_t *t = &threads[i];
+        t->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (t->epfd < 0) {
+            perror("epoll_create1");
+            exit(1);
+        }
+
+        t->req_len = (size_t) req_len;
+        t->wbuf = malloc(t->req_len * (size_t) (cfg.depth + 1));
+        for (int d = 0; d <= cfg.depth; d++)
+            memcpy(t->wbuf + t->req_len * (size_t) d, req, t->req_len);
+
+        // Split the connections as evenly as possible
+        t->nconns = cfg.connections / cfg.threads
+                    + (i < cfg.connections % cfg.threads);
+        t->conns = calloc((size_t) t->nconns, sizeof(conn_t));
+        for (int j = 0; j < t->nconns; j++) {
+            t->conns[j].t = t;
+            t->conns[j].fd = -1;
+            t->conns[j].sent_at = calloc((size_t) cfg.depth, sizeof(uint64_t));
+        }
+        hist_init(&t->latency);
+    }
+
+    printf("Running %ds test @ http://%s:%s%s\n", cfg.duration, cfg.host, cfg.port, cfg.path);
+    printf("  %d threads, %d connections, pipeline depth %d, %s",
+           cfg.threads, cfg.connections, cfg.depth,
+           cfg.keepalive ? "keep-alive" : "no keep-alive");
+    if (cfg.rate > 0)
+        printf(", open-loop at %.0f req/s\n\n", cfg.rate);
+    else
+        printf(", closed-loop\n\n");
+
+    if (cfg.log != NULL) {
+        // One more for the responses that complete in the last instants
+        nintervals = (int) ((uint64_t) cfg.duration * 1000000000ull / LOG_NS) + 1;
+        intervals = malloc((size_t) nintervals * sizeof(hist_t));
+        for (int i = 0; i < nintervals; i++)
+            hist_init(&intervals[i]);
+        for (int i = 0; i < cfg.threads; i++)
+            hist_init(&threads[i].interval);
+    }
+
+    cfg.start = now_ns();
+    cfg.stop_at = cfg.start + (uint64_t) cfg.duration * 1000000000ull;
+    for (int i = 0; i < cfg.threads; i++)
+        pthread_create(&threads[i].tid, NULL, thread_main, &threads[i]);
+    for (int i = 0; i < cfg.threads; i++)
+        pthread_join(threads[i].tid, NULL);
+    double elapsed = (now_ns() - cfg.start) / 1e9;
+
+    print_results(threads, elapsed);
+
+    uint64_t completed = 0;
+    for (int i = 0; i < cfg.threads; i++)
+        completed += threads[i].completed;
+
+    return (completed == 0) ? 1 : 0;
+}
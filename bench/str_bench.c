@@ -0,0 +1,181 @@
+/**
+ * Checks and microbenchmarks for the SIMD string kernels.
+ *
+ * Every implementation the CPU supports is first checked against the
+ * scalar one on random strings of every length up to MAX_CHECK_LEN, at
+ * every alignment; any difference aborts. Then each kernel is timed on
+ * strings of a few typical lengths.
+ *
+ * Usage: str_bench [-n iterations]
+ */
+#include "../src/simd.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CHECK_LEN 300
+#define CHECK_ROUNDS  20
+#define BUF_SIZE      4096
+
+static const size_t bench_lens[] = { 8, 16, 32, 64, 256, 1024 };
+#define NLENS (sizeof(bench_lens) / sizeof(bench_lens[0]))
+
+static uint64_t rng_state = 0x2545F4914F6CDD1Dull;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Fills buf with random header-ish bytes, mostly letters so that the
+ * case-insensitive compare and the scanner have work to do.
+ */
+static void fill_random(char *buf, size_t len) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_@[`{";
+    for (size_t i = 0; i < len; i++)
+        buf[i] = alphabet[rng_next() % (sizeof(alphabet) - 1)];
+}
+
+static void fail(const simd_impl_t *impl, const char *kernel, size_t off, size_t len) {
+    fprintf(stderr, "%s %s differs from scalar at offset %zu, length %zu\n",
+            impl->name, kernel, off, len);
+    exit(1);
+}
+
+/**
+ * Checks impl against the scalar implementation.
+ */
+static void check_impl(const simd_impl_t *impl) {
+    const simd_impl_t *ref = &simd_impls[0];
+    static char a[BUF_SIZE], b[BUF_SIZE], x[BUF_SIZE], y[BUF_SIZE];
+
+    for (int round = 0; round < CHECK_ROUNDS; round++) {
+        for (size_t len = 0; len <= MAX_CHECK_LEN; len++) {
+            size_t off = rng_next() % 64;
+            fill_random(a + off, len);
+
+            // Same string with the case of some letters flipped
+            memcpy(b + off, a + off, len);
+            for (size_t i = 0; i < len; i++) {
+                char c = b[off + i];
+                if (((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) && rng_next() % 2)
+                    b[off + i] = c ^ 0x20;
+            }
+            // ...and sometimes one different byte
+            if (len > 0 && rng_next() % 2)
+                b[off + rng_next() % len] ^= 1 << (rng_next() % 8);
+
+            // A delimiter at a random position, or none
+            if (len > 0 && rng_next() % 4 != 0)
+                a[off + rng_next() % len] = ":\r\n"[rng_next() % 3];
+
+            if (impl->hash(a + off, len) != ref->hash(a + off, len))
+                fail(impl, "hash", off, len);
+            if (impl->scan_header(a + off, len) != ref->scan_header(a + off, len))
+                fail(impl, "scan_header", off, len);
+            if (impl->caseeq(a + off, b + off, len) != ref->caseeq(a + off, b + off, len))
+                fail(impl, "caseeq", off, len);
+
+            uint64_t r = rng_next();
+            uint8_t key[4] = { (uint8_t) r, (uint8_t) (r >> 8), (uint8_t) (r >> 16), (uint8_t) (r >> 24) };
+            memcpy(x + off, a + off, len);
+            memcpy(y + off, a + off, len);
+            x[off + len] = y[off + len] = 0;
+            impl->xor_mask(x + off, len, key);
+            ref->xor_mask(y + off, len, key);
+            if (memcmp(x + off, y + off, len + 1) != 0)
+                fail(impl, "xor_mask", off, len);
+        }
+    }
+}
+
+/**
+ * Times one implementation, printing ns per call for every length.
+ */
+static void bench_impl(const simd_impl_t *impl, long iterations) {
+    static char a[BUF_SIZE], b[BUF_SIZE], c[BUF_SIZE];
+    fill_random(a, BUF_SIZE);
+    for (size_t i = 0; i < BUF_SIZE; i++)
+        b[i] = (a[i] >= 'a' && a[i] <= 'z') ? a[i] - 0x20 : a[i];
+
+    for (size_t l = 0; l < NLENS; l++) {
+        size_t len = bench_lens[l];
+        uint64_t sink = 0;
+
+        uint64_t start = now_ns();
+        for (long i = 0; i < iterations; i++)
+            sink += impl->hash(a + (i & 63), len);
+        double hash_ns = (double) (now_ns() - start) / iterations;
+
+        start = now_ns();
+        for (long i = 0; i < iterations; i++)
+            sink += impl->scan_header(a + (i & 63), len);
+        double scan_ns = (double) (now_ns() - start) / iterations;
+
+        start = now_ns();
+        for (long i = 0; i < iterations; i++)
+            sink += impl->caseeq(a + (i & 63), b + (i & 63), len);
+        double caseeq_ns = (double) (now_ns() - start) / iterations;
+
+        static const uint8_t key[4] = { 0x12, 0x34, 0x56, 0x78 };
+        start = now_ns();
+        for (long i = 0; i < iterations; i++)
+            impl->xor_mask(c + (i & 63), len, key);
+        double xor_ns = (double) (now_ns() - start) / iterations;
+
+        printf("%-8s %6zu %10.2f %10.2f %10.2f %10.2f\n", impl->name, len, hash_ns, scan_ns,
+               caseeq_ns, xor_ns);
+        if (sink == 42)  // keeps the calls from being optimized away
+            printf(" ");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = 2000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    init_simd();
+    printf("selected: %s\n", simd->name);
+
+    for (int i = 1; i < simd_nimpls; i++) {
+        if (!simd_supported(&simd_impls[i])) {
+            printf("%s: not supported, skipped\n", simd_impls[i].name);
+            continue;
+        }
+        check_impl(&simd_impls[i]);
+        printf("%s: matches scalar\n", simd_impls[i].name);
+    }
+
+    printf("%-8s %6s %10s %10s %10s %10s\n", "impl", "len", "hash ns", "scan ns", "caseeq ns",
+           "xor ns");
+    for (int i = 0; i < simd_nimpls; i++) {
+        if (simd_supported(&simd_impls[i]))
+            bench_impl(&simd_impls[i], iterations);
+    }
+
+    return 0;
+}
@@ -0,0 +1,263 @@
+/**
+ * Packets and latency per response for the TCP option strategies.
+ *
+ * A client and a server thread exchange request/response pairs over
+ * loopback, one at a time. For every response shape the server writes
+ * the response the way each strategy would, and the data packets it
+ * sent (TCP_INFO's tcpi_data_segs_out) are reported per response, along
+ * with the round trip time.
+ *
+ * Strategies:
+ *   nagle    default options: headers and body in separate writes
+ *   nodelay  TCP_NODELAY on: headers and body in separate writes
+ *   tuned    src/tcp_tune.c: corking for multi-part responses, one
+ *            writev for small ones
+ *
+ * Loopback normally uses a 64KB MSS; -m sets an Ethernet-like one so
+ * the packet counts match a real network.
+ *
+ * Usage: tcp_bench [-n responses] [-m mss]
+ */
+#include "../src/tcp_tune.h"
+
+#include <arpa/inet.h>
+#include <linux/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILE_SIZE (256 * 1024)
+
+typedef enum { NAGLE, NODELAY, TUNED } strategy_t;
+static const char *strategy_names[] = { "nagle", "nodelay", "tuned" };
+
+typedef struct {
+    const char *name;
+    size_t header_len;
+    size_t body_len;
+    int    sendfile;
+} shape_t;
+
+static const shape_t shapes[] = {
+    { "small", 180, 320, 0 },
+    { "medium", 180, 12000, 0 },
+    { "file", 220, FILE_SIZE, 1 },
+};
+#define NSHAPES (sizeof(shapes) / sizeof(shapes[0]))
+
+static char body[FILE_SIZE];
+static char header[512];
+static int file_fd;
+static int mss;
+
+typedef struct {
+    int fd;
+    strategy_t strategy;
+    const shape_t *shape;
+    int n;
+    uint32_t segs;  // data segments sent, filled by the server
+} run_t;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t data_segs_out(int fd) {
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    memset(&ti, 0, sizeof(ti));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) != 0) {
+        perror("getsockopt");
+        exit(1);
+    }
+    return ti.tcpi_data_segs_out;
+}
+
+static void write_all(int fd, const char *p, size_t len) {
+    for (size_t off = 0; off < len;) {
+        ssize_t n = write(fd, p + off, len - off);
+        if (n <= 0) {
+            perror("write");
+            exit(1);
+        }
+        off += (size_t) n;
+    }
+}
+
+static void send_body(int fd, const shape_t *s) {
+    if (s->sendfile) {
+        off_t off = 0;
+        while ((size_t) off < s->body_len) {
+            if (sendfile(fd, file_fd, &off, s->body_len - off) <= 0) {
+                perror("sendfile");
+                exit(1);
+            }
+        }
+    } else {
+        write_all(fd, body, s->body_len);
+    }
+}
+
+/**
+ * Server side: answers every one byte request with a response.
+ */
+static void *server(void *arg) {
+    run_t *r = arg;
+    const shape_t *s = r->shape;
+    tcp_tune_t tune;
+    char req;
+
+    int one = 1;
+    if (r->strategy == NODELAY)
+        setsockopt(r->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    else if (r->strategy == TUNED)
+        tcp_tune_init(&tune, r->fd);
+
+    uint32_t start = data_segs_out(r->fd);
+    for (int i = 0; i < r->n; i++) {
+        if (read(r->fd, &req, 1) != 1) {
+            perror("read");
+            exit(1);
+        }
+
+        if (r->strategy != TUNED) {
+            write_all(r->fd, header, s->header_len);
+            send_body(r->fd, s);
+            continue;
+        }
+
+        tcp_shape_t shape = { s->header_len, s->body_len, s->sendfile };
+        tcp_response_begin(&tune, r->fd, &shape);
+        if (!s->sendfile && s->header_len + s->body_len <= TCP_SMALL_RESPONSE) {
+            struct iovec iov[2] = { { header, s->header_len }, { body, s->body_len } };
+            if (writev(r->fd, iov, 2) != (ssize_t) (s->header_len + s->body_len)) {
+                perror("writev");
+                exit(1);
+            }
+        } else {
+            write_all(r->fd, header, s->header_len);
+            send_body(r->fd, s);
+        }
+        tcp_response_end(&tune, r->fd);
+    }
+    r->segs = data_segs_out(r->fd) - start;
+
+    return NULL;
+}
+
+static int tcp_socket(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    if (mss > 0 && setsockopt(fd, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss)) != 0) {
+        perror("setsockopt TCP_MAXSEG");
+        exit(1);
+    }
+    return fd;
+}
+
+/**
+ * Runs n request/response pairs on a new connection and prints the
+ * results.
+ */
+static void run(strategy_t strategy, const shape_t *s, int n) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t alen = sizeof(addr);
+
+    int lfd = tcp_socket();
+    if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(lfd, 1) != 0
+            || getsockname(lfd, (struct sockaddr *) &addr, &alen) != 0) {
+        perror("listen");
+        exit(1);
+    }
+    int cfd = tcp_socket();
+    if (connect(cfd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        perror("connect");
+        exit(1);
+    }
+    int sfd = accept(lfd, NULL, NULL);
+    if (sfd < 0) {
+        perror("accept");
+        exit(1);
+    }
+    close(lfd);
+
+    run_t r = { sfd, strategy, s, n, 0 };
+    pthread_t th;
+    pthread_create(&th, NULL, server, &r);
+
+    static char buf[FILE_SIZE + 1024];
+    size_t total = s->header_len + s->body_len;
+    uint64_t start = now_ns();
+    for (int i = 0; i < n; i++) {
+        write_all(cfd, "x", 1);
+        for (size_t got = 0; got < total; ) {
+            ssize_t m = read(cfd, buf, sizeof(buf));
+            if (m <= 0) {
+                perror("read");
+                exit(1);
+            }
+            got += m;
+        }
+    }
+    double us = (double) (now_ns() - start) / n / 1000;
+    pthread_join(th, NULL);
+
+    printf("%-8s %-8s %8zu %12.2f %10.1f\n", strategy_names[strategy], s->name, total,
+           (double) r.segs / n, us);
+    close(cfd);
+    close(sfd);
+}
+
+int main(int argc, char *argv[]) {
+    int n = 200;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+        switch (opt) {
+        case 'n': n = atoi(optarg); break;
+        case 'm': mss = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n responses] [-m mss]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n <= 0)
+        n = 1;
+
+    memset(body, 'a', sizeof(body));
+    memset(header, 'h', sizeof(header));
+
+    char path[] = "/tmp/tcp_bench.XXXXXX";
+    file_fd = mkstemp(path);
+    if (file_fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    write_all(file_fd, body, sizeof(body));
+
+    printf("%-8s %-8s %8s %12s %10s\n", "strategy", "shape", "bytes", "packets/resp", "us/resp");
+    for (size_t s = 0; s < NSHAPES; s++) {
+        for (int st = NAGLE; st <= TUNED; st++)
+            run(st, &shapes[s], n);
+    }
+
+    close(file_fd);
+    return 0;
+}
@@ -0,0 +1,590 @@
+#include "access_log.h"
+#include "metrics.h"
+#include "xalloc.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WRITER_IDLE_NS 5000000  // writer sleep when all rings are empty (5ms)
+#define WRITER_POLL_MS 100      // wait for a full pipe or socket log at a time
+
+#define MAX_FORMAT_OPS 64
+#define MAX_LITERALS   1024     // bytes of literal text and header names
+
+/* Format operations */
+#define OP_LITERAL  0
+#define OP_REMOTE   1
+#define OP_TIME     2
+#define OP_REQUEST  3
+#define OP_METHOD   4
+#define OP_TARGET   5
+#define OP_PROTOCOL 6
+#define OP_STATUS   7
+#define OP_BYTES    8
+#define OP_DURATION 9
+#define OP_HEADER   10
+
+/**
+ * A step of a compiled log format. Literal text and header names are
+ * stored in the literals buffer; header names come with their prehash,
+ * so lookups in the request headers do not hash them again.
+ */
+typedef struct {
+    int     op;
+    int     len;      // length of the literal or header name
+    int     off;      // offset of the literal or header name in literals
+    int64_t prehash;  // of the header name
+} format_op_t;
+
+/* The format in use, compiled once by access_log_open() */
+static format_op_t ops[MAX_FORMAT_OPS];
+static int nops;
+static char literals[MAX_LITERALS];
+static int nliterals;
+
+/**
+ * Single producer, single consumer ring of log bytes.
+ *
+ * The worker owning it appends whole lines and publishes them by moving
+ * head; the writer thread consumes from tail. Both indices only grow and
+ * are reduced modulo the ring size on access. They live in different
+ * cache lines so the two sides do not invalidate each other on every entry.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) uint64_t head;  // written by the worker
+    uint64_t tail_cache;                      // worker copy of tail
+    uint64_t dropped;                         // lines not fitting in the ring
+    uint64_t dropped_bytes;
+    _Alignas(CACHE_LINE_SIZE) uint64_t tail;  // written by the writer
+    char buf[ACCESS_LOG_RING_SIZE];
+} ring_t;
+
+static _Thread_local ring_t *local_ring;
+
+static ring_t *rings[ACCESS_LOG_MAX_RINGS];
+static int nrings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int log_fd = -1;
+static int stopping;
+static pthread_t writer;
+
+/* Writer state: a ring whose data was only partly written when writev(2)
+ * failed, to be finished first, and the failures so far */
+static int resume_ring = -1;
+static int failing;
+static uint64_t write_errors;
+
+
+/**
+ * Appends a line to the ring of the calling thread, or counts it as
+ * dropped if there is no room: requests never wait for the disk.
+ */
+static void ring_push(ring_t *r, const char *line, size_t len) {
+    uint64_t head = r->head;
+    if (head + len - r->tail_cache > ACCESS_LOG_RING_SIZE) {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head + len - r->tail_cache > ACCESS_LOG_RING_SIZE) {
+            __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&r->dropped_bytes, r->dropped_bytes + len, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    // Copy, in two pieces if the line wraps around the end
+    size_t off = head & (ACCESS_LOG_RING_SIZE - 1);
+    size_t first = ACCESS_LOG_RING_SIZE - off;
+    if (first > len)
+        first = len;
+    memcpy(r->buf + off, line, first);
+    memcpy(r->buf, line + first, len - first);
+
+    __atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+}
+
+/**
+ * Writes everything published in the rings with as few writev(2) calls
+ * as possible. Returns the number of bytes written.
+ *
+ * If writing fails, or the log is a pipe or socket still full after
+ * WRITER_POLL_MS, the rings keep what was not written, to be retried on
+ * the next call: meanwhile workers drop new lines once their ring is
+ * full, and count them.
+ */
+static size_t drain_rings(void) {
+    struct iovec iov[2 * ACCESS_LOG_MAX_RINGS];
+    int iov_ring[2 * ACCESS_LOG_MAX_RINGS];  // ring of each iovec
+    size_t lens[2 * ACCESS_LOG_MAX_RINGS];   // iovec lengths, as writev moves them
+    uint64_t heads[ACCESS_LOG_MAX_RINGS];
+    int niov = 0;
+    size_t total = 0;
+
+    // The ring left with a partial line goes first, so that lines of
+    // other rings are not written in the middle of it
+    int n = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+    int first_ring = (resume_ring >= 0) ? resume_ring : 0;
+    for (int j = 0; j < n; j++) {
+        int i = (first_ring + j) % n;
+        ring_t *r = rings[i];
+        heads[i] = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        size_t len = heads[i] - r->tail;
+        if (len == 0)
+            continue;
+
+        size_t off = r->tail & (ACCESS_LOG_RING_SIZE - 1);
+        size_t first = ACCESS_LOG_RING_SIZE - off;
+        if (first > len)
+            first = len;
+        iov_ring[niov] = i;
+        iov[niov].iov_base = r->buf + off;
+        iov[niov].iov_len = lens[niov] = first;
+        niov++;
+        if (len > first) {
+            iov_ring[niov] = i;
+            iov[niov].iov_base = r->buf;
+            iov[niov].iov_len = lens[niov] = len - first;
+            niov++;
+        }
+        total += len;
+    }
+    if (total == 0)
+        return 0;
+
+    // Rings only hold whole lines, so lines are never interleaved. At two
+    // iovecs per ring, there are less than the 1024 writev(2) accepts.
+    struct iovec *v = iov;
+    int left = niov;
+    size_t written = 0;
+    while (left > 0) {
+        ssize_t w = writev(log_fd, v, left);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                // The log is a pipe or socket whose reader is behind. Only
+                // wait a little, so that a stalled reader does not keep
+                // the writer from noticing it must stop.
+                struct pollfd pfd = { log_fd, POLLOUT, 0 };
+                if (poll(&pfd, 1, WRITER_POLL_MS) > 0)
+                    continue;
+                break;
+            }
+            __atomic_store_n(&write_errors, write_errors + 1, __ATOMIC_RELAXED);
+            if (!failing)
+                perror("access log: writev");
+            failing = 1;
+            break;
+        }
+        failing = 0;
+        written += (size_t) w;
+
+        // Skip what was written, possibly part of an iovec
+        while (left > 0 && (size_t) w >= v->iov_len) {
+            w -= (ssize_t) v->iov_len;
+            v++;
+            left--;
+        }
+        if (left > 0) {
+            v->iov_base = (char *) v->iov_base + w;
+            v->iov_len -= (size_t) w;
+        }
+    }
+
+    if (left == 0) {
+        // Hand the space back to the workers
+        resume_ring = -1;
+        for (int i = 0; i < n; i++)
+            __atomic_store_n(&rings[i]->tail, heads[i], __ATOMIC_RELEASE);
+        return total;
+    }
+
+    // Only give back what was written. The ring it stopped in may be left
+    // in the middle of a line: it goes first next time.
+    size_t done = written;
+    for (int k = 0; k < niov && written > 0; k++) {
+        size_t len = (written < lens[k]) ? written : lens[k];
+        ring_t *r = rings[iov_ring[k]];
+        __atomic_store_n(&r->tail, r->tail + len, __ATOMIC_RELEASE);
+        written -= len;
+        resume_ring = iov_ring[k];
+    }
+    return done;
+}
+
+/**
+ * Appends the given operation to the compiled format, with its text
+ * if any. Returns -1 if the format is too long.
+ */
+static int add_op(int op, const char *text, int len) {
+    if (nliterals + len > MAX_LITERALS)
+        return -1;
+
+    // Consecutive literals are merged into a single copy
+    if (op == OP_LITERAL && nops > 0 && ops[nops - 1].op == OP_LITERAL) {
+        memcpy(literals + nliterals, text, (size_t) len);
+        nliterals += len;
+        ops[nops - 1].len += len;
+        return 0;
+    }
+
+    if (nops == MAX_FORMAT_OPS)
+        return -1;
+    format_op_t *o = &ops[nops++];
+    o->op = op;
+    o->len = len;
+    o->off = nliterals;
+    o->prehash = 0;
+    if (len > 0) {
+        memcpy(literals + nliterals, text, (size_t) len);
+        nliterals += len;
+    }
+
+    return 0;
+}
+
+/**
+ * Compiles the log format string into ops. Returns 0 on success, or -1
+ * if the format is not valid.
+ */
+static int compile_format(const char *fmt) {
+    nops = nliterals = 0;
+
+    for (const char *c = fmt; *c != '\0'; c++) {
+        if (*c != '%') {
+            if (add_op(OP_LITERAL, c, 1) < 0)
+                return -1;
+            continue;
+        }
+
+        c++;
+        int op;
+        switch (*c) {
+        case '%':
+            if (add_op(OP_LITERAL, c, 1) < 0)
+                return -1;
+            continue;
+        case 'h': op = OP_REMOTE; break;
+        case 't': op = OP_TIME; break;
+        case 'r': op = OP_REQUEST; break;
+        case 'm': op = OP_METHOD; break;
+        case 'U': op = OP_TARGET; break;
+        case 'H': op = OP_PROTOCOL; break;
+        case 's': op = OP_STATUS; break;
+        case 'b': op = OP_BYTES; break;
+        case 'D': op = OP_DURATION; break;
+        case '{': {
+            const char *end = strchr(c, '}');
+            if (end == NULL || end[1] != 'i' || end == c + 1)
+                return -1;
+
+            // Header names are case insensitive: keep them in lower case
+            char name[256];
+            int len = (int) (end - c - 1);
+            if (len >= (int) sizeof(name))
+                return -1;
+            for (int i = 0; i < len; i++)
+                name[i] = (char) tolower((unsigned char) c[1 + i]);
+            name[len] = '\0';
+
+            if (add_op(OP_HEADER, name, len + 1) < 0)  // with the terminator
+                return -1;
+            ops[nops - 1].len = len;
+            ops[nops - 1].prehash = hash_prehash(name);
+            c = end + 1;
+            continue;
+        }
+        default:
+            return -1;
+        }
+        if (add_op(op, NULL, 0) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Counts the lines left in the rings as dropped, and empties the rings.
+ * For when the log cannot take them on closing. Workers no longer log
+ * then, so their counters can be updated from here.
+ */
+static void drop_unwritten(void) {
+    int n = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        ring_t *r = rings[i];
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t lines = 0;
+        for (uint64_t p = r->tail; p < head; p++)
+            lines += r->buf[p & (ACCESS_LOG_RING_SIZE - 1)] == '\n';
+
+        __atomic_store_n(&r->dropped, r->dropped + lines, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->dropped_bytes, r->dropped_bytes + (head - r->tail), __ATOMIC_RELAXED);
+        __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+    }
+    resume_ring = -1;
+}
+
+static void *writer_main(void *arg) {
+    (void) arg;
+    struct timespec idle = { 0, WRITER_IDLE_NS };
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        if (drain_rings() == 0)
+            nanosleep(&idle, NULL);
+    }
+    // Write what is left for as long as the log takes it
+    while (drain_rings() > 0)
+        ;
+    drop_unwritten();
+
+    return NULL;
+}
+
+/**
+ * Opens the access log file, appending to it, and starts the thread
+ * writing to it. Lines are written in the given format, or in
+ * ACCESS_LOG_DEFAULT_FORMAT if it is NULL. Returns 0 on success, -1 on
+ * error.
+ */
+int access_log_open(const char *path, const char *format) {
+    if (format == NULL)
+        format = ACCESS_LOG_DEFAULT_FORMAT;
+    if (compile_format(format) < 0) {
+        fprintf(stderr, "access log: invalid format: %s\n", format);
+        return -1;
+    }
+
+    log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (log_fd < 0) {
+        perror(path);
+        return -1;
+    }
+    // A pipe or socket whose reader stalls then makes writes fail with
+    // EAGAIN rather than block the writer, see drain_rings()
+    fcntl(log_fd, F_SETFL, fcntl(log_fd, F_GETFL) | O_NONBLOCK);
+
+    stopping = 0;
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        perror("pthread_create");
+        close(log_fd);
+        log_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes out the pending lines and closes the access log. Workers must
+ * not log anymore when it is called. Lines a stalled pipe or socket does
+ * not take within WRITER_POLL_MS are counted as dropped.
+ */
+void access_log_close(void) {
+    if (log_fd < 0)
+        return;
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+    close(log_fd);
+    log_fd = -1;
+}
+
+/**
+ * Creates the ring of the calling thread. Must be called once by every
+ * thread logging requests.
+ */
+void access_log_register_thread(void) {
+    ring_t *r = (ring_t *) xcalloc(1, sizeof(ring_t));
+
+    pthread_mutex_lock(&rings_lock);
+    if (nrings == ACCESS_LOG_MAX_RINGS) {
+        pthread_mutex_unlock(&rings_lock);
+        fatal("access log: more than %d threads", ACCESS_LOG_MAX_RINGS);
+    }
+    rings[nrings] = r;
+    __atomic_store_n(&nrings, nrings + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rings_lock);
+
+    local_ring = r;
+}
+
+/**
+ * Returns the current time formatted for the log, as [10/Oct/2000:13:55:36 +0000].
+ * Formatting is redone only when the second changes.
+ */
+static const char *log_time(void) {
+    static _Thread_local time_t last;
+    static _Thread_local char str[40];
+
+    time_t now = time(NULL);
+    if (now != last) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(str, sizeof(str), "[%d/%b/%Y:%H:%M:%S +0000]", &tm);
+        last = now;
+    }
+
+    return str;
+}
+
+/**
+ * Copies len bytes of src at p, as many as fit before end.
+ * Returns the position following the copy.
+ */
+static char *put(char *p, char *end, const char *src, size_t len) {
+    if (len > (size_t) (end - p))
+        len = (size_t) (end - p);
+    memcpy(p, src, len);
+    return p + len;
+}
+
+static char *put_str(char *p, char *end, const char *s) {
+    return put(p, end, s, strlen(s));
+}
+
+/**
+ * Copies the string s, which comes from the request, escaping quotes,
+ * backslashes and control characters as \", \\ and \xHH, so it cannot
+ * end a field or forge a line. Escapes are never cut at end.
+ */
+static char *put_escaped(char *p, char *end, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char) *s;
+        if (c >= 0x20 && c != 0x7f && c != '"' && c != '\\') {
+            if (p == end)
+                break;
+            *p++ = (char) c;
+        } else if (c == '"' || c == '\\') {
+            if (end - p < 2)
+                break;
+            *p++ = '\\';
+            *p++ = (char) c;
+        } else {
+            if (end - p < 4)
+                break;
+            *p++ = '\\';
+            *p++ = 'x';
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 15];
+        }
+    }
+    return p;
+}
+
+static char *put_uint(char *p, char *end, uint64_t v) {
+    char digits[20];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    return put(p, end, digits + i, sizeof(digits) - (size_t) i);
+}
+
+/**
+ * Logs a served request in the configured format. The line is handed
+ * to the writer thread; it is dropped, and counted, if the thread ring
+ * is full.
+ */
+void access_log_request(const access_entry_t *e) {
+    if (log_fd < 0 || local_ring == NULL)
+        return;
+
+    char line[ACCESS_LOG_MAX_LINE];
+    char *p = line;
+    char *end = line + sizeof(line) - 1;  // room for the newline
+
+    for (int i = 0; i < nops; i++) {
+        const format_op_t *o = &ops[i];
+        switch (o->op) {
+        case OP_LITERAL:
+            p = put(p, end, literals + o->off, (size_t) o->len);
+            break;
+        case OP_REMOTE:
+            p = put_escaped(p, end, e->remote_addr);
+            break;
+        case OP_TIME:
+            p = put_str(p, end, log_time());
+            break;
+        case OP_REQUEST:
+            p = put_escaped(p, end, e->method);
+            p = put(p, end, " ", 1);
+            p = put_escaped(p, end, e->target);
+            p = put(p, end, " ", 1);
+            p = put_escaped(p, end, e->protocol);
+            break;
+        case OP_METHOD:
+            p = put_escaped(p, end, e->method);
+            break;
+        case OP_TARGET:
+            p = put_escaped(p, end, e->target);
+            break;
+        case OP_PROTOCOL:
+            p = put_escaped(p, end, e->protocol);
+            break;
+        case OP_STATUS:
+            p = put_uint(p, end, (uint64_t) e->status);
+            break;
+        case OP_BYTES:
+            if (e->bytes_sent == 0)
+                p = put(p, end, "-", 1);
+            else
+                p = put_uint(p, end, e->bytes_sent);
+            break;
+        case OP_DURATION:
+            p = put_uint(p, end, e->duration_us);
+            break;
+        case OP_HEADER: {
+            const char *v = NULL;
+            if (e->headers != NULL)
+                v = hash_get_prehashed(e->headers, literals + o->off, o->prehash);
+            p = put_escaped(p, end, (v != NULL) ? v : "-");
+            break;
+        }
+        }
+    }
+    *p++ = '\n';
+
+    ring_push(local_ring, line, (size_t) (p - line));
+}
+
+/**
+ * Returns the number of lines dropped so far because a ring was full.
+ */
+uint64_t access_log_dropped(void) {
+    uint64_t sum = 0;
+    int n = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++)
+        sum += __atomic_load_n(&rings[i]->dropped, __ATOMIC_RELAXED);
+    return sum;
+}
+
+/**
+ * Returns the size of the lines dropped so far, in bytes.
+ */
+uint64_t access_log_dropped_bytes(void) {
+    uint64_t sum = 0;
+    int n = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++)
+        sum += __atomic_load_n(&rings[i]->dropped_bytes, __ATOMIC_RELAXED);
+    return sum;
+}
+
+/**
+ * Returns the number of failed writes to the log file. Their data stays
+ * in the rings until a write succeeds.
+ */
+uint64_t access_log_write_errors(void) {
+    return __atomic_load_n(&write_errors, __ATOMIC_RELAXED);
+}
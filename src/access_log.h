@@ -0,0 +1,52 @@
+#ifndef _HTTP_ACCESS_LOG_H
+#define _HTTP_ACCESS_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash_table.h"
+
+#define ACCESS_LOG_RING_SIZE (256 * 1024)  // bytes buffered per thread, power of 2
+#define ACCESS_LOG_MAX_LINE  2048
+#define ACCESS_LOG_MAX_RINGS 256
+
+/**
+ * Log line format. Directives, as in Apache's mod_log_config:
+ *   %h  remote address        %t  time, [10/Oct/2000:13:55:36 +0000]
+ *   %r  request line          %m  method
+ *   %U  request target        %H  protocol
+ *   %s  status                %b  bytes sent, '-' for none
+ *   %D  time taken, in us     %{Name}i  request header Name
+ *   %%  a literal %
+ * Values from the request have quotes, backslashes and control characters
+ * escaped, as \", \\ and \xHH.
+ * The default is the Common Log Format, followed by the time taken.
+ */
+#define ACCESS_LOG_DEFAULT_FORMAT "%h - - %t \"%r\" %s %b %D"
+
+/**
+ * What gets logged about a served request.
+ */
+typedef struct {
+    const char *remote_addr;
+    const char *method;
+    const char *target;
+    const char *protocol;
+    int         status;
+    size_t      bytes_sent;
+    uint64_t    duration_us;
+    hasht_t    *headers;      // request headers, names in lower case
+} access_entry_t;
+
+
+int  access_log_open(const char *path, const char *format);
+void access_log_close(void);
+
+void     access_log_register_thread(void);
+void     access_log_request(const access_entry_t *e);
+uint64_t access_log_dropped(void);
+uint64_t access_log_dropped_bytes(void);
+uint64_t access_log_write_errors(void);
+
+
+#endif  // _HTTP_ACCESS_LOG_H
@@ -0,0 +1,79 @@
+#include "base64.h"
+
+static const char alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * Encodes len bytes from src in base64 (RFC 4648) with padding into dst,
+ * which must hold BASE64_LEN(len) + 1 bytes. Returns the length written,
+ * not counting the null terminator.
+ */
+size_t base64_encode(const unsigned char *src, size_t len, char *dst) {
+    size_t o = 0, i = 0;
+
+    for (; i + 3 <= len; i += 3) {
+        unsigned v = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+        dst[o++] = alphabet[(v >> 18) & 63];
+        dst[o++] = alphabet[(v >> 12) & 63];
+        dst[o++] = alphabet[(v >> 6) & 63];
+        dst[o++] = alphabet[v & 63];
+    }
+
+    if (i < len) {
+        unsigned v = src[i] << 16;
+        if (i + 1 < len)
+            v |= src[i + 1] << 8;
+        dst[o++] = alphabet[(v >> 18) & 63];
+        dst[o++] = alphabet[(v >> 12) & 63];
+        dst[o++] = (i + 1 < len) ? alphabet[(v >> 6) & 63] : '=';
+        dst[o++] = '=';
+    }
+
+    dst[o] = '\0';
+    return o;
+}
+
+static int url_value(char c) {
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '-')
+        return 62;
+    if (c == '_')
+        return 63;
+    return -1;
+}
+
+/**
+ * Decodes len characters of base64url (RFC 4648 section 5) from src into
+ * dst, which must hold len * 3 / 4 bytes. Trailing padding is optional.
+ * Returns the length decoded, or -1 if src is not valid base64url,
+ * including when the bits left over by the last character are not zero
+ * (RFC 4648 section 3.5), as then other strings decode the same.
+ */
+int base64url_decode(const char *src, size_t len, unsigned char *dst) {
+    while (len > 0 && src[len - 1] == '=')
+        len--;
+    if (len % 4 == 1)
+        return -1;
+
+    int o = 0, bits = 0;
+    unsigned v = 0;
+    for (size_t i = 0; i < len; i++) {
+        int c = url_value(src[i]);
+        if (c < 0)
+            return -1;
+        v = (v << 6) | (unsigned) c;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            dst[o++] = (unsigned char) (v >> bits);
+        }
+    }
+    if ((v & ((1u << bits) - 1)) != 0)
+        return -1;
+    return o;
+}
@@ -0,0 +1,13 @@
+#ifndef _HTTP_BASE64_H
+#define _HTTP_BASE64_H
+
+#include <stddef.h>
+
+/* Length of the encoding of n bytes, without the null terminator */
+#define BASE64_LEN(n) (((n) + 2) / 3 * 4)
+
+size_t base64_encode(const unsigned char *src, size_t len, char *dst);
+int    base64url_decode(const char *src, size_t len, unsigned char *dst);
+
+
+#endif  // _HTTP_BASE64_H
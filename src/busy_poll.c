@@ -0,0 +1,87 @@
+#include "busy_poll.h"
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Initializes bp with the given spin budget and socket busy poll time,
+ * both in microseconds.
+ */
+void busy_poll_init(busy_poll_t *bp, int budget_us, int sock_us) {
+    bp->budget_us = (budget_us > 0) ? budget_us : 0;
+    bp->sock_us = (sock_us > 0) ? sock_us : 0;
+    bp->polls = bp->hits = bp->sleeps = 0;
+}
+
+/**
+ * Waits for events on epfd like epoll_wait(2), but spins on it with a
+ * zero timeout for up to bp->budget_us first. The budget starts over on
+ * every call, so a worker that keeps finding work never sleeps.
+ *
+ * The spin counts against timeout_ms, so the call returns by the
+ * caller's deadline (to the millisecond epoll_wait() works with); a zero
+ * timeout_ms is a single poll.
+ */
+int busy_poll_wait(busy_poll_t *bp, int epfd, struct epoll_event *events,
+                   int maxevents, int timeout_ms) {
+    if (timeout_ms == 0) {
+        int n = epoll_wait(epfd, events, maxevents, 0);
+        bp->polls++;
+        if (n > 0)
+            bp->hits++;
+        return n;
+    }
+    if (bp->budget_us == 0) {
+        bp->sleeps++;
+        return epoll_wait(epfd, events, maxevents, timeout_ms);
+    }
+
+    uint64_t timeout_us = (uint64_t) timeout_ms * 1000;  // unused if negative
+    uint64_t spin_us = bp->budget_us;
+    if (timeout_ms > 0 && spin_us > timeout_us)
+        spin_us = timeout_us;
+
+    uint64_t start = now_us(), elapsed;
+    do {
+        int n = epoll_wait(epfd, events, maxevents, 0);
+        bp->polls++;
+        if (n != 0) {
+            if (n > 0)
+                bp->hits++;
+            return n;
+        }
+        elapsed = now_us() - start;
+    } while (elapsed < spin_us);
+
+    // Sleep only for what is left of the timeout
+    if (timeout_ms > 0) {
+        if (elapsed >= timeout_us)
+            return 0;
+        timeout_ms = (int) ((timeout_us - elapsed + 999) / 1000);
+    }
+    bp->sleeps++;
+    return epoll_wait(epfd, events, maxevents, timeout_ms);
+}
+
+/**
+ * Sets SO_BUSY_POLL on a newly accepted socket, if configured. Returns
+ * 0 on success or when disabled, -1 with errno set otherwise; the
+ * socket works either way.
+ */
+int busy_poll_socket(const busy_poll_t *bp, int fd) {
+    if (bp->sock_us == 0)
+        return 0;
+    return setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &bp->sock_us, sizeof(bp->sock_us));
+}
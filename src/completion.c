@@ -0,0 +1,81 @@
+#include "completion.h"
+#include "xalloc.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+/**
+ * Initializes a completion queue. Returns 0 on success, -1 with errno
+ * set if the eventfd cannot be created.
+ */
+int completion_queue_init(completion_queue_t *cq) {
+    cq->head = NULL;
+    cq->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return (cq->efd < 0) ? -1 : 0;
+}
+
+/**
+ * Closes the queue's eventfd. Completions still posted are not run.
+ */
+void completion_queue_close(completion_queue_t *cq) {
+    close(cq->efd);
+    cq->efd = -1;
+}
+
+/**
+ * Posts c to the queue, from any thread. Only the first completion
+ * posted to an empty queue signals the eventfd: the owner drains all
+ * that arrived in the meantime in one go.
+ */
+void completion_post(completion_queue_t *cq, completion_t *c) {
+    completion_t *old = __atomic_load_n(&cq->head, __ATOMIC_RELAXED);
+    do {
+        c->next = old;
+    } while (!__atomic_compare_exchange_n(&cq->head, &old, c, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (old == NULL) {
+        uint64_t one = 1;
+        if (write(cq->efd, &one, sizeof(one)) != sizeof(one))
+            fatal("completion_post: %s", strerror(errno));
+    }
+}
+
+/**
+ * Runs the callbacks of all the posted completions, oldest first. Must
+ * be called by the owner only. Returns the number of completions run.
+ */
+int completion_drain(completion_queue_t *cq) {
+    uint64_t count;
+    // Reset the eventfd before taking the list, so a completion posted
+    // after this signals it again
+    if (read(cq->efd, &count, sizeof(count)) < 0)
+        count = 0;
+
+    completion_t *c = __atomic_exchange_n(&cq->head, NULL, __ATOMIC_ACQUIRE);
+
+    // Reverse the list to run the completions in posting order
+    completion_t *fifo = NULL;
+    while (c != NULL) {
+        completion_t *next = c->next;
+        c->next = fifo;
+        fifo = c;
+        c = next;
+    }
+
+    int n = 0;
+    while (fifo != NULL) {
+        completion_t *next = fifo->next;
+        fifo->fn(fifo);  // may free fifo
+        fifo = next;
+        n++;
+    }
+    return n;
+}
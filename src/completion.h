@@ -0,0 +1,30 @@
+#ifndef _HTTP_COMPLETION_H
+#define _HTTP_COMPLETION_H
+
+/**
+ * Completion queues hand finished work from helper threads back to the
+ * event loop that asked for it.
+ *
+ * Any thread can post to a queue; only its owner drains it. The owner
+ * adds the queue's eventfd to its epoll set and calls completion_drain()
+ * when it becomes readable, which runs the callbacks of the posted
+ * completions on the owner's thread, in the order they were posted.
+ */
+typedef struct completion {
+    struct completion *next;
+    void (*fn)(struct completion *c);  // run by completion_drain()
+} completion_t;
+
+typedef struct {
+    completion_t *head;  // posted completions, newest first
+    int efd;             // readable while completions are waiting
+} completion_queue_t;
+
+
+int  completion_queue_init(completion_queue_t *cq);
+void completion_queue_close(completion_queue_t *cq);
+void completion_post(completion_queue_t *cq, completion_t *c);
+int  completion_drain(completion_queue_t *cq);
+
+
+#endif  // _HTTP_COMPLETION_H
@@ -0,0 +1,318 @@
+#include "coro.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined(__x86_64__) && !defined(CORO_UCONTEXT)
+#define CORO_UCONTEXT 1
+#endif
+
+#ifdef CORO_UCONTEXT
+#include <ucontext.h>
+#endif
+
+#define GUARD_SIZE 4096
+
+struct coro {
+#ifdef CORO_UCONTEXT
+    ucontext_t ctx;
+    ucontext_t caller;
+#else
+    void *sp;         // saved stack pointer of the coroutine
+    void *caller_sp;  // ...and of the thread that resumed it
+#endif
+    coro_fn  fn;
+    void    *arg;
+    char    *stack;   // mapping, guard page included
+    coro_t  *prev;    // coroutine running before the resume, if any
+    int      done;
+
+    int      wait_fd;
+    uint32_t wait_events;
+};
+
+static _Thread_local coro_t *current;
+
+/* Free stacks of the calling thread */
+static _Thread_local char *pool[CORO_POOL_MAX];
+static _Thread_local int   npool;
+
+
+/**
+ * Returns a stack, with a guard page at its lowest address.
+ */
+static char *stack_alloc(void) {
+    if (npool > 0)
+        return pool[--npool];
+
+    char *s = mmap(NULL, GUARD_SIZE + CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (s == MAP_FAILED)
+        return NULL;
+    if (mprotect(s, GUARD_SIZE, PROT_NONE) != 0) {
+        munmap(s, GUARD_SIZE + CORO_STACK_SIZE);
+        return NULL;
+    }
+    return s;
+}
+
+static void stack_free(char *s) {
+    if (npool < CORO_POOL_MAX)
+        pool[npool++] = s;
+    else
+        munmap(s, GUARD_SIZE + CORO_STACK_SIZE);
+}
+
+/**
+ * Runs the coroutine function, then switches back for good.
+ */
+static void coro_main(coro_t *co) {
+    co->fn(co, co->arg);
+    co->done = 1;
+    coro_yield(co);
+
+    // Never resumed once done
+    abort();
+}
+
+
+#ifdef CORO_UCONTEXT
+
+/* makecontext() passes int arguments only */
+static _Thread_local coro_t *starting;
+
+static void ucontext_entry(void) {
+    coro_main(starting);
+}
+
+static int ctx_init(coro_t *co) {
+    if (getcontext(&co->ctx) != 0)
+        return -1;
+    co->ctx.uc_stack.ss_sp = co->stack + GUARD_SIZE;
+    co->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+    co->ctx.uc_link = NULL;
+    makecontext(&co->ctx, ucontext_entry, 0);
+    return 0;
+}
+
+static void switch_in(coro_t *co) {
+    starting = co;
+    swapcontext(&co->caller, &co->ctx);
+}
+
+static void switch_out(coro_t *co) {
+    swapcontext(&co->ctx, &co->caller);
+}
+
+#else
+
+/*
+ * http_coro_switch(void **save_sp, void *load_sp): pushes the callee-saved
+ * registers, saves the stack pointer to *save_sp, switches to load_sp and
+ * pops the registers saved there. A new coroutine starts out with a frame
+ * whose return address is http_coro_entry and whose r12 is the coroutine.
+ */
+__asm__(
+    ".text\n"
+    ".globl http_coro_switch\n"
+    ".hidden http_coro_switch\n"
+    ".type http_coro_switch, @function\n"
+    "http_coro_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size http_coro_switch, .-http_coro_switch\n"
+    "\n"
+    ".globl http_coro_entry\n"
+    ".hidden http_coro_entry\n"
+    ".type http_coro_entry, @function\n"
+    "http_coro_entry:\n"
+    "    movq %r12, %rdi\n"
+    "    call http_coro_main\n"
+    "    ud2\n"
+    ".size http_coro_entry, .-http_coro_entry\n"
+);
+
+void http_coro_switch(void **save_sp, void *load_sp);
+void http_coro_entry(void);
+// Only referenced from the asm above: kept by "used", even under LTO
+void http_coro_main(coro_t *co) __attribute__((used, visibility("hidden")));
+
+void http_coro_main(coro_t *co) {
+    coro_main(co);
+}
+
+static int ctx_init(coro_t *co) {
+    // Aligned to 16 once http_coro_entry is entered by the ret
+    uintptr_t top = ((uintptr_t) (co->stack + GUARD_SIZE + CORO_STACK_SIZE)) & ~(uintptr_t) 15;
+    uintptr_t *frame = (uintptr_t *) top - 7;
+
+    frame[0] = 0;                // r15
+    frame[1] = 0;                // r14
+    frame[2] = 0;                // r13
+    frame[3] = (uintptr_t) co;   // r12
+    frame[4] = 0;                // rbx
+    frame[5] = 0;                // rbp
+    frame[6] = (uintptr_t) http_coro_entry;
+    co->sp = frame;
+    return 0;
+}
+
+static void switch_in(coro_t *co) {
+    http_coro_switch(&co->caller_sp, co->sp);
+}
+
+static void switch_out(coro_t *co) {
+    http_coro_switch(&co->sp, co->caller_sp);
+}
+
+#endif  // CORO_UCONTEXT
+
+
+/**
+ * Returns a new coroutine that will run fn(co, arg) when first resumed,
+ * or NULL if out of memory. It must be freed by calling coro_free().
+ */
+coro_t *coro_new(coro_fn fn, void *arg) {
+    coro_t *co = (coro_t *) calloc(1, sizeof(coro_t));
+    if (co == NULL)
+        return NULL;
+
+    co->stack = stack_alloc();
+    if (co->stack == NULL) {
+        free(co);
+        return NULL;
+    }
+    co->fn = fn;
+    co->arg = arg;
+    co->wait_fd = -1;
+
+    if (ctx_init(co) != 0) {
+        stack_free(co->stack);
+        free(co);
+        return NULL;
+    }
+    return co;
+}
+
+/**
+ * Frees a coroutine that is done, or was never resumed, or is suspended:
+ * in the last case its stack is dropped without unwinding, so anything
+ * the handler allocated on its own must be freed by its owner.
+ */
+void coro_free(coro_t *co) {
+    if (co == NULL)
+        return;
+    stack_free(co->stack);
+    free(co);
+}
+
+/**
+ * Runs co until it yields or returns. Returns 1 if it yielded and can be
+ * resumed again, 0 if it is done.
+ */
+int coro_resume(coro_t *co) {
+    if (co->done)
+        return 0;
+
+    co->prev = current;
+    current = co;
+    switch_in(co);
+    current = co->prev;
+
+    return !co->done;
+}
+
+/**
+ * Suspends the running coroutine co, returning to the coro_resume()
+ * call that ran it.
+ */
+void coro_yield(coro_t *co) {
+    switch_out(co);
+}
+
+/**
+ * Returns the coroutine running on the calling thread, NULL if none.
+ */
+coro_t *coro_current() {
+    return current;
+}
+
+/**
+ * Tells what a suspended coroutine waits for: the fd and epoll events
+ * to arm before resuming it. Returns 0 if it waits on nothing, and
+ * should just be resumed again later (it yielded on its own).
+ */
+int coro_waiting(const coro_t *co, int *fd, uint32_t *events) {
+    if (co->wait_fd < 0)
+        return 0;
+    *fd = co->wait_fd;
+    *events = co->wait_events;
+    return 1;
+}
+
+/**
+ * Yields until the event loop finds fd ready for events (EPOLLIN,
+ * EPOLLOUT). Returns 0.
+ */
+int coro_wait_fd(coro_t *co, int fd, uint32_t events) {
+    co->wait_fd = fd;
+    co->wait_events = events;
+    coro_yield(co);
+    co->wait_fd = -1;
+    co->wait_events = 0;
+    return 0;
+}
+
+/**
+ * Reads up to len bytes from non-blocking fd into buf, yielding while
+ * there is nothing to read. Returns as read(2), never failing with
+ * EAGAIN.
+ */
+ssize_t coro_read(coro_t *co, int fd, void *buf, size_t len) {
+    for (;;) {
+        ssize_t n = read(fd, buf, len);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return n;
+        if (errno != EINTR)
+            coro_wait_fd(co, fd, EPOLLIN);
+    }
+}
+
+/**
+ * Writes all len bytes of buf to non-blocking fd, yielding whenever its
+ * buffer is full. Returns len, or -1 on error with errno set.
+ */
+ssize_t coro_write(coro_t *co, int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    size_t left = len;
+
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n >= 0) {
+            p += n;
+            left -= n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            coro_wait_fd(co, fd, EPOLLOUT);
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return len;
+}
@@ -0,0 +1,44 @@
+#ifndef _HTTP_CORO_H
+#define _HTTP_CORO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CORO_STACK_SIZE (64 * 1024)  // usable stack of each coroutine
+#define CORO_POOL_MAX   1024         // free stacks kept per thread
+
+/**
+ * Stackful coroutines, so handlers can be written as straight-line code
+ * that reads and writes as if blocking, while the event loop keeps
+ * serving other connections.
+ *
+ * The event loop runs a handler with coro_resume(). When an I/O call
+ * such as coro_read() would block, the coroutine records what it waits
+ * for and yields; coro_resume() then returns 1 and the loop arms the fd
+ * given by coro_waiting() in its epoll set, resuming the coroutine once
+ * the fd is ready. coro_resume() returns 0 when the handler is done.
+ *
+ * On x86-64 the context switch saves just the callee-saved registers;
+ * elsewhere, or with CORO_UCONTEXT defined, it uses ucontext(3). Stacks
+ * are mmap(2)ed with a guard page below them, so an overflow faults
+ * rather than corrupting memory, and are pooled per thread.
+ */
+typedef struct coro coro_t;
+
+typedef void (*coro_fn)(coro_t *co, void *arg);
+
+
+coro_t *coro_new(coro_fn fn, void *arg);
+void    coro_free(coro_t *co);
+int     coro_resume(coro_t *co);
+void    coro_yield(coro_t *co);
+coro_t *coro_current(void);
+int     coro_waiting(const coro_t *co, int *fd, uint32_t *events);
+
+ssize_t coro_read(coro_t *co, int fd, void *buf, size_t len);
+ssize_t coro_write(coro_t *co, int fd, const void *buf, size_t len);
+int     coro_wait_fd(coro_t *co, int fd, uint32_t events);
+
+
+#endif  // _HTTP_CORO_H
@@ -0,0 +1,230 @@
+#include "fs_pool.h"
+#include "xalloc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Queue of one pool thread. Requests are submitted to a queue picked per
+ * submitting thread, and threads with nothing to do steal from the
+ * others, so a thread stuck on a slow disk holds up only the request it
+ * is working on.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    fs_req_t *head;
+    fs_req_t *tail;
+} queue_t;
+
+struct fs_pool {
+    int        nthreads;
+    pthread_t  threads[FS_POOL_MAX_THREADS];
+    queue_t    queues[FS_POOL_MAX_THREADS];
+
+    int        pending;  // requests queued, not yet taken by a thread
+    int        nidle;    // threads asleep, or about to be
+    int        stop;
+    unsigned   next_queue;
+    uint64_t   generation;  // tells pools apart, unlike their address
+    pthread_mutex_t idle_lock;
+    pthread_cond_t  idle_cond;
+};
+
+typedef struct {
+    fs_pool_t *pool;
+    int        id;
+} thread_arg_t;
+
+/* Queue of the pool each thread submits to, see fs_pool_submit() */
+static _Thread_local struct {
+    uint64_t generation;  // of the pool
+    int      queue;
+} home;
+
+static uint64_t next_generation = 1;
+
+
+static void queue_push(queue_t *q, fs_req_t *req) {
+    req->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail != NULL)
+        q->tail->next = req;
+    else
+        q->head = req;
+    q->tail = req;
+    pthread_mutex_unlock(&q->lock);
+}
+
+static fs_req_t *queue_pop(queue_t *q) {
+    pthread_mutex_lock(&q->lock);
+    fs_req_t *req = q->head;
+    if (req != NULL) {
+        q->head = req->next;
+        if (q->head == NULL)
+            q->tail = NULL;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return req;
+}
+
+/**
+ * Takes a request from thread id's own queue, or else steals one from
+ * the others, starting with its neighbour. Returns NULL if all are
+ * empty.
+ */
+static fs_req_t *take(fs_pool_t *pool, int id) {
+    for (int i = 0; i < pool->nthreads; i++) {
+        fs_req_t *req = queue_pop(&pool->queues[(id + i) % pool->nthreads]);
+        if (req != NULL) {
+            __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_RELAXED);
+            return req;
+        }
+    }
+    return NULL;
+}
+
+static void run(fs_req_t *req) {
+    errno = 0;
+    switch (req->op) {
+    case FS_OPEN:
+        req->result = open(req->path, req->flags | O_CLOEXEC);
+        break;
+    case FS_STAT:
+        req->result = stat(req->path, &req->st);
+        break;
+    case FS_OPEN_STAT:
+        req->result = open(req->path, req->flags | O_CLOEXEC);
+        if (req->result >= 0 && fstat(req->result, &req->st) != 0) {
+            int err = errno;
+            close(req->result);
+            req->result = -1;
+            errno = err;
+        }
+        break;
+    case FS_PREAD:
+        req->result = pread(req->fd, req->buf, req->len, req->offset);
+        break;
+    case FS_CLOSE:
+        req->result = close(req->fd);
+        break;
+    default:
+        req->result = -1;
+        errno = EINVAL;
+    }
+    req->err = (req->result < 0) ? errno : 0;
+}
+
+static void *pool_thread(void *arg) {
+    thread_arg_t *ta = arg;
+    fs_pool_t *pool = ta->pool;
+    int id = ta->id;
+    free(ta);
+
+    for (;;) {
+        fs_req_t *req = take(pool, id);
+        if (req != NULL) {
+            run(req);
+            completion_post(req->cq, &req->done);
+            continue;
+        }
+
+        // Announce going to sleep, then check pending once more: with
+        // the fence, either this sees a request counted meanwhile or the
+        // submitter sees nidle and signals
+        pthread_mutex_lock(&pool->idle_lock);
+        __atomic_add_fetch(&pool->nidle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool->pending, __ATOMIC_RELAXED) == 0 && !pool->stop)
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        __atomic_sub_fetch(&pool->nidle, 1, __ATOMIC_RELAXED);
+        int stop = pool->stop && __atomic_load_n(&pool->pending, __ATOMIC_RELAXED) == 0;
+        pthread_mutex_unlock(&pool->idle_lock);
+        if (stop)
+            return NULL;
+    }
+}
+
+/**
+ * Returns a new pool of nthreads threads. As they spend their time
+ * blocked on the disk, there can be more of them than CPUs.
+ */
+fs_pool_t *fs_pool_new(int nthreads) {
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > FS_POOL_MAX_THREADS)
+        nthreads = FS_POOL_MAX_THREADS;
+
+    fs_pool_t *pool = (fs_pool_t *) xcalloc(1, sizeof(fs_pool_t));
+    pool->nthreads = nthreads;
+    pool->generation = __atomic_fetch_add(&next_generation, 1, __ATOMIC_RELAXED);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    for (int i = 0; i < nthreads; i++)
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+
+    for (int i = 0; i < nthreads; i++) {
+        thread_arg_t *ta = (thread_arg_t *) xmalloc(sizeof(thread_arg_t));
+        ta->pool = pool;
+        ta->id = i;
+        int err = pthread_create(&pool->threads[i], NULL, pool_thread, ta);
+        if (err != 0)
+            fatal("fs_pool_new: %s", strerror(err));
+    }
+
+    return pool;
+}
+
+/**
+ * Runs the requests already submitted, then stops the threads and frees
+ * the pool.
+ */
+void fs_pool_free(fs_pool_t *pool) {
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+        pthread_mutex_destroy(&pool->queues[i].lock);
+    }
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle_cond);
+    free(pool);
+}
+
+/**
+ * Submits req to the pool. Its completion is posted to req->cq, which
+ * must be set, with req->done.fn set to the callback to run there.
+ *
+ * Each submitting thread keeps to one queue, spreading event loops over
+ * the pool threads; requests waiting behind a slow one get stolen by
+ * idle threads.
+ */
+void fs_pool_submit(fs_pool_t *pool, fs_req_t *req) {
+    // By generation: a new pool allocated at the address of a freed one
+    // may have fewer threads than the queue picked for the freed one
+    if (home.generation != pool->generation) {
+        home.generation = pool->generation;
+        home.queue = __atomic_fetch_add(&pool->next_queue, 1, __ATOMIC_RELAXED) % pool->nthreads;
+    }
+
+    // Counted first, so pending never drops below the queued requests
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_RELAXED);
+    queue_push(&pool->queues[home.queue], req);
+
+    // Only wake a thread if one is asleep: busy ones take the request
+    // when done with theirs
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->nidle, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
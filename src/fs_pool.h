@@ -0,0 +1,55 @@
+#ifndef _HTTP_FS_POOL_H
+#define _HTTP_FS_POOL_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "completion.h"
+
+#define FS_POOL_MAX_THREADS 64
+
+/**
+ * Blocking filesystem operations, run by the pool threads.
+ */
+typedef enum {
+    FS_OPEN,       // open(path, flags), result is the fd
+    FS_STAT,       // stat(path, &st)
+    FS_OPEN_STAT,  // open(path, flags) then fstat() into st, as for a static file
+    FS_PREAD,      // pread(fd, buf, len, offset), result is the bytes read
+    FS_CLOSE,      // close(fd)
+} fs_op_t;
+
+/**
+ * A request to the pool. The caller owns it, and must keep it alive
+ * until done.fn runs, on the thread draining cq, with result and err
+ * filled in.
+ */
+typedef struct fs_req {
+    completion_t        done;  // posted to cq once the operation finished
+    completion_queue_t *cq;
+
+    fs_op_t     op;
+    const char *path;
+    int         flags;
+    int         fd;
+    void       *buf;
+    size_t      len;
+    off_t       offset;
+
+    ssize_t     result;  // as returned by the system call, -1 on error
+    int         err;     // errno on error, 0 otherwise
+    struct stat st;
+
+    struct fs_req *next;  // link in the pool queues
+} fs_req_t;
+
+typedef struct fs_pool fs_pool_t;
+
+
+fs_pool_t *fs_pool_new(int nthreads);
+void       fs_pool_free(fs_pool_t *pool);
+void       fs_pool_submit(fs_pool_t *pool, fs_req_t *req);
+
+
+#endif  // _HTTP_FS_POOL_H
@@ -0,0 +1,843 @@
+#include "h2.h"
+#include "base64.h"
+#include "headers.h"
+#include "xalloc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UPGRADE_RESPONSE \
+    "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"
+
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+}
+
+/**
+ * Returns 1 if buf starts with the client connection preface, 0 if it is
+ * a prefix of it, -1 otherwise: the connection then speaks HTTP/1.1. For
+ * h2c with prior knowledge, before handing the connection over.
+ */
+int h2_preface_match(const char *buf, size_t len) {
+    size_t n = (len < H2_PREFACE_LEN) ? len : H2_PREFACE_LEN;
+    if (memcmp(buf, H2_PREFACE, n) != 0)
+        return -1;
+    return n == H2_PREFACE_LEN;
+}
+
+void h2_parse_frame_header(const uint8_t *p, h2_frame_t *f) {
+    f->len = (uint32_t) p[0] << 16 | (uint32_t) p[1] << 8 | p[2];
+    f->type = p[3];
+    f->flags = p[4];
+    f->stream = get32(p + 5) & H2_MAX_WINDOW;  // reserved bit ignored
+}
+
+void h2_write_frame_header(uint8_t *p, const h2_frame_t *f) {
+    p[0] = (uint8_t) (f->len >> 16);
+    p[1] = (uint8_t) (f->len >> 8);
+    p[2] = (uint8_t) f->len;
+    p[3] = f->type;
+    p[4] = f->flags;
+    put32(p + 5, f->stream);
+}
+
+
+/* Output */
+
+static uint8_t *out_reserve(h2_conn_t *c, size_t n) {
+    if (c->out_len + n > c->out_cap) {
+        size_t cap = (c->out_cap > 0) ? c->out_cap : 4096;
+        while (cap < c->out_len + n)
+            cap *= 2;
+        c->out = (uint8_t *) xrealloc(c->out, cap);
+        c->out_cap = cap;
+    }
+    uint8_t *p = c->out + c->out_len;
+    c->out_len += n;
+    return p;
+}
+
+static void out_frame(h2_conn_t *c, int type, int flags, uint32_t stream,
+                      const void *payload, size_t len) {
+    h2_frame_t f = { (uint32_t) len, (uint8_t) type, (uint8_t) flags, stream };
+    uint8_t *p = out_reserve(c, H2_FRAME_HEADER + len);
+    h2_write_frame_header(p, &f);
+    if (len > 0)
+        memcpy(p + H2_FRAME_HEADER, payload, len);
+}
+
+static void out_window_update(h2_conn_t *c, uint32_t stream, uint32_t inc) {
+    uint8_t p[4];
+    put32(p, inc);
+    out_frame(c, H2_WINDOW_UPDATE, 0, stream, p, 4);
+}
+
+/**
+ * Returns the bytes waiting to be written to the socket, len of them.
+ */
+const uint8_t *h2_conn_output(h2_conn_t *c, size_t *len) {
+    *len = c->out_len;
+    return c->out;
+}
+
+/**
+ * Discards the first n output bytes, once written to the socket.
+ */
+void h2_conn_written(h2_conn_t *c, size_t n) {
+    memmove(c->out, c->out + n, c->out_len - n);
+    c->out_len -= n;
+}
+
+/**
+ * Sends the server preface: our SETTINGS, and a bigger connection
+ * window than the default 64KB so uploads are not throttled by it.
+ */
+static void send_settings(h2_conn_t *c) {
+    if (c->settings_sent)
+        return;
+    c->settings_sent = 1;
+
+    static const struct { uint16_t id; uint32_t value; } settings[] = {
+        { H2_SETTINGS_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS },
+        { H2_SETTINGS_MAX_HEADER_LIST_SIZE, H2_MAX_HEADERS },
+    };
+    uint8_t p[sizeof(settings) / sizeof(settings[0]) * 6];
+    for (size_t i = 0; i < sizeof(settings) / sizeof(settings[0]); i++) {
+        p[6 * i] = (uint8_t) (settings[i].id >> 8);
+        p[6 * i + 1] = (uint8_t) settings[i].id;
+        put32(p + 6 * i + 2, settings[i].value);
+    }
+    out_frame(c, H2_SETTINGS, 0, 0, p, sizeof(p));
+
+    out_window_update(c, 0, H2_CONN_WINDOW - H2_DEFAULT_WINDOW);
+    c->recv_window = H2_CONN_WINDOW;
+}
+
+
+/* Streams */
+
+/* Connection-specific headers, which HTTP/2 forbids (RFC 9113 section
+ * 8.2.2) */
+static const char *const conn_headers[] = {
+    "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade",
+};
+
+static const char *get(hasht_t *headers, const char *name) {
+    return hash_get_prehashed(headers, name, hash_prehash(name));
+}
+
+/**
+ * Returns the content-length declared in headers, -1 if there is none,
+ * or -2 if it is not a number.
+ */
+static int64_t content_length(hasht_t *headers) {
+    const char *v = get(headers, "content-length");
+    if (v == NULL)
+        return -1;
+    if (*v == '\0')
+        return -2;
+
+    int64_t n = 0;
+    for (; *v != '\0'; v++) {
+        if (*v < '0' || *v > '9' || n > (INT64_MAX - 9) / 10)
+            return -2;
+        n = n * 10 + (*v - '0');
+    }
+    return n;
+}
+
+static h2_stream_t *find_stream(h2_conn_t *c, uint32_t id) {
+    for (int i = 0; i < c->nstreams; i++) {
+        if (c->streams[i]->id == id)
+            return c->streams[i];
+    }
+    return NULL;
+}
+
+static h2_stream_t *new_stream(h2_conn_t *c, uint32_t id, hasht_t *headers) {
+    h2_stream_t *s = (h2_stream_t *) xmalloc(sizeof(h2_stream_t));
+    s->id = id;
+    s->remote_done = s->local_done = 0;
+    s->send_window = c->peer_initial_window;
+    s->recv_window = H2_DEFAULT_WINDOW;
+    s->headers = headers;
+    s->content_length = content_length(headers);
+    s->body = NULL;
+    s->body_len = 0;
+    s->resp = NULL;
+    s->resp_off = 0;
+
+    c->streams[c->nstreams++] = s;
+    return s;
+}
+
+static void free_stream(h2_conn_t *c, h2_stream_t *s) {
+    for (int i = 0; i < c->nstreams; i++) {
+        if (c->streams[i] == s) {
+            c->streams[i] = c->streams[--c->nstreams];
+            break;
+        }
+    }
+    free_hash_table(s->headers);
+    c->body_buffered -= s->body_len;
+    free(s->body);
+    if (s->resp != NULL)
+        sbuf_unref(s->resp);
+    free(s);
+}
+
+/**
+ * Resets a stream: RST_STREAM with the error code, and the stream is
+ * forgotten if it was open. The frames the client sent before getting
+ * the reset are then ignored, see was_reset().
+ */
+static void stream_error(h2_conn_t *c, uint32_t id, uint32_t code) {
+    uint8_t p[4];
+    put32(p, code);
+    out_frame(c, H2_RST_STREAM, 0, id, p, 4);
+    c->reset[c->reset_next] = id;
+    c->reset_next = (c->reset_next + 1) % H2_RESET_MEMORY;
+
+    h2_stream_t *s = find_stream(c, id);
+    if (s != NULL)
+        free_stream(c, s);
+}
+
+/**
+ * Returns 1 if we recently reset stream id. Frames may still arrive on
+ * it, sent before the client got the reset: they must be ignored rather
+ * than treated as errors (RFC 9113 section 5.1, "closed").
+ */
+static int was_reset(const h2_conn_t *c, uint32_t id) {
+    for (int i = 0; i < H2_RESET_MEMORY; i++) {
+        if (c->reset[i] == id)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Fails the connection: GOAWAY with the error code. Returns -1, for the
+ * input handlers to return; the caller writes the output and closes.
+ */
+static int conn_error(h2_conn_t *c, uint32_t code) {
+    uint8_t p[8];
+    put32(p, c->last_stream);
+    put32(p + 4, code);
+    out_frame(c, H2_GOAWAY, 0, 0, p, 8);
+    c->goaway = 1;
+    return -1;
+}
+
+/**
+ * Sends as much of the pending response body of s as the flow control
+ * windows allow, freeing the stream once it is all sent.
+ */
+static void send_data(h2_conn_t *c, h2_stream_t *s) {
+    while (s->resp != NULL) {
+        size_t left = s->resp->len - s->resp_off;
+        int64_t n = left;
+        if (n > c->peer_max_frame)
+            n = c->peer_max_frame;
+        if (n > c->send_window)
+            n = c->send_window;
+        if (n > s->send_window)
+            n = s->send_window;
+        if (n <= 0 && left > 0)
+            return;  // resumed by WINDOW_UPDATE
+
+        int last = (size_t) n == left;
+        out_frame(c, H2_DATA, last ? H2_END_STREAM : 0, s->id, s->resp->data + s->resp_off, n);
+        s->resp_off += n;
+        c->send_window -= n;
+        s->send_window -= n;
+
+        if (last) {
+            sbuf_unref(s->resp);
+            s->resp = NULL;
+            s->local_done = 1;
+        }
+    }
+
+    if (s->local_done && s->remote_done)
+        free_stream(c, s);
+}
+
+/**
+ * Resumes the responses blocked on flow control, after the windows grew.
+ */
+static void send_pending(h2_conn_t *c) {
+    // Backwards, as finished streams are replaced by the last one
+    for (int i = c->nstreams - 1; i >= 0 && c->send_window > 0; i--) {
+        if (i < c->nstreams && c->streams[i]->resp != NULL)
+            send_data(c, c->streams[i]);
+    }
+}
+
+/**
+ * Answers request stream id with the given status, headers (a NULL
+ * terminated array of name and value pairs, names in lower case) and
+ * body, which may be NULL; a reference on body is taken until it is all
+ * sent, as flow control allows. Returns -1 if the stream is gone, reset
+ * by the client, or already answered.
+ */
+int h2_respond(h2_conn_t *c, uint32_t id, int status, const char *const *headers,
+               sbuf_t *body) {
+    h2_stream_t *s = find_stream(c, id);
+    if (s == NULL || s->local_done || s->resp != NULL)
+        return -1;
+
+    char st[16];
+    snprintf(st, sizeof(st), "%d", status);
+    size_t size = 6 + HPACK_MAX_ENCODED(sizeof(":status"), strlen(st));
+    for (int i = 0; headers != NULL && headers[i] != NULL; i += 2)
+        size += HPACK_MAX_ENCODED(strlen(headers[i]), strlen(headers[i + 1]));
+
+    uint8_t *block = (uint8_t *) xmalloc(size);
+    size_t len = hpack_encode_update(&c->enc, block);
+    len += hpack_encode(&c->enc, ":status", st, block + len);
+    for (int i = 0; headers != NULL && headers[i] != NULL; i += 2)
+        len += hpack_encode(&c->enc, headers[i], headers[i + 1], block + len);
+
+    // HEADERS, then CONTINUATION frames if the block is too large for one
+    int end_stream = (body == NULL || body->len == 0) ? H2_END_STREAM : 0;
+    size_t off = 0;
+    do {
+        size_t n = len - off;
+        if (n > c->peer_max_frame)
+            n = c->peer_max_frame;
+        int flags = (off + n == len) ? H2_END_HEADERS : 0;
+        if (off == 0)
+            out_frame(c, H2_HEADERS, flags | end_stream, id, block, n);
+        else
+            out_frame(c, H2_CONTINUATION, flags, id, block + off, n);
+        off += n;
+    } while (off < len);
+    free(block);
+
+    if (end_stream) {
+        s->local_done = 1;
+    } else {
+        s->resp = sbuf_ref(body);
+        s->resp_off = 0;
+    }
+    send_data(c, s);
+    return 0;
+}
+
+
+/* Input */
+
+/**
+ * Applies a SETTINGS payload from the client. Returns -1 on error.
+ */
+static int apply_settings(h2_conn_t *c, const uint8_t *p, size_t len) {
+    if (len % 6 != 0)
+        return conn_error(c, H2_FRAME_SIZE_ERROR);
+
+    for (size_t i = 0; i < len; i += 6) {
+        int id = p[i] << 8 | p[i + 1];
+        uint32_t v = get32(p + i + 2);
+
+        switch (id) {
+        case H2_SETTINGS_HEADER_TABLE_SIZE:
+            hpack_set_limit(&c->enc, v);
+            break;
+        case H2_SETTINGS_ENABLE_PUSH:
+            if (v > 1)
+                return conn_error(c, H2_PROTOCOL_ERROR);
+            break;  // never pushing anyway
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+            if (v > H2_MAX_WINDOW)
+                return conn_error(c, H2_FLOW_CONTROL_ERROR);
+            // Applies to the open streams too, possibly going negative
+            int64_t delta = (int64_t) v - c->peer_initial_window;
+            for (int j = 0; j < c->nstreams; j++)
+                c->streams[j]->send_window += delta;
+            c->peer_initial_window = v;
+            break;
+        }
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if (v < H2_FRAME_SIZE || v > 0xFFFFFF)
+                return conn_error(c, H2_PROTOCOL_ERROR);
+            c->peer_max_frame = v;
+            break;
+        default:
+            break;  // unknown settings are ignored
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns 1 if a request is well-formed (RFC 9113 section 8.3.1): it has
+ * the pseudo-headers its method needs and no response or extended
+ * CONNECT ones, and a numeric content-length if any. The decoder already
+ * rejected unknown and repeated pseudo-headers.
+ *
+ * Unless the request comes from an HTTP/1.1 upgrade, whose hop-by-hop
+ * headers h2_conn_upgrade() removes, it must not have connection-specific
+ * headers either, and te may only be "trailers" (section 8.2.2).
+ */
+static int valid_request(hasht_t *headers, int upgrade) {
+    const char *method = get(headers, ":method");
+    const char *path = get(headers, ":path");
+    if (method == NULL || hash_contains(headers, ":status") || hash_contains(headers, ":protocol")
+        || content_length(headers) == -2)
+        return 0;
+
+    if (strcmp(method, "CONNECT") == 0) {
+        // Tunnels only name their target, in :authority (section 8.5)
+        if (!hash_contains(headers, ":authority") || path != NULL
+            || hash_contains(headers, ":scheme"))
+            return 0;
+    } else if (path == NULL || *path == '\0' || (!upgrade && !hash_contains(headers, ":scheme"))) {
+        return 0;
+    }
+    if (upgrade)
+        return 1;
+
+    for (size_t i = 0; i < sizeof(conn_headers) / sizeof(conn_headers[0]); i++) {
+        if (hash_contains(headers, conn_headers[i]))
+            return 0;
+    }
+    const char *te = get(headers, "te");
+    return te == NULL || strcmp(te, "trailers") == 0;
+}
+
+/**
+ * Ends the request of s, once END_STREAM was received: passes it on,
+ * unless its body does not have the declared length, which makes it
+ * malformed (RFC 9113 section 8.1.1).
+ */
+static void end_request(h2_conn_t *c, h2_stream_t *s) {
+    if (s->content_length >= 0 && (uint64_t) s->content_length != s->body_len) {
+        stream_error(c, s->id, H2_PROTOCOL_ERROR);
+        return;
+    }
+    s->remote_done = 1;
+    c->on_request(c, s, c->arg);
+}
+
+/**
+ * Handles a complete header block: a new request, or trailers.
+ */
+static int on_header_block(h2_conn_t *c, uint32_t id, const uint8_t *block, size_t len,
+                           int end_stream) {
+    hasht_t *headers = new_hash_table();
+    int r = hpack_decode(&c->dec, block, len, headers, H2_MAX_HEADERS);
+    if (r == -1) {
+        free_hash_table(headers);
+        return conn_error(c, H2_COMPRESSION_ERROR);
+    }
+
+    h2_stream_t *s = find_stream(c, id);
+    if (s != NULL) {
+        // Trailers: they must end the request; they are not kept
+        free_hash_table(headers);
+        if (s->remote_done) {
+            stream_error(c, id, H2_STREAM_CLOSED);
+        } else if (!end_stream || r != 0) {
+            stream_error(c, id, H2_PROTOCOL_ERROR);
+        } else {
+            end_request(c, s);
+        }
+        return 0;
+    }
+
+    // Closed stream, reset by us: the block was still decoded above, to
+    // keep the HPACK table in sync
+    if (id % 2 == 1 && id <= c->last_stream && was_reset(c, id)) {
+        free_hash_table(headers);
+        return 0;
+    }
+
+    // New stream: client ids are odd and increasing
+    if (id % 2 == 0 || id <= c->last_stream) {
+        free_hash_table(headers);
+        return conn_error(c, (id % 2 == 0) ? H2_PROTOCOL_ERROR : H2_STREAM_CLOSED);
+    }
+    c->last_stream = id;
+
+    if (c->goaway) {
+        free_hash_table(headers);
+        return 0;
+    }
+    if (r != 0 || !valid_request(headers, 0)) {
+        free_hash_table(headers);
+        stream_error(c, id, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+    if (c->nstreams == H2_MAX_STREAMS) {
+        free_hash_table(headers);
+        stream_error(c, id, H2_REFUSED_STREAM);
+        return 0;
+    }
+
+    s = new_stream(c, id, headers);
+    if (end_stream)
+        end_request(c, s);
+    return 0;
+}
+
+/**
+ * Strips the padding of a DATA or HEADERS payload. Returns -1 if the
+ * padding is longer than the payload.
+ */
+static int unpad(const h2_frame_t *f, const uint8_t **p, size_t *len) {
+    if (!(f->flags & H2_PADDED))
+        return 0;
+    if (*len < 1 || (size_t) (*p)[0] >= *len)
+        return -1;
+    *len -= 1 + (*p)[0];
+    *p += 1;
+    return 0;
+}
+
+/**
+ * Adds the DATA payload p, len bytes, to the body of stream id, and
+ * grows its receive window back once the client used half of it. The
+ * window never exceeds the body the stream may still buffer.
+ */
+static void stream_data(h2_conn_t *c, const h2_frame_t *f, const uint8_t *p, size_t len) {
+    h2_stream_t *s = find_stream(c, f->stream);
+    if (s == NULL) {
+        if (!was_reset(c, f->stream))
+            stream_error(c, f->stream, H2_STREAM_CLOSED);
+        return;
+    }
+    if (s->remote_done) {
+        stream_error(c, f->stream, H2_STREAM_CLOSED);
+        return;
+    }
+
+    s->recv_window -= f->len;
+    if (s->recv_window < 0) {
+        stream_error(c, f->stream, H2_FLOW_CONTROL_ERROR);
+        return;
+    }
+    if (s->content_length >= 0 && s->body_len + len > (uint64_t) s->content_length) {
+        stream_error(c, f->stream, H2_PROTOCOL_ERROR);  // more than declared
+        return;
+    }
+    if (s->body_len + len > H2_MAX_BODY || c->body_buffered + len > H2_MAX_CONN_BODY) {
+        stream_error(c, f->stream, H2_REFUSED_STREAM);
+        return;
+    }
+    if (len > 0) {
+        s->body = (char *) xrealloc(s->body, s->body_len + len);
+        memcpy(s->body + s->body_len, p, len);
+        s->body_len += len;
+        c->body_buffered += len;
+    }
+
+    if (f->flags & H2_END_STREAM) {
+        end_request(c, s);
+        return;
+    }
+    int64_t window = H2_MAX_BODY - s->body_len;
+    if (window > H2_DEFAULT_WINDOW)
+        window = H2_DEFAULT_WINDOW;
+    if (s->recv_window < window / 2) {
+        out_window_update(c, s->id, (uint32_t) (window - s->recv_window));
+        s->recv_window = window;
+    }
+}
+
+static int on_data(h2_conn_t *c, const h2_frame_t *f, const uint8_t *p) {
+    if (f->stream == 0 || f->stream > c->last_stream)
+        return conn_error(c, H2_PROTOCOL_ERROR);  // idle stream
+
+    // The whole frame counts against the windows, padding included
+    c->recv_window -= f->len;
+    if (c->recv_window < 0)
+        return conn_error(c, H2_FLOW_CONTROL_ERROR);
+
+    size_t len = f->len;
+    if (unpad(f, &p, &len) != 0)
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    stream_data(c, f, p, len);
+
+    // The frame is now buffered, within H2_MAX_CONN_BODY, or dropped:
+    // either way the connection window can take more
+    if (c->recv_window < H2_CONN_WINDOW / 2) {
+        out_window_update(c, 0, (uint32_t) (H2_CONN_WINDOW - c->recv_window));
+        c->recv_window = H2_CONN_WINDOW;
+    }
+    return 0;
+}
+
+static int on_headers(h2_conn_t *c, const h2_frame_t *f, const uint8_t *p) {
+    if (f->stream == 0)
+        return conn_error(c, H2_PROTOCOL_ERROR);
+
+    size_t len = f->len;
+    if (unpad(f, &p, &len) != 0)
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    if (f->flags & H2_PRIO) {
+        // Priorities are deprecated (RFC 9113 section 5.3.2): skipped
+        if (len < 5)
+            return conn_error(c, H2_FRAME_SIZE_ERROR);
+        p += 5;
+        len -= 5;
+    }
+
+    int end_stream = f->flags & H2_END_STREAM;
+    if (f->flags & H2_END_HEADERS)
+        return on_header_block(c, f->stream, p, len, end_stream);
+
+    // The rest follows in CONTINUATION frames
+    c->hblock = (uint8_t *) xrealloc(c->hblock, len > 0 ? len : 1);
+    memcpy(c->hblock, p, len);
+    c->hblock_len = len;
+    c->hblock_stream = f->stream;
+    c->hblock_end_stream = end_stream;
+    return 0;
+}
+
+static int on_continuation(h2_conn_t *c, const h2_frame_t *f, const uint8_t *p) {
+    if (c->hblock_len + f->len > H2_MAX_HEADERS)
+        return conn_error(c, H2_ENHANCE_YOUR_CALM);
+
+    c->hblock = (uint8_t *) xrealloc(c->hblock, c->hblock_len + f->len + 1);
+    memcpy(c->hblock + c->hblock_len, p, f->len);
+    c->hblock_len += f->len;
+    if (!(f->flags & H2_END_HEADERS))
+        return 0;
+
+    c->hblock_stream = 0;
+    return on_header_block(c, f->stream, c->hblock, c->hblock_len, c->hblock_end_stream);
+}
+
+static int on_window_update(h2_conn_t *c, const h2_frame_t *f, const uint8_t *p) {
+    if (f->len != 4)
+        return conn_error(c, H2_FRAME_SIZE_ERROR);
+    uint32_t inc = get32(p) & H2_MAX_WINDOW;
+
+    if (f->stream == 0) {
+        if (inc == 0)
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        if (c->send_window + inc > H2_MAX_WINDOW)
+            return conn_error(c, H2_FLOW_CONTROL_ERROR);
+        c->send_window += inc;
+        send_pending(c);
+        return 0;
+    }
+
+    h2_stream_t *s = find_stream(c, f->stream);
+    if (s == NULL) {
+        // Updates may cross the end of a stream; idle ones are an error
+        return (f->stream > c->last_stream) ? conn_error(c, H2_PROTOCOL_ERROR) : 0;
+    }
+    if (inc == 0 || s->send_window + inc > H2_MAX_WINDOW) {
+        stream_error(c, f->stream, inc == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        return 0;
+    }
+    s->send_window += inc;
+    if (s->resp != NULL)
+        send_data(c, s);
+    return 0;
+}
+
+/**
+ * Handles one complete frame. Returns -1 on a connection error.
+ */
+static int on_frame(h2_conn_t *c, const h2_frame_t *f, const uint8_t *p) {
+    // A header block must not be interleaved with other frames
+    if (c->hblock_stream != 0 && (f->type != H2_CONTINUATION || f->stream != c->hblock_stream))
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    if (!c->got_settings && f->type != H2_SETTINGS)
+        return conn_error(c, H2_PROTOCOL_ERROR);
+
+    switch (f->type) {
+    case H2_DATA:
+        return on_data(c, f, p);
+    case H2_HEADERS:
+        return on_headers(c, f, p);
+    case H2_CONTINUATION:
+        if (c->hblock_stream == 0)
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        return on_continuation(c, f, p);
+
+    case H2_PRIORITY:
+        if (f->stream == 0)
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        if (f->len != 5)
+            stream_error(c, f->stream, H2_FRAME_SIZE_ERROR);
+        return 0;
+
+    case H2_RST_STREAM: {
+        if (f->stream == 0 || f->stream > c->last_stream)
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        if (f->len != 4)
+            return conn_error(c, H2_FRAME_SIZE_ERROR);
+        h2_stream_t *s = find_stream(c, f->stream);
+        if (s != NULL)
+            free_stream(c, s);
+        return 0;
+    }
+
+    case H2_SETTINGS:
+        if (f->stream != 0)
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        if (f->flags & H2_ACK)
+            return (f->len == 0) ? 0 : conn_error(c, H2_FRAME_SIZE_ERROR);
+        c->got_settings = 1;
+        if (apply_settings(c, p, f->len) != 0)
+            return -1;
+        out_frame(c, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+        send_pending(c);  // the initial window may have grown
+        return 0;
+
+    case H2_PUSH_PROMISE:
+        return conn_error(c, H2_PROTOCOL_ERROR);  // clients cannot push
+
+    case H2_PING:
+        if (f->stream != 0)
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        if (f->len != 8)
+            return conn_error(c, H2_FRAME_SIZE_ERROR);
+        if (!(f->flags & H2_ACK))
+            out_frame(c, H2_PING, H2_ACK, 0, p, 8);
+        return 0;
+
+    case H2_GOAWAY:
+        if (f->stream != 0)
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        c->goaway = 1;  // streams in progress still get their response
+        return 0;
+
+    case H2_WINDOW_UPDATE:
+        return on_window_update(c, f, p);
+
+    default:
+        return 0;  // unknown frame types are ignored
+    }
+}
+
+/**
+ * Processes len bytes read from the client. Returns the number of bytes
+ * consumed: the rest is an incomplete frame, to be passed again with
+ * more bytes. Returns -1 on a connection error; the output then ends
+ * with a GOAWAY, to be written before closing the connection.
+ *
+ * Once more than H2_MAX_OUTPUT bytes wait to be written, processing
+ * stops before the next frame, as a client that does not read would
+ * otherwise grow the output without bound, e.g. with PINGs. The caller
+ * should then stop reading from the socket until the output is written
+ * (see h2_conn_written()), and pass the rest of the input again.
+ */
+ssize_t h2_conn_input(h2_conn_t *c, const uint8_t *buf, size_t len) {
+    size_t off = 0;
+
+    if (c->preface < H2_PREFACE_LEN) {
+        size_t n = H2_PREFACE_LEN - c->preface;
+        if (n > len)
+            n = len;
+        if (memcmp(buf, H2_PREFACE + c->preface, n) != 0)
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        c->preface += n;
+        off = n;
+        if (c->preface < H2_PREFACE_LEN)
+            return off;
+        send_settings(c);
+    }
+
+    while (len - off >= H2_FRAME_HEADER && c->out_len <= H2_MAX_OUTPUT) {
+        h2_frame_t f;
+        h2_parse_frame_header(buf + off, &f);
+        if (f.len > H2_FRAME_SIZE)
+            return conn_error(c, H2_FRAME_SIZE_ERROR);
+        if (len - off < H2_FRAME_HEADER + f.len)
+            break;
+
+        if (on_frame(c, &f, buf + off + H2_FRAME_HEADER) != 0)
+            return -1;
+        off += H2_FRAME_HEADER + f.len;
+    }
+
+    return off;
+}
+
+
+/* Connections */
+
+void h2_conn_init(h2_conn_t *c, h2_request_fn fn, void *arg) {
+    memset(c, 0, sizeof(h2_conn_t));
+    c->peer_max_frame = H2_FRAME_SIZE;
+    c->peer_initial_window = H2_DEFAULT_WINDOW;
+    c->send_window = H2_DEFAULT_WINDOW;
+    c->recv_window = H2_DEFAULT_WINDOW;
+    hpack_table_init(&c->dec, HPACK_TABLE_SIZE, 0);
+    hpack_table_init(&c->enc, HPACK_TABLE_SIZE, 1);
+    c->on_request = fn;
+    c->arg = arg;
+}
+
+void h2_conn_free(h2_conn_t *c) {
+    while (c->nstreams > 0)
+        free_stream(c, c->streams[0]);
+    hpack_table_free(&c->dec);
+    hpack_table_free(&c->enc);
+    free(c->hblock);
+    free(c->out);
+}
+
+/**
+ * Switches an HTTP/1.1 connection to h2c, if its request asks for it
+ * with Upgrade: h2c and HTTP2-Settings (RFC 7540 section 3.2). headers
+ * are the request headers, with :method and :path added from the request
+ * line; on success the connection takes them over as stream 1, without
+ * the hop-by-hop headers and with :scheme added, answers 101 and runs
+ * the request callback. Returns -1, leaving headers alone,
+ * if the request is not a valid upgrade: it is then served as HTTP/1.1.
+ */
+int h2_conn_upgrade(h2_conn_t *c, hasht_t *headers) {
+    const char *upgrade = hash_get_prehashed(headers, "upgrade", hash_prehash("upgrade"));
+    const char *connection = hash_get_prehashed(headers, "connection", hash_prehash("connection"));
+    const char *settings = hash_get_prehashed(headers, "http2-settings",
+                                              hash_prehash("http2-settings"));
+    if (upgrade == NULL || !header_has_token(upgrade, "h2c") || connection == NULL
+        || !header_has_token(connection, "upgrade")
+        || !header_has_token(connection, "http2-settings") || settings == NULL
+        || !valid_request(headers, 1))
+        return -1;
+
+    size_t slen = strlen(settings);
+    uint8_t *p = (uint8_t *) xmalloc(slen * 3 / 4 + 1);
+    int n = base64url_decode(settings, slen, p);
+    int ok = n >= 0 && n % 6 == 0 && apply_settings(c, p, n) == 0;
+    free(p);
+    if (!ok) {
+        c->out_len = 0;  // no GOAWAY before the 101
+        c->goaway = 0;
+        return -1;
+    }
+
+    memcpy(out_reserve(c, sizeof(UPGRADE_RESPONSE) - 1), UPGRADE_RESPONSE,
+           sizeof(UPGRADE_RESPONSE) - 1);
+    send_settings(c);
+
+    // The HTTP/1.1 hop-by-hop headers do not carry over to HTTP/2
+    for (size_t i = 0; i < sizeof(conn_headers) / sizeof(conn_headers[0]); i++)
+        hash_remove(headers, conn_headers[i]);
+    hash_remove(headers, "te");
+    hash_remove(headers, "http2-settings");
+    if (!hash_contains(headers, ":scheme"))
+        hash_insert(headers, ":scheme", "http");
+
+    c->last_stream = 1;
+    h2_stream_t *s = new_stream(c, 1, headers);
+    s->remote_done = 1;
+    c->on_request(c, s, c->arg);
+    return 0;
+}
@@ -0,0 +1,160 @@
+#ifndef _HTTP_H2_H
+#define _HTTP_H2_H
+
+#include "hash_table.h"
+#include "hpack.h"
+#include "wqueue.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define H2_PREFACE        "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN    24
+#define H2_FRAME_HEADER   9
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW     0x7FFFFFFF
+#define H2_FRAME_SIZE     16384       // largest frame accepted, the protocol minimum
+#define H2_CONN_WINDOW    (1 << 20)   // connection receive window
+#define H2_MAX_STREAMS    100         // concurrent streams per connection
+#define H2_MAX_HEADERS    (64 << 10)  // header block and decoded list limit
+#define H2_MAX_BODY       (1 << 20)   // request body buffered per stream
+#define H2_MAX_CONN_BODY  (8 << 20)   // request bodies buffered per connection
+#define H2_MAX_OUTPUT     (1 << 20)   // output buffered before input is paused
+#define H2_RESET_MEMORY   H2_MAX_STREAMS  // streams reset by us, whose frames are ignored
+
+/* Frame types, RFC 9113 section 6 */
+enum {
+    H2_DATA          = 0x0,
+    H2_HEADERS       = 0x1,
+    H2_PRIORITY      = 0x2,
+    H2_RST_STREAM    = 0x3,
+    H2_SETTINGS      = 0x4,
+    H2_PUSH_PROMISE  = 0x5,
+    H2_PING          = 0x6,
+    H2_GOAWAY        = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION  = 0x9,
+};
+
+/* Frame flags */
+#define H2_END_STREAM  0x01
+#define H2_ACK         0x01
+#define H2_END_HEADERS 0x04
+#define H2_PADDED      0x08
+#define H2_PRIO        0x20
+
+/* Error codes, RFC 9113 section 7 */
+enum {
+    H2_NO_ERROR            = 0x0,
+    H2_PROTOCOL_ERROR      = 0x1,
+    H2_INTERNAL_ERROR      = 0x2,
+    H2_FLOW_CONTROL_ERROR  = 0x3,
+    H2_STREAM_CLOSED       = 0x5,
+    H2_FRAME_SIZE_ERROR    = 0x6,
+    H2_REFUSED_STREAM      = 0x7,
+    H2_CANCEL              = 0x8,
+    H2_COMPRESSION_ERROR   = 0x9,
+    H2_ENHANCE_YOUR_CALM   = 0xB,
+};
+
+/* Settings, RFC 9113 section 6.5.2 */
+enum {
+    H2_SETTINGS_HEADER_TABLE_SIZE      = 0x1,
+    H2_SETTINGS_ENABLE_PUSH            = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE    = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE         = 0x5,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE   = 0x6,
+};
+
+typedef struct {
+    uint32_t len;
+    uint8_t  type;
+    uint8_t  flags;
+    uint32_t stream;
+} h2_frame_t;
+
+/**
+ * A request stream. Its headers, pseudo-headers included, and body are
+ * complete when the request callback gets it.
+ */
+typedef struct {
+    uint32_t id;
+    int      remote_done;  // END_STREAM received
+    int      local_done;   // END_STREAM sent
+    int64_t  send_window;
+    int64_t  recv_window;
+    hasht_t *headers;
+    int64_t  content_length;  // declared by the client, -1 if not
+    char    *body;
+    size_t   body_len;
+    sbuf_t  *resp;         // response body still to send, or NULL
+    size_t   resp_off;
+} h2_stream_t;
+
+typedef struct h2_conn h2_conn_t;
+
+/**
+ * Called with every complete request. It may answer right away with
+ * h2_respond(), or later by stream id: the stream is only valid during
+ * the call.
+ */
+typedef void (*h2_request_fn)(h2_conn_t *c, h2_stream_t *s, void *arg);
+
+/**
+ * HTTP/2 connection state, independent of the socket: bytes read are
+ * fed to h2_conn_input(), and the bytes to write collect in an output
+ * buffer, see h2_conn_output().
+ */
+struct h2_conn {
+    int      preface;        // bytes of the client preface seen
+    int      settings_sent;
+    int      got_settings;   // the first client frame must be SETTINGS
+    int      goaway;         // GOAWAY sent or received: no new streams
+    uint32_t last_stream;    // highest stream id opened by the client
+
+    uint32_t peer_max_frame;
+    uint32_t peer_initial_window;
+    int64_t  send_window;
+    int64_t  recv_window;
+    hpack_table_t dec, enc;
+
+    h2_stream_t *streams[H2_MAX_STREAMS];
+    int          nstreams;
+    size_t       body_buffered;  // request body bytes held by the streams
+
+    // Last streams we reset, which the client may not know yet
+    uint32_t reset[H2_RESET_MEMORY];
+    int      reset_next;
+
+    // Header block split over CONTINUATION frames, 0 as stream if none
+    uint8_t *hblock;
+    size_t   hblock_len;
+    uint32_t hblock_stream;
+    int      hblock_end_stream;
+
+    uint8_t *out;
+    size_t   out_len, out_cap;
+
+    h2_request_fn on_request;
+    void         *arg;
+};
+
+
+int  h2_preface_match(const char *buf, size_t len);
+void h2_parse_frame_header(const uint8_t *p, h2_frame_t *f);
+void h2_write_frame_header(uint8_t *p, const h2_frame_t *f);
+
+void    h2_conn_init(h2_conn_t *c, h2_request_fn fn, void *arg);
+void    h2_conn_free(h2_conn_t *c);
+int     h2_conn_upgrade(h2_conn_t *c, hasht_t *headers);
+ssize_t h2_conn_input(h2_conn_t *c, const uint8_t *buf, size_t len);
+int     h2_respond(h2_conn_t *c, uint32_t id, int status, const char *const *headers,
+                   sbuf_t *body);
+
+const uint8_t *h2_conn_output(h2_conn_t *c, size_t *len);
+void           h2_conn_written(h2_conn_t *c, size_t n);
+
+
+#endif  // _HTTP_H2_H
@@ -1,4 +1,8 @@
 #include "hash_table.h"
+#include "huge_alloc.h"
+#include "simd.h"
+#include "trace.h"
+#include "xalloc.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -25,6 +29,7 @@ static int64_t mod(int64_t x, int64_t y) {
  * Initializes the library. Should be called only once.
  */
 void init_hash() {
+    init_simd();
     srandom(time(NULL));
     p = 2305843009213693951; // 2^61 - 1, prime
     a = random();
@@ -32,24 +37,33 @@ void init_hash() {
 }
 
 /**
- * Prehash function for strings, by Dan Bernstein.
+ * Prehash function for strings. Keeps the top 31 bits of str_hash(), so
+ * that a * k + b cannot overflow.
  */
 static int64_t prehash(const char *str) {
-    int64_t hash = 5381;
-    int c;
-
-    while ((c = *str++) != 0)
-        hash = ((hash << 5) + hash) + c;  // hash * 33 + c
+    return (int64_t) (str_hash(str, strlen(str)) >> 33);
+}
 
-    return hash;
+/**
+ * Universal hash function, on a prehashed key.
+ */
+static int hash_slot(int64_t k, int m) {
+    return mod(mod(a * k + b, p), m);
 }
 
 /**
  * Universal hash function
  */
 static int hash(const char *str, int m) {
-    int64_t k = prehash(str);
-    return mod(mod(a * k + b, p), m);
+    return hash_slot(prehash(str), m);
+}
+
+/**
+ * Returns the prehash of the given key, to be passed later on to the
+ * *_prehashed() functions, which then skip hashing the key again.
+ */
+int64_t hash_prehash(const char *key) {
+    return prehash(key);
 }
 
 /**
@@ -123,7 +137,7 @@ void free_hash_table(hasht_t *ht) {
     for (int l = 0; l < ht->m; l++)
         free_list_nodes(ht->table[l]);
 
-    free(ht->table);
+    huge_free(ht->table, ht->m, sizeof(node_t *));
     free(ht);
 }
 
@@ -132,13 +146,13 @@ void free_hash_table(hasht_t *ht) {
  * the list in the hash table containin such key. Returns the NULL
  * poiner if no such element exists.
  */
-static node_t *hash_search_node(hasht_t *ht, const char *key) {
+static node_t *hash_search_node_prehashed(hasht_t *ht, const char *key, int64_t k) {
     // Empty hash table case
     if (ht->m == 0)
         return NULL;
 
     // Get the list at hash(key) slot
-    node_t *head = ht->table[hash(key, ht->m)];
+    node_t *head = ht->table[hash_slot(k, ht->m)];
 
     // seek for key in such list
     node_t *n = head;
@@ -153,6 +167,10 @@ static node_t *hash_search_node(hasht_t *ht, const char *key) {
     return NULL;
 }
 
+static node_t *hash_search_node(hasht_t *ht, const char *key) {
+    return hash_search_node_prehashed(ht, key, prehash(key));
+}
+
 /**
  * Given hash table and a key, returns 1 if there is an element in
  * the table with such key. Returns 0 otherwise.
@@ -183,14 +201,31 @@ char *hash_search(hasht_t *ht, const char *key) {
     return s;
 }
 
+/**
+ * Given hash table, a key and its prehash as returned by hash_prehash(),
+ * returns the element in the table with such key, or NULL if there is
+ * none. Unlike hash_search(), it returns the stored element itself, not
+ * a copy: it must not be freed, and it is only valid until the table is
+ * next modified.
+ */
+const char *hash_get_prehashed(hasht_t *ht, const char *key, int64_t k) {
+    node_t *n = hash_search_node_prehashed(ht, key, k);
+    return (n == NULL) ? NULL : n->value;
+}
+
 /**
  * Resizes the hash table given to the new value of m.
  * It does so by allocating a new table and freeing the prior one,
  * and rehashing all the prior elements.
- * It has O(ht->n) running time.
+ * It has O(ht->n) running time. If the new table cannot be allocated,
+ * the table keeps its size: it still works, with longer chains.
  */
 static void resize_hash_table(hasht_t *ht, int newm) {
-    node_t **t = (node_t **) malloc(newm * sizeof(node_t *));
+    // Large tables go on huge pages, if enabled, to save TLB misses
+    node_t **t = (node_t **) huge_calloc(newm, sizeof(node_t *));
+    if (t == NULL)
+        return;
+    TRACE_HASH_RESIZE(ht, ht->m, newm, ht->n);
 
     // Rehash elements to the new table
     for (int l = 0; l < ht->m; l++) {
@@ -215,7 +250,7 @@ static void resize_hash_table(hasht_t *ht, int newm) {
     }
 
     // Link new table with hasht struct and free old table
-    free(ht->table);
+    huge_free(ht->table, ht->m, sizeof(node_t *));
     ht->table = t;
     ht->m = newm;
 }
@@ -227,8 +262,11 @@ static void grow_hash_table(hasht_t *ht) {
     // Check empty hash table case
     if (ht->m == 0) {
         // Start with table with MINSIZE
+        TRACE_HASH_RESIZE(ht, 0, MIN_TABLE_SIZE, 0);
+        ht->table = (node_t **) huge_calloc(MIN_TABLE_SIZE, sizeof(node_t *));
+        if (ht->table == NULL)
+            fatal("hash table: out of memory");
         ht->m = MIN_TABLE_SIZE;
-        ht->table = (node_t **) malloc(ht->m * sizeof(node_t *));
         return;
     }
 
@@ -262,8 +300,8 @@ void hash_insert(hasht_t *ht, const char *key, const char *value) {
         return;
     }
 
-    // New insertion. Check first to grow hash table.
-    if (ht->n == ht->m)
+    // New insertion. Check first to grow hash table; past m if it failed.
+    if (ht->n >= ht->m)
         grow_hash_table(ht);
     ht->n++;  // Increment number of elements in table
 
@@ -305,8 +343,8 @@ void hash_remove(hasht_t *ht, const char *key) {
     if (n == NULL)
         return;
 
-    // Check first to shrink hash table.
-    if (ht->n/4 <= ht->m) {
+    // Check first to shrink hash table, once it is a quarter full.
+    if (ht->n <= ht->m/4) {
         shrink_hash_table(ht);
         n = hash_search_node(ht, key);
     }
@@ -326,6 +364,86 @@ void hash_remove(hasht_t *ht, const char *key) {
     free_hash_node(n);
 }
 
+/**
+ * Fills st with the occupancy statistics of the given hash table.
+ * It walks the whole table, so it has O(ht->m + ht->n) running time.
+ */
+void hash_stats(hasht_t *ht, hash_stats_t *st) {
+    st->m = ht->m;
+    st->n = ht->n;
+    st->used = st->longest = 0;
+
+    for (int l = 0; l < ht->m; l++) {
+        int len = 0;
+        for (node_t *n = ht->table[l]; n != NULL; n = n->next)
+            len++;
+        if (len > 0)
+            st->used++;
+        if (len > st->longest)
+            st->longest = len;
+    }
+}
+
+/**
+ * Writes all the elements of the given hash table to f, in a binary
+ * format read back by hash_load(): a magic number and the element count,
+ * then the length-prefixed key and value of every element. Returns 0 on
+ * success, -1 if writing failed.
+ */
+int hash_save(hasht_t *ht, FILE *f) {
+    uint32_t hdr[2] = { HASH_SNAPSHOT_MAGIC, (uint32_t) ht->n };
+    if (fwrite(hdr, sizeof(hdr), 1, f) != 1)
+        return -1;
+
+    for (int l = 0; l < ht->m; l++) {
+        for (node_t *n = ht->table[l]; n != NULL; n = n->next) {
+            uint32_t len[2] = { (uint32_t) strlen(n->key), (uint32_t) strlen(n->value) };
+            if (fwrite(len, sizeof(len), 1, f) != 1
+                    || fwrite(n->key, 1, len[0], f) != len[0]
+                    || fwrite(n->value, 1, len[1], f) != len[1])
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Inserts into the given hash table the elements written to f by
+ * hash_save(), overriding those with the same keys. Returns the number
+ * of elements read, or -1 if f does not hold a valid table; the
+ * elements read until then are kept.
+ */
+int hash_load(hasht_t *ht, FILE *f) {
+    uint32_t hdr[2];
+    if (fread(hdr, sizeof(hdr), 1, f) != 1 || hdr[0] != HASH_SNAPSHOT_MAGIC)
+        return -1;
+
+    char *buf = NULL;
+    size_t cap = 0;
+    uint32_t i;
+    for (i = 0; i < hdr[1]; i++) {
+        uint32_t len[2];
+        if (fread(len, sizeof(len), 1, f) != 1)
+            break;
+        size_t need = (size_t) len[0] + len[1] + 2;
+        if (need > cap) {
+            char *nbuf = (char *) realloc(buf, need);
+            if (nbuf == NULL)
+                break;
+            buf = nbuf;
+            cap = need;
+        }
+        char *key = buf, *value = buf + len[0] + 1;
+        if (fread(key, 1, len[0], f) != len[0] || fread(value, 1, len[1], f) != len[1])
+            break;
+        key[len[0]] = value[len[1]] = '\0';
+        hash_insert(ht, key, value);
+    }
+    free(buf);
+
+    return (i == hdr[1]) ? (int) i : -1;
+}
+
 void hash_print(hasht_t *ht) {
     printf("{");
     for (int l = 0; l < (int) ht->m; l++) { // print each list in the table
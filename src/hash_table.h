@@ -2,6 +2,10 @@
 #define _HTTP_HASH_TABLE_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define HASH_SNAPSHOT_MAGIC 0x31544848  // "HHT1", see hash_save()
 
 /**
  * Nodes of linked list in hash table.
@@ -23,6 +27,16 @@ typedef struct {
     node_t **table;  // hash table of size m, of lists. 
 } hasht_t;
 
+/**
+ * Occupancy statistics of a hash table, see hash_stats().
+ */
+typedef struct {
+    int m;        // table size
+    int n;        // number of elements stored in the table
+    int used;     // slots with a non-empty list
+    int longest;  // length of the longest list
+} hash_stats_t;
+
 
 void init_hash(void);
 
@@ -37,6 +51,12 @@ char *hash_search(hasht_t *ht, const char *key);
 void  hash_insert(hasht_t *ht, const char *key, const char *element);
 void  hash_remove(hasht_t *ht, const char *key);
 
+int64_t     hash_prehash(const char *key);
+const char *hash_get_prehashed(hasht_t *ht, const char *key, int64_t k);
+
+void  hash_stats(hasht_t *ht, hash_stats_t *st);
+int   hash_save(hasht_t *ht, FILE *f);
+int   hash_load(hasht_t *ht, FILE *f);
 void  hash_print(hasht_t *ht);
 // char *hash_to_string(hasht_t *ht);
 
@@ -0,0 +1,27 @@
+#include "headers.h"
+#include "simd.h"
+
+#include <string.h>
+
+/**
+ * Returns 1 if the comma separated list s, like a Connection or Upgrade
+ * header value, has the given token, ignoring case and spaces around the
+ * elements.
+ */
+int header_has_token(const char *s, const char *token) {
+    size_t tlen = strlen(token);
+    while (*s != '\0') {
+        while (*s == ' ' || *s == '\t' || *s == ',')
+            s++;
+        const char *end = s;
+        while (*end != '\0' && *end != ',')
+            end++;
+        const char *e = end;
+        while (e > s && (e[-1] == ' ' || e[-1] == '\t'))
+            e--;
+        if ((size_t) (e - s) == tlen && str_caseeq(s, token, tlen))
+            return 1;
+        s = end;
+    }
+    return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef _HTTP_HEADERS_H
+#define _HTTP_HEADERS_H
+
+/*
+ * Helpers for header values, as stored in the request header table.
+ */
+
+int header_has_token(const char *value, const char *token);
+
+
+#endif  // _HTTP_HEADERS_H
@@ -0,0 +1,728 @@
+#include "hpack.h"
+#include "xalloc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HUFFMAN_EOS      256
+#define HUFFMAN_EOS_CODE 0x3fffffff
+#define HUFFMAN_EOS_LEN  30
+#define MAX_STRING       (1 << 20)  // longer header strings are refused
+
+/* Huffman code of every octet, RFC 7541 appendix B */
+static const uint32_t huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+static const uint8_t huffman_lens[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+/* Static table, RFC 7541 appendix A; index i + 1 */
+static const struct { const char *name, *value; } static_table[HPACK_STATIC_LEN] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+/* Huffman decoding tree: children of every inner node, leaves stored as
+ * -(symbol + 1). Built by init_hpack(). */
+static int16_t huffman_tree[512][2];
+
+/* Static table lookups for the encoder: "name\nvalue" and "name" to the
+ * index, see static_index() */
+static hasht_t *static_index;
+
+
+/**
+ * Returns "name\nvalue", or "name" if value is NULL: the keys of the
+ * encoder indexes. A newline can be in neither a name nor a value.
+ */
+static char *index_key(const char *name, const char *value, char *buf, size_t size) {
+    size_t nlen = strlen(name), vlen = (value != NULL) ? strlen(value) + 1 : 0;
+    char *key = (nlen + vlen + 1 <= size) ? buf : (char *) xmalloc(nlen + vlen + 1);
+    memcpy(key, name, nlen);
+    if (value != NULL) {
+        key[nlen] = '\n';
+        memcpy(key + nlen + 1, value, vlen - 1);
+    }
+    key[nlen + vlen] = '\0';
+    return key;
+}
+
+/**
+ * Builds the Huffman decoding tree and the static table index. Must be
+ * called once at startup, after init_hash().
+ */
+void init_hpack(void) {
+    int nodes = 1;
+    memset(huffman_tree, 0, sizeof(huffman_tree));
+    for (int sym = 0; sym <= HUFFMAN_EOS; sym++) {
+        uint32_t code = (sym < HUFFMAN_EOS) ? huffman_codes[sym] : HUFFMAN_EOS_CODE;
+        int len = (sym < HUFFMAN_EOS) ? huffman_lens[sym] : HUFFMAN_EOS_LEN;
+
+        int node = 0;
+        for (int i = len - 1; i > 0; i--) {
+            int bit = (code >> i) & 1;
+            if (huffman_tree[node][bit] == 0)
+                huffman_tree[node][bit] = (int16_t) nodes++;
+            node = huffman_tree[node][bit];
+        }
+        huffman_tree[node][code & 1] = (int16_t) -(sym + 1);
+    }
+
+    static_index = new_hash_table();
+    char buf[64], id[8];
+    // Backwards, so that names map to their first entry
+    for (int i = HPACK_STATIC_LEN - 1; i >= 0; i--) {
+        snprintf(id, sizeof(id), "%d", i + 1);
+        hash_insert(static_index, index_key(static_table[i].name, NULL, buf, sizeof(buf)), id);
+        hash_insert(static_index, index_key(static_table[i].name, static_table[i].value, buf,
+                                            sizeof(buf)), id);
+    }
+}
+
+
+/* Dynamic table */
+
+/**
+ * Initializes an empty table. limit is the table size allowed by the
+ * SETTINGS_HEADER_TABLE_SIZE of the decoding side.
+ */
+void hpack_table_init(hpack_table_t *t, size_t limit, int encoder) {
+    t->ents = NULL;
+    t->cap = t->head = t->n = 0;
+    t->size = 0;
+    t->limit = limit;
+    t->max_size = limit;
+    t->inserted = 0;
+    t->index = encoder ? new_hash_table() : NULL;
+    t->pending_update = 0;
+}
+
+void hpack_table_free(hpack_table_t *t) {
+    for (int i = 0; i < t->n; i++)
+        free(t->ents[(t->head + i) % t->cap].name);
+    free(t->ents);
+    if (t->index != NULL)
+        free_hash_table(t->index);
+    t->ents = NULL;
+    t->n = 0;
+}
+
+/**
+ * Returns the entry with dynamic index d, 0 being the newest.
+ */
+static hpack_entry_t *entry(hpack_table_t *t, int d) {
+    return &t->ents[(t->head + t->n - 1 - d) % t->cap];
+}
+
+/**
+ * Removes the id of the evicted entry from the encoder index, unless a
+ * newer entry took its key over.
+ */
+static void unindex(hpack_table_t *t, hpack_entry_t *e, uint64_t id) {
+    char buf[256], ids[24];
+    snprintf(ids, sizeof(ids), "%llu", (unsigned long long) id);
+
+    for (int full = 0; full < 2; full++) {
+        char *key = index_key(e->name, full ? e->value : NULL, buf, sizeof(buf));
+        const char *cur = hash_get_prehashed(t->index, key, hash_prehash(key));
+        if (cur != NULL && strcmp(cur, ids) == 0)
+            hash_remove(t->index, key);
+        if (key != buf)
+            free(key);
+    }
+}
+
+static void evict_oldest(hpack_table_t *t) {
+    hpack_entry_t *e = &t->ents[t->head];
+    if (t->index != NULL)
+        unindex(t, e, t->inserted - (uint64_t) (t->n - 1));
+    t->size -= e->size;
+    free(e->name);
+    t->head = (t->head + 1) % t->cap;
+    t->n--;
+}
+
+/**
+ * Evicts the oldest entries until the table fits in size.
+ */
+static void evict(hpack_table_t *t, size_t size) {
+    while (t->n > 0 && t->size > size)
+        evict_oldest(t);
+}
+
+/**
+ * Adds an entry, evicting as needed. An entry larger than the table just
+ * empties it (RFC 7541 section 4.4). name may belong to an entry about to
+ * be evicted, so it is copied first.
+ */
+static void add(hpack_table_t *t, const char *name, size_t nlen, const char *value, size_t vlen) {
+    size_t size = nlen + vlen + HPACK_ENTRY_OVERHEAD;
+    if (size > t->max_size) {
+        evict(t, 0);
+        return;
+    }
+
+    char *s = (char *) xmalloc(nlen + vlen + 2);
+    memcpy(s, name, nlen);
+    s[nlen] = '\0';
+    memcpy(s + nlen + 1, value, vlen);
+    s[nlen + 1 + vlen] = '\0';
+    evict(t, t->max_size - size);
+
+    if (t->n == t->cap) {
+        int cap = (t->cap > 0) ? 2 * t->cap : 16;
+        hpack_entry_t *ents = (hpack_entry_t *) xmalloc(cap * sizeof(hpack_entry_t));
+        for (int i = 0; i < t->n; i++)
+            ents[i] = t->ents[(t->head + i) % t->cap];
+        free(t->ents);
+        t->ents = ents;
+        t->cap = cap;
+        t->head = 0;
+    }
+
+    hpack_entry_t *e = &t->ents[(t->head + t->n) % t->cap];
+    e->name = s;
+    e->value = s + nlen + 1;
+    e->size = size;
+    t->size += size;
+    t->n++;
+    t->inserted++;
+
+    if (t->index != NULL) {
+        char buf[256], id[24];
+        snprintf(id, sizeof(id), "%llu", (unsigned long long) t->inserted);
+        for (int full = 0; full < 2; full++) {
+            char *key = index_key(e->name, full ? e->value : NULL, buf, sizeof(buf));
+            hash_insert(t->index, key, id);
+            if (key != buf)
+                free(key);
+        }
+    }
+}
+
+/**
+ * Sets the ceiling of the table size, from the SETTINGS_HEADER_TABLE_SIZE
+ * of the decoding side. An encoder shrinks its table right away and
+ * signals it at the start of the next header block.
+ */
+void hpack_set_limit(hpack_table_t *t, size_t limit) {
+    t->limit = limit;
+    if (t->index != NULL) {
+        size_t max = (limit < HPACK_TABLE_SIZE) ? limit : HPACK_TABLE_SIZE;
+        if (max != t->max_size) {
+            t->max_size = max;
+            evict(t, max);
+            t->pending_update = 1;
+        }
+    }
+}
+
+
+/* Primitives, RFC 7541 section 5 */
+
+/**
+ * Decodes an integer with an n bit prefix at *p, advancing it. Returns -1
+ * if it is truncated or does not fit in 32 bits.
+ */
+static int decode_int(const uint8_t **p, const uint8_t *end, int n, uint32_t *out) {
+    if (*p >= end)
+        return -1;
+    uint32_t max = (1u << n) - 1;
+    uint32_t v = *(*p)++ & max;
+    if (v < max) {
+        *out = v;
+        return 0;
+    }
+
+    for (int shift = 0; shift <= 28; shift += 7) {
+        if (*p >= end)
+            return -1;
+        uint8_t b = *(*p)++;
+        uint64_t add = (uint64_t) (b & 0x7F) << shift;
+        if (v + add > UINT32_MAX)
+            return -1;
+        v += (uint32_t) add;
+        if ((b & 0x80) == 0) {
+            *out = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Encodes v with an n bit prefix, flags being the bits above the prefix.
+ * Returns the bytes written, at most 6.
+ */
+static size_t encode_int(uint8_t *out, int n, uint8_t flags, uint32_t v) {
+    uint32_t max = (1u << n) - 1;
+    if (v < max) {
+        out[0] = flags | (uint8_t) v;
+        return 1;
+    }
+
+    size_t o = 0;
+    out[o++] = flags | (uint8_t) max;
+    v -= max;
+    while (v >= 0x80) {
+        out[o++] = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+    out[o++] = (uint8_t) v;
+    return o;
+}
+
+/**
+ * Decodes Huffman coded bytes into out, which holds len * 8 / 5 bytes at
+ * least. Returns the decoded length, or -1 on an invalid code or padding.
+ */
+static int huffman_decode(const uint8_t *p, size_t len, char *out) {
+    int node = 0, depth = 0, ones = 1, o = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            int bit = (p[i] >> b) & 1;
+            node = huffman_tree[node][bit];
+            if (node < 0) {
+                int sym = -node - 1;
+                if (sym == HUFFMAN_EOS)
+                    return -1;
+                out[o++] = (char) sym;
+                node = depth = 0;
+                ones = 1;
+            } else {
+                depth++;
+                ones &= bit;
+            }
+        }
+    }
+
+    // Padding: the most significant bits of EOS, shorter than a byte
+    if (depth >= 8 || !ones)
+        return -1;
+    return o;
+}
+
+static size_t huffman_len(const char *s, size_t len) {
+    size_t bits = 0;
+    for (size_t i = 0; i < len; i++)
+        bits += huffman_lens[(uint8_t) s[i]];
+    return (bits + 7) / 8;
+}
+
+static size_t huffman_encode(const char *s, size_t len, uint8_t *out) {
+    uint64_t acc = 0;
+    int bits = 0;
+    size_t o = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = (uint8_t) s[i];
+        acc = (acc << huffman_lens[c]) | huffman_codes[c];
+        bits += huffman_lens[c];
+        while (bits >= 8) {
+            bits -= 8;
+            out[o++] = (uint8_t) (acc >> bits);
+        }
+    }
+    if (bits > 0)  // pad with the start of EOS
+        out[o++] = (uint8_t) ((acc << (8 - bits)) | (0xFF >> bits));
+    return o;
+}
+
+/**
+ * Decodes a string literal at *p into a new null-terminated string,
+ * advancing *p. Returns NULL if it is invalid.
+ */
+static char *decode_string(const uint8_t **p, const uint8_t *end, size_t *len) {
+    if (*p >= end)
+        return NULL;
+    int huffman = **p & 0x80;
+    uint32_t n;
+    if (decode_int(p, end, 7, &n) != 0 || n > (size_t) (end - *p) || n > MAX_STRING)
+        return NULL;
+
+    char *s;
+    if (huffman) {
+        s = (char *) xmalloc((size_t) n * 8 / 5 + 1);
+        int l = huffman_decode(*p, n, s);
+        if (l < 0) {
+            free(s);
+            return NULL;
+        }
+        *len = l;
+    } else {
+        s = (char *) xmalloc((size_t) n + 1);
+        memcpy(s, *p, n);
+        *len = n;
+    }
+    s[*len] = '\0';
+    *p += n;
+    return s;
+}
+
+static size_t encode_string(const char *s, size_t len, uint8_t *out) {
+    size_t hlen = huffman_len(s, len);
+    if (hlen < len) {
+        size_t o = encode_int(out, 7, 0x80, (uint32_t) hlen);
+        return o + huffman_encode(s, len, out + o);
+    }
+    size_t o = encode_int(out, 7, 0, (uint32_t) len);
+    memcpy(out + o, s, len);
+    return o + len;
+}
+
+
+/* Header blocks, RFC 7541 section 6 */
+
+/**
+ * Returns the name and value of the header at HPACK index i, or -1 if
+ * there is none.
+ */
+static int lookup(hpack_table_t *t, uint32_t i, const char **name, const char **value) {
+    if (i >= 1 && i <= HPACK_STATIC_LEN) {
+        *name = static_table[i - 1].name;
+        *value = static_table[i - 1].value;
+        return 0;
+    }
+    if (i > HPACK_STATIC_LEN && i - HPACK_STATIC_LEN <= (uint32_t) t->n) {
+        hpack_entry_t *e = entry(t, (int) (i - HPACK_STATIC_LEN - 1));
+        *name = e->name;
+        *value = e->value;
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Returns 1 if name may be stored in the header table: lower case, as
+ * HTTP/2 requires, and printable.
+ */
+static int valid_name(const char *name, size_t len) {
+    if (len == 0 || strlen(name) != len)
+        return 0;
+    for (size_t i = 0; i < len; i++) {
+        if ((name[i] >= 'A' && name[i] <= 'Z') || (uint8_t) name[i] <= ' ')
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Returns 1 if value may be stored: no NUL, CR or LF, which could split
+ * it into several header lines once joined as HTTP/1.1 would, and no
+ * leading or trailing whitespace (RFC 9113 section 8.2.1).
+ */
+static int valid_value(const char *value, size_t len) {
+    if (strlen(value) != len || strpbrk(value, "\r\n") != NULL)
+        return 0;
+    return len == 0 || (value[0] != ' ' && value[0] != '\t' && value[len - 1] != ' '
+                        && value[len - 1] != '\t');
+}
+
+/**
+ * Returns 1 if name is a pseudo-header HTTP/2 defines (RFC 9113 section
+ * 8.3, and :protocol from RFC 8441).
+ */
+static int known_pseudo(const char *name) {
+    static const char *const pseudo[] = {
+        ":authority", ":method", ":path", ":protocol", ":scheme", ":status",
+    };
+    for (size_t i = 0; i < sizeof(pseudo) / sizeof(pseudo[0]); i++) {
+        if (strcmp(name, pseudo[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Stores a decoded header, joining the values of repeated names as
+ * HTTP/1.1 would: with "; " for cookies, ", " otherwise.
+ */
+static void store(hasht_t *headers, const char *name, const char *value) {
+    char *prev = hash_search(headers, name);
+    if (prev == NULL) {
+        hash_insert(headers, name, value);
+        return;
+    }
+
+    const char *sep = (strcmp(name, "cookie") == 0) ? "; " : ", ";
+    size_t plen = strlen(prev), slen = strlen(sep), vlen = strlen(value);
+    char *joined = (char *) xmalloc(plen + slen + vlen + 1);
+    memcpy(joined, prev, plen);
+    memcpy(joined + plen, sep, slen);
+    memcpy(joined + plen + slen, value, vlen + 1);
+    hash_insert(headers, name, joined);
+    free(joined);
+    free(prev);
+}
+
+/**
+ * Decodes a complete header block into headers, updating the dynamic
+ * table. Returns 0 on success; -1 on a decoding error, which is a
+ * connection error as the table is then out of sync; -2 if the block
+ * decoded but the headers are malformed or larger than max_list, which
+ * only fails the request. Malformed means invalid names or values, or
+ * pseudo-headers unknown, repeated, or after a regular header.
+ */
+int hpack_decode(hpack_table_t *t, const uint8_t *p, size_t len, hasht_t *headers,
+                 size_t max_list) {
+    const uint8_t *end = p + len;
+    size_t list = 0;
+    int malformed = 0, first = 1, regular = 0;
+
+    while (p < end) {
+        uint8_t b = *p;
+        uint32_t i;
+
+        // Size updates must come first in the block
+        if ((b & 0xE0) == 0x20) {
+            if (!first || decode_int(&p, end, 5, &i) != 0 || i > t->limit)
+                return -1;
+            t->max_size = i;
+            evict(t, i);
+            continue;
+        }
+        first = 0;
+
+        const char *name, *value;
+        char *nbuf = NULL, *vbuf = NULL;
+        size_t nlen, vlen;
+
+        if (b & 0x80) {
+            // Indexed header field
+            if (decode_int(&p, end, 7, &i) != 0 || i == 0 || lookup(t, i, &name, &value) != 0)
+                return -1;
+            nlen = strlen(name);
+            vlen = strlen(value);
+        } else {
+            // Literal, with incremental indexing, without, or never indexed
+            int prefix = ((b & 0xC0) == 0x40) ? 6 : 4;
+            if (decode_int(&p, end, prefix, &i) != 0)
+                return -1;
+            if (i == 0) {
+                if ((nbuf = decode_string(&p, end, &nlen)) == NULL)
+                    return -1;
+                name = nbuf;
+            } else {
+                if (lookup(t, i, &name, &value) != 0)
+                    return -1;
+                nlen = strlen(name);
+            }
+            if ((vbuf = decode_string(&p, end, &vlen)) == NULL) {
+                free(nbuf);
+                return -1;
+            }
+            value = vbuf;
+        }
+
+        list += nlen + vlen + HPACK_ENTRY_OVERHEAD;
+        if (!valid_name(name, nlen) || !valid_value(value, vlen) || list > max_list)
+            malformed = 1;
+        else if (name[0] != ':')
+            regular = 1;
+        else if (regular || !known_pseudo(name) || hash_contains(headers, name))
+            malformed = 1;  // checked before store() joins repeated ones
+        if (!malformed)
+            store(headers, name, value);
+
+        // Last: adding may evict the entry name points to
+        if ((b & 0xC0) == 0x40)
+            add(t, name, nlen, value, vlen);
+        free(nbuf);
+        free(vbuf);
+    }
+
+    return malformed ? -2 : 0;
+}
+
+/**
+ * Writes the dynamic table size update due after hpack_set_limit(), if
+ * any, to out (6 bytes at most). Must start every header block the
+ * encoder writes. Returns the bytes written.
+ */
+size_t hpack_encode_update(hpack_table_t *t, uint8_t *out) {
+    if (!t->pending_update)
+        return 0;
+    t->pending_update = 0;
+    return encode_int(out, 5, 0x20, (uint32_t) t->max_size);
+}
+
+/**
+ * Returns the HPACK index of the entry with the given id, or 0 if it was
+ * evicted.
+ */
+static uint32_t dynamic_index(hpack_table_t *t, const char *id) {
+    if (id == NULL)
+        return 0;
+    uint64_t age = t->inserted - strtoull(id, NULL, 10);
+    return (age < (uint64_t) t->n) ? HPACK_STATIC_LEN + 1 + (uint32_t) age : 0;
+}
+
+/**
+ * Looks up a key in the static table, then in the dynamic one. Returns
+ * the HPACK index, or 0 if neither has it.
+ */
+static uint32_t find(hpack_table_t *t, const char *key) {
+    int64_t k = hash_prehash(key);
+    const char *id = hash_get_prehashed(static_index, key, k);
+    if (id != NULL)
+        return (uint32_t) atoi(id);
+    return dynamic_index(t, hash_get_prehashed(t->index, key, k));
+}
+
+/**
+ * Returns 1 for headers that should never be indexed, so that their
+ * values cannot be guessed by probing the compression (RFC 7541 section
+ * 7.1.3).
+ */
+static int sensitive(const char *name) {
+    return strcmp(name, "authorization") == 0 || strcmp(name, "set-cookie") == 0
+           || strcmp(name, "cookie") == 0 || strcmp(name, "proxy-authorization") == 0;
+}
+
+/**
+ * Encodes one header into out, which must hold
+ * HPACK_MAX_ENCODED(strlen(name), strlen(value)) bytes. name must be in
+ * lower case. Headers already in a table are sent as an index; others
+ * are added to the dynamic table if they fit in a quarter of it, so that
+ * large or one-off values do not flush it. Returns the bytes written.
+ */
+size_t hpack_encode(hpack_table_t *t, const char *name, const char *value, uint8_t *out) {
+    size_t nlen = strlen(name), vlen = strlen(value), o;
+    char buf[256];
+    uint32_t i = 0;
+    int never = sensitive(name);
+
+    if (!never) {
+        char *key = index_key(name, value, buf, sizeof(buf));
+        i = find(t, key);
+        if (key != buf)
+            free(key);
+        if (i != 0)
+            return encode_int(out, 7, 0x80, i);
+    }
+
+    char *key = index_key(name, NULL, buf, sizeof(buf));
+    i = find(t, key);
+    if (key != buf)
+        free(key);
+
+    int indexing = !never && nlen + vlen + HPACK_ENTRY_OVERHEAD <= t->max_size / 4;
+    if (indexing)
+        o = encode_int(out, 6, 0x40, i);
+    else
+        o = encode_int(out, 4, never ? 0x10 : 0x00, i);
+    if (i == 0)
+        o += encode_string(name, nlen, out + o);
+    o += encode_string(value, vlen, out + o);
+
+    if (indexing)
+        add(t, name, nlen, value, vlen);
+    return o;
+}
@@ -0,0 +1,57 @@
+#ifndef _HTTP_HPACK_H
+#define _HTTP_HPACK_H
+
+#include "hash_table.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HPACK_STATIC_LEN     61
+#define HPACK_TABLE_SIZE     4096  // default dynamic table size, in HPACK units
+#define HPACK_ENTRY_OVERHEAD 32
+
+/* Upper bound of the encoding of a header with the given name and value
+ * lengths: a flags byte, two integers and the strings, uncompressed */
+#define HPACK_MAX_ENCODED(nlen, vlen) (1 + 2 * 6 + (nlen) + (vlen))
+
+typedef struct {
+    char  *name;   // one allocation holding both strings
+    char  *value;
+    size_t size;   // name and value lengths plus HPACK_ENTRY_OVERHEAD
+} hpack_entry_t;
+
+/**
+ * HPACK dynamic table (RFC 7541 section 2.3.2), one per direction of a
+ * connection. Entries live in a ring, newest last. Each gets an id from
+ * a counter of insertions, which maps to its HPACK index for as long as
+ * it is in the table.
+ *
+ * The encoder side also indexes its entries in a hasht_t, from
+ * "name\nvalue" and from "name" to the id of the newest such entry, so
+ * finding what to reference does not scan the table.
+ */
+typedef struct {
+    hpack_entry_t *ents;
+    int            cap, head, n;
+    size_t         size;       // sum of the entry sizes
+    size_t         max_size;   // current limit, set by a size update
+    size_t         limit;      // ceiling for size updates, from SETTINGS
+    uint64_t       inserted;   // id of the newest entry
+    hasht_t       *index;      // encoder only, NULL for decoders
+    int            pending_update;  // encoder: size update to signal
+} hpack_table_t;
+
+
+void init_hpack(void);
+
+void hpack_table_init(hpack_table_t *t, size_t limit, int encoder);
+void hpack_table_free(hpack_table_t *t);
+void hpack_set_limit(hpack_table_t *t, size_t limit);
+
+int    hpack_decode(hpack_table_t *t, const uint8_t *p, size_t len, hasht_t *headers,
+                    size_t max_list);
+size_t hpack_encode(hpack_table_t *t, const char *name, const char *value, uint8_t *out);
+size_t hpack_encode_update(hpack_table_t *t, uint8_t *out);
+
+
+#endif  // _HTTP_HPACK_H
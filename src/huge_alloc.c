@@ -0,0 +1,171 @@
+#include "huge_alloc.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+/*
+ * Large allocations are mapped directly, their length rounded up to a
+ * huge page, which huge_free() finds again from the size it is given.
+ * The backing each one got, only needed for the statistics, is kept in a
+ * list apart: a header in the mapping would take a whole extra huge page
+ * for the power of two sizes hash tables allocate.
+ */
+enum { KIND_REGULAR, KIND_THP, KIND_HUGETLB };
+
+typedef struct region {
+    void          *p;
+    int            kind;
+    struct region *next;
+} region_t;
+
+static huge_mode_t mode = HUGE_PAGES_OFF;
+static uint64_t    allocated[3];  // bytes mapped, by kind
+
+static region_t       *regions;  // live mappings, few and rarely changed
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Sets how the following large allocations are backed.
+ */
+void huge_set_mode(huge_mode_t m) {
+    __atomic_store_n(&mode, m, __ATOMIC_RELAXED);
+}
+
+huge_mode_t huge_get_mode() {
+    return __atomic_load_n(&mode, __ATOMIC_RELAXED);
+}
+
+/**
+ * Parses "off", "thp" or "hugetlb" into mode. Returns 0 on success, -1
+ * if s is none of them.
+ */
+int huge_parse_mode(const char *s, huge_mode_t *m) {
+    if (strcmp(s, "off") == 0)
+        *m = HUGE_PAGES_OFF;
+    else if (strcmp(s, "thp") == 0)
+        *m = HUGE_PAGES_THP;
+    else if (strcmp(s, "hugetlb") == 0)
+        *m = HUGE_PAGES_HUGETLB;
+    else
+        return -1;
+    return 0;
+}
+
+static size_t round_up(size_t n, size_t to) {
+    return (n + to - 1) / to * to;
+}
+
+/**
+ * Maps len bytes aligned to a huge page, so that all of them can be
+ * backed by transparent huge pages. Returns NULL on failure.
+ */
+static void *map_aligned(size_t len) {
+    size_t over = len + HUGE_PAGE_SIZE;
+    char *p = mmap(NULL, over, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    // Trim the unaligned head and the tail left over
+    char *start = (char *) round_up((uintptr_t) p, HUGE_PAGE_SIZE);
+    if (start > p)
+        munmap(p, start - p);
+    if (p + over > start + len)
+        munmap(start + len, (p + over) - (start + len));
+    return start;
+}
+
+/**
+ * Returns zeroed memory for nmemb elements of the given size, like
+ * calloc(3), backed by huge pages as set by huge_set_mode() when it is
+ * at least HUGE_PAGE_SIZE bytes. It must be freed with huge_free()
+ * with the same nmemb and size. Returns NULL when out of memory.
+ */
+void *huge_calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size)
+        return NULL;
+    size_t n = nmemb * size;
+    if (n < HUGE_PAGE_SIZE)
+        return calloc(nmemb, size);
+
+    region_t *r = (region_t *) malloc(sizeof(region_t));
+    if (r == NULL)
+        return NULL;
+
+    size_t maplen = round_up(n, HUGE_PAGE_SIZE);
+    huge_mode_t m = huge_get_mode();
+    char *p = NULL;
+    int kind = KIND_REGULAR;
+
+    if (m == HUGE_PAGES_HUGETLB) {
+        p = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED)
+            p = NULL;  // pool empty or not configured, fall back to THP
+        else
+            kind = KIND_HUGETLB;
+    }
+    if (p == NULL) {
+        p = (m == HUGE_PAGES_OFF) ? mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+                                  : map_aligned(maplen);
+        if (p == MAP_FAILED || p == NULL) {
+            free(r);
+            return NULL;
+        }
+        // Not fatal if THP is disabled: the memory is still usable
+        if (m != HUGE_PAGES_OFF && madvise(p, maplen, MADV_HUGEPAGE) == 0)
+            kind = KIND_THP;
+    }
+
+    r->p = p;
+    r->kind = kind;
+    pthread_mutex_lock(&regions_lock);
+    r->next = regions;
+    regions = r;
+    pthread_mutex_unlock(&regions_lock);
+    __atomic_add_fetch(&allocated[kind], maplen, __ATOMIC_RELAXED);
+
+    return p;
+}
+
+/**
+ * Frees memory returned by huge_calloc(nmemb, size).
+ */
+void huge_free(void *p, size_t nmemb, size_t size) {
+    if (p == NULL)
+        return;
+    if (nmemb * size < HUGE_PAGE_SIZE) {
+        free(p);
+        return;
+    }
+
+    size_t maplen = round_up(nmemb * size, HUGE_PAGE_SIZE);
+    pthread_mutex_lock(&regions_lock);
+    region_t **link = &regions;
+    while ((*link)->p != p)
+        link = &(*link)->next;
+    region_t *r = *link;
+    *link = r->next;
+    pthread_mutex_unlock(&regions_lock);
+
+    __atomic_sub_fetch(&allocated[r->kind], maplen, __ATOMIC_RELAXED);
+    munmap(p, maplen);
+    free(r);
+}
+
+/**
+ * Fills st with the bytes currently mapped by each backing.
+ */
+void huge_stats(huge_stats_t *st) {
+    st->hugetlb = __atomic_load_n(&allocated[KIND_HUGETLB], __ATOMIC_RELAXED);
+    st->thp = __atomic_load_n(&allocated[KIND_THP], __ATOMIC_RELAXED);
+    st->regular = __atomic_load_n(&allocated[KIND_REGULAR], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,42 @@
+#ifndef _HTTP_HUGE_ALLOC_H
+#define _HTTP_HUGE_ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * How allocations of at least HUGE_PAGE_SIZE bytes are backed:
+ *   HUGE_PAGES_OFF      regular pages
+ *   HUGE_PAGES_THP      transparent huge pages, through madvise(MADV_HUGEPAGE)
+ *   HUGE_PAGES_HUGETLB  the hugetlbfs pool (MAP_HUGETLB), falling back to
+ *                       transparent huge pages when the pool is empty
+ * Smaller allocations always come from malloc.
+ */
+typedef enum {
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_THP,
+    HUGE_PAGES_HUGETLB,
+} huge_mode_t;
+
+/**
+ * Bytes currently allocated by each backing, for monitoring.
+ */
+typedef struct {
+    uint64_t hugetlb;
+    uint64_t thp;
+    uint64_t regular;
+} huge_stats_t;
+
+
+void        huge_set_mode(huge_mode_t mode);
+huge_mode_t huge_get_mode(void);
+int         huge_parse_mode(const char *s, huge_mode_t *mode);
+
+void *huge_calloc(size_t nmemb, size_t size);
+void  huge_free(void *p, size_t nmemb, size_t size);
+void  huge_stats(huge_stats_t *st);
+
+
+#endif  // _HTTP_HUGE_ALLOC_H
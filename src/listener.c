@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include "listener.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Descriptor kept in reserve by each accepting thread, to shed
+ * connections when out of descriptors, see shed_connection() */
+static _Thread_local int spare_fd = -1;
+
+
+static int set_opt(int fd, int level, int opt, int value) {
+    return setsockopt(fd, level, opt, &value, sizeof(value));
+}
+
+/**
+ * Accepts the next connection on lfd and closes it right away, with the
+ * descriptor kept in reserve. Out of descriptors, this tells the client
+ * at once, instead of leaving its connection queued where it keeps a
+ * level-triggered listener readable and the event loop spinning. Returns
+ * 1 if a connection was shed, 0 if the queue was empty (accept(2) reports
+ * EMFILE before looking at it), or -1 if no descriptor was in reserve.
+ */
+static int shed_connection(int lfd) {
+    if (spare_fd < 0)
+        return -1;
+
+    close(spare_fd);
+    int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+    int shed = (fd >= 0 || errno == ECONNABORTED);
+    if (fd >= 0)
+        close(fd);
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);  // may fail if taken meanwhile
+    return shed;
+}
+
+/**
+ * Opens a non-blocking listening socket on host (NULL for any address)
+ * and port, with the given options. Options the kernel does not support
+ * are skipped with a warning. Returns the socket, or -1 on error.
+ */
+int listener_open(const char *host, const char *port, const listener_opts_t *o) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "listener: %s\n", gai_strerror(err));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        set_opt(fd, SOL_SOCKET, SO_REUSEADDR, 1);
+        if (o->reuseport && set_opt(fd, SOL_SOCKET, SO_REUSEPORT, 1) != 0)
+            perror("listener: SO_REUSEPORT");
+
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, o->backlog) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        perror("listener");
+        return -1;
+    }
+
+    // Both are optimizations only: the listener works without them
+    if (o->defer_accept_s > 0 && set_opt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, o->defer_accept_s) != 0)
+        perror("listener: TCP_DEFER_ACCEPT");
+    if (o->fastopen_qlen > 0 && set_opt(fd, IPPROTO_TCP, TCP_FASTOPEN, o->fastopen_qlen) != 0)
+        perror("listener: TCP_FASTOPEN");
+
+    return fd;
+}
+
+/**
+ * Accepts the pending connections on listener lfd, up to o->batch of
+ * them, calling cb for each. Meant to be called when lfd is readable:
+ * draining several connections per event saves an epoll round trip for
+ * each of the others. With an edge-triggered (EPOLLET) listener, no new
+ * event comes for the connections left queued past the batch: the
+ * caller must call again as long as it returns o->batch.
+ *
+ * With o->speculative, each connection is read into buf right away. With
+ * TCP_DEFER_ACCEPT or Fast Open the request is usually there already, so
+ * it is served without waiting for another readiness event.
+ *
+ * Out of descriptors (EMFILE, ENFILE), connections are accepted and
+ * closed at once with a descriptor kept in reserve, and counted as taken
+ * off the queue. If there is none in reserve, -1 is returned with errno
+ * set: the caller should then stop polling lfd until it closes a
+ * connection, or it would wake up for the same queued connection forever.
+ *
+ * Returns the number of connections taken off the queue, or -1 on an
+ * error other than the queue being empty.
+ */
+int listener_accept(int lfd, const listener_opts_t *o, char *buf, size_t buflen,
+                    accept_fn cb, void *arg) {
+    int n = 0;
+
+    if (spare_fd < 0)
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    while (n < o->batch) {
+        struct sockaddr_storage addr;
+        socklen_t alen = sizeof(addr);
+        int fd = accept4(lfd, (struct sockaddr *) &addr, &alen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            // Aborted before accepted: the others are still there
+            if (errno == ECONNABORTED || errno == EINTR)
+                continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                int shed = shed_connection(lfd);
+                if (shed > 0) {
+                    n++;
+                    continue;
+                }
+                if (shed == 0)
+                    break;
+            }
+            return (n > 0) ? n : -1;
+        }
+        TRACE_CONN_ACCEPT(fd);
+        n++;
+
+        ssize_t len = 0;
+        if (o->speculative && buf != NULL) {
+            len = read(fd, buf, buflen);
+            if (len == 0)
+                len = -1;  // closed without sending anything
+            else if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                len = 0;
+        }
+        cb(fd, &addr, buf, len, arg);
+    }
+
+    return n;
+}
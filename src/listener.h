@@ -0,0 +1,38 @@
+#ifndef _HTTP_LISTENER_H
+#define _HTTP_LISTENER_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/**
+ * Listening socket options.
+ */
+typedef struct {
+    int backlog;
+    int reuseport;       // SO_REUSEPORT, for one listener per worker
+    int defer_accept_s;  // TCP_DEFER_ACCEPT: wake up only once the request
+                         // arrives, giving up after this many seconds. 0: off
+    int fastopen_qlen;   // TCP_FASTOPEN pending queue length, 0: off
+    int batch;           // connections accepted per readiness event at most
+    int speculative;     // read from new connections right away
+} listener_opts_t;
+
+#define LISTENER_DEFAULT_OPTS { 1024, 0, 5, 256, 64, 1 }
+
+/**
+ * Called for every accepted connection, which is non-blocking and
+ * close-on-exec. With speculative reads on, data holds the first
+ * len bytes already read from it; len is 0 if none were there yet and
+ * -1 if the peer closed it or the read failed (it is then best closed).
+ */
+typedef void (*accept_fn)(int fd, const struct sockaddr_storage *addr,
+                          const char *data, ssize_t len, void *arg);
+
+
+int listener_open(const char *host, const char *port, const listener_opts_t *o);
+int listener_accept(int lfd, const listener_opts_t *o, char *buf, size_t buflen,
+                    accept_fn cb, void *arg);
+
+
+#endif  // _HTTP_LISTENER_H
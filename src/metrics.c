@@ -0,0 +1,233 @@
+#include "metrics.h"
+#include "access_log.h"
+#include "huge_alloc.h"
+#include "xalloc.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Counters of the calling thread, set by metrics_register_worker() */
+_Thread_local worker_metrics_t *metrics_local;
+
+/* Length of a metrics_clock() tick, set by init_metrics() */
+double metrics_ns_per_tick = 1.0;
+
+static worker_metrics_t workers[METRICS_MAX_WORKERS];
+static int nworkers;
+
+/* Hash tables whose statistics are exported */
+static struct {
+    const char *name;
+    hasht_t *ht;
+} tables[METRICS_MAX_TABLES];
+static int ntables;
+
+
+/**
+ * Initializes the library. Should be called only once, before any
+ * worker records stage timings.
+ */
+void init_metrics(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    // Calibrate the time stamp counter against the monotonic clock
+    struct timespec t0, t1, pause = { 0, 10000000 };  // 10ms
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t c0 = metrics_clock();
+    nanosleep(&pause, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    uint64_t c1 = metrics_clock();
+
+    double ns = (double) (t1.tv_sec - t0.tv_sec) * 1e9
+                + (double) (t1.tv_nsec - t0.tv_nsec);
+    metrics_ns_per_tick = ns / (double) (c1 - c0);
+#endif
+}
+
+/**
+ * Assigns a counters slot to the calling thread. Must be called once by
+ * every worker thread before it counts anything.
+ */
+worker_metrics_t *metrics_register_worker(void) {
+    int i = __atomic_fetch_add(&nworkers, 1, __ATOMIC_RELAXED);
+    if (i >= METRICS_MAX_WORKERS)
+        fatal("metrics: more than %d workers", METRICS_MAX_WORKERS);
+
+    metrics_local = &workers[i];
+    return metrics_local;
+}
+
+/**
+ * Exports the statistics of the given hash table under the given name.
+ * The table is walked while rendering, so it must not be modified
+ * concurrently with a scrape: register only tables owned by the thread
+ * rendering the metrics, or tables no longer written to.
+ */
+void metrics_register_table(const char *name, hasht_t *ht) {
+    if (ntables == METRICS_MAX_TABLES)
+        return;
+    tables[ntables].name = name;
+    tables[ntables].ht = ht;
+    ntables++;
+}
+
+/**
+ * Output buffer that keeps counting once full, like snprintf(3).
+ */
+typedef struct {
+    char  *buf;
+    size_t len;
+    size_t off;
+} out_t;
+
+static void out_printf(out_t *o, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    size_t room = (o->off < o->len) ? o->len - o->off : 0;
+    int n = vsnprintf(o->buf + (room ? o->off : 0), room, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        o->off += (size_t) n;
+}
+
+static void out_header(out_t *o, const char *name, const char *type,
+                       const char *help) {
+    out_printf(o, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Returns the sum of the counter at the given offset in every worker.
+ */
+static uint64_t sum_counter(size_t offset) {
+    int n = __atomic_load_n(&nworkers, __ATOMIC_RELAXED);
+    if (n > METRICS_MAX_WORKERS)
+        n = METRICS_MAX_WORKERS;
+
+    uint64_t sum = 0;
+    for (int i = 0; i < n; i++) {
+        uint64_t *c = (uint64_t *) ((char *) &workers[i] + offset);
+        sum += __atomic_load_n(c, __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+#define SUM(field) sum_counter(offsetof(worker_metrics_t, field))
+
+/**
+ * Returns the upper bound, in nanoseconds, of the given stage histogram
+ * bucket. The last bucket has no bound.
+ */
+static uint64_t stage_bucket_bound(int i) {
+    if (i == 0)
+        return 1ull << STAGE_MIN_SHIFT;
+
+    int shift = STAGE_MIN_SHIFT + ((i - 1) >> STAGE_SUB_BITS);
+    uint64_t sub = (uint64_t) ((i - 1) & ((1 << STAGE_SUB_BITS) - 1)) + 1;
+    return (1ull << shift) + (sub << (shift - STAGE_SUB_BITS));
+}
+
+/**
+ * Renders the latency histogram of every stage, with cumulative buckets
+ * in seconds as Prometheus expects.
+ */
+static void render_stages(out_t *o) {
+    static const char *stages[STAGE_COUNT] = { "accept", "parse", "handle", "write" };
+
+    out_header(o, "http_stage_duration_seconds", "histogram",
+               "Time spent in each request stage.");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        uint64_t count = 0;
+        for (int i = 0; i < STAGE_BUCKETS; i++) {
+            count += SUM(stage_counts[s][i]);
+            if (i < STAGE_BUCKETS - 1) {
+                out_printf(o, "http_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %"
+                           PRIu64 "\n", stages[s], stage_bucket_bound(i) / 1e9, count);
+            } else {
+                out_printf(o, "http_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %"
+                           PRIu64 "\n", stages[s], count);
+            }
+        }
+        out_printf(o, "http_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n",
+                   stages[s], SUM(stage_sum_ns[s]) / 1e9);
+        out_printf(o, "http_stage_duration_seconds_count{stage=\"%s\"} %" PRIu64 "\n",
+                   stages[s], count);
+    }
+}
+
+/**
+ * Renders all the metrics in the Prometheus text exposition format into
+ * buf, which holds len bytes. Returns the length of the whole output; if
+ * it is len or more, the output was truncated and a bigger buffer is
+ * needed.
+ */
+size_t metrics_render(char *buf, size_t len) {
+    out_t o = { buf, len, 0 };
+
+    out_header(&o, "http_requests_total", "counter", "Requests served.");
+    out_printf(&o, "http_requests_total %" PRIu64 "\n", SUM(requests));
+
+    out_header(&o, "http_responses_total", "counter", "Responses by status class.");
+    static const char *classes[] = { "other", "1xx", "2xx", "3xx", "4xx", "5xx" };
+    for (int c = 0; c < 6; c++) {
+        out_printf(&o, "http_responses_total{code=\"%s\"} %" PRIu64 "\n", classes[c],
+                   SUM(status[c]));
+    }
+
+    out_header(&o, "http_received_bytes_total", "counter", "Bytes read from clients.");
+    out_printf(&o, "http_received_bytes_total %" PRIu64 "\n", SUM(bytes_in));
+    out_header(&o, "http_sent_bytes_total", "counter", "Bytes written to clients.");
+    out_printf(&o, "http_sent_bytes_total %" PRIu64 "\n", SUM(bytes_out));
+
+    // Closes are read first so the gauge never goes negative
+    uint64_t closed = SUM(connections_closed);
+    uint64_t opened = SUM(connections_opened);
+    out_header(&o, "http_connections_total", "counter", "Connections accepted.");
+    out_printf(&o, "http_connections_total %" PRIu64 "\n", opened);
+    out_header(&o, "http_connections_active", "gauge", "Connections currently open.");
+    out_printf(&o, "http_connections_active %" PRIu64 "\n", opened - closed);
+
+    out_header(&o, "http_cache_requests_total", "counter", "Cache lookups by result.");
+    out_printf(&o, "http_cache_requests_total{result=\"hit\"} %" PRIu64 "\n", SUM(cache_hits));
+    out_printf(&o, "http_cache_requests_total{result=\"miss\"} %" PRIu64 "\n", SUM(cache_misses));
+
+    out_header(&o, "http_access_log_dropped_total", "counter",
+               "Access log lines dropped because the log could not keep up.");
+    out_printf(&o, "http_access_log_dropped_total %" PRIu64 "\n", access_log_dropped());
+    out_header(&o, "http_access_log_dropped_bytes_total", "counter",
+               "Bytes of the access log lines dropped.");
+    out_printf(&o, "http_access_log_dropped_bytes_total %" PRIu64 "\n", access_log_dropped_bytes());
+    out_header(&o, "http_access_log_write_errors_total", "counter",
+               "Failed writes to the access log, retried later.");
+    out_printf(&o, "http_access_log_write_errors_total %" PRIu64 "\n", access_log_write_errors());
+
+    huge_stats_t hs;
+    huge_stats(&hs);
+    out_header(&o, "http_large_alloc_bytes", "gauge", "Bytes in large allocations, by page backing.");
+    out_printf(&o, "http_large_alloc_bytes{pages=\"hugetlb\"} %" PRIu64 "\n", hs.hugetlb);
+    out_printf(&o, "http_large_alloc_bytes{pages=\"thp\"} %" PRIu64 "\n", hs.thp);
+    out_printf(&o, "http_large_alloc_bytes{pages=\"regular\"} %" PRIu64 "\n", hs.regular);
+
+    render_stages(&o);
+
+    if (ntables > 0) {
+        hash_stats_t st[METRICS_MAX_TABLES];
+        for (int i = 0; i < ntables; i++)
+            hash_stats(tables[i].ht, &st[i]);
+
+        out_header(&o, "hash_table_slots", "gauge", "Size of the hash table.");
+        for (int i = 0; i < ntables; i++)
+            out_printf(&o, "hash_table_slots{table=\"%s\"} %d\n", tables[i].name, st[i].m);
+        out_header(&o, "hash_table_entries", "gauge", "Elements stored in the hash table.");
+        for (int i = 0; i < ntables; i++)
+            out_printf(&o, "hash_table_entries{table=\"%s\"} %d\n", tables[i].name, st[i].n);
+        out_header(&o, "hash_table_used_slots", "gauge", "Slots holding at least one element.");
+        for (int i = 0; i < ntables; i++)
+            out_printf(&o, "hash_table_used_slots{table=\"%s\"} %d\n", tables[i].name, st[i].used);
+        out_header(&o, "hash_table_longest_chain", "gauge", "Length of the longest chain.");
+        for (int i = 0; i < ntables; i++)
+            out_printf(&o, "hash_table_longest_chain{table=\"%s\"} %d\n", tables[i].name, st[i].longest);
+    }
+
+    return o.off;
+}
@@ -0,0 +1,147 @@
+#ifndef _HTTP_METRICS_H
+#define _HTTP_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "hash_table.h"
+
+#define METRICS_PATH         "/metrics"
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+#define METRICS_MAX_WORKERS 256
+#define METRICS_MAX_TABLES  16
+#define CACHE_LINE_SIZE     64
+
+/**
+ * Request stages timed into per-worker latency histograms:
+ *   accept  from accept() to the first request byte read
+ *   parse   from the first byte read to a fully parsed request
+ *   handle  running the request handler
+ *   write   from the first response byte written to the last
+ */
+enum {
+    STAGE_ACCEPT,
+    STAGE_PARSE,
+    STAGE_HANDLE,
+    STAGE_WRITE,
+    STAGE_COUNT
+};
+
+/*
+ * Stage histograms are log-linear over nanoseconds: each power of two
+ * from 2^STAGE_MIN_SHIFT to 2^STAGE_MAX_SHIFT (256ns to ~17s) is split in
+ * 2^STAGE_SUB_BITS buckets, plus one bucket below and one above the range.
+ */
+#define STAGE_MIN_SHIFT 8
+#define STAGE_MAX_SHIFT 34
+#define STAGE_SUB_BITS  1
+#define STAGE_BUCKETS   (((STAGE_MAX_SHIFT - STAGE_MIN_SHIFT) << STAGE_SUB_BITS) + 2)
+
+/**
+ * Counters of a single worker thread.
+ *
+ * Each worker owns one, aligned to its own cache lines, and is the only
+ * one writing it, so counting is a plain load and store: no atomic
+ * read-modify-write and no cache line bouncing between workers. Scrapes
+ * read every worker and add them up.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) uint64_t requests;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t status[6];           // responses by class, 1xx-5xx, 0 for others
+    uint64_t connections_opened;
+    uint64_t connections_closed;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+
+    uint64_t stage_counts[STAGE_COUNT][STAGE_BUCKETS];
+    uint64_t stage_sum_ns[STAGE_COUNT];
+} worker_metrics_t;
+
+extern _Thread_local worker_metrics_t *metrics_local;
+extern double metrics_ns_per_tick;
+
+
+void              init_metrics(void);
+worker_metrics_t *metrics_register_worker(void);
+void              metrics_register_table(const char *name, hasht_t *ht);
+
+size_t metrics_render(char *buf, size_t len);
+
+/**
+ * Adds v to a counter of the calling thread. Relaxed atomic accesses
+ * compile to plain moves; they only keep concurrent scrapes well defined.
+ */
+static inline void metrics_add(uint64_t *counter, uint64_t v) {
+    uint64_t old = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    __atomic_store_n(counter, old + v, __ATOMIC_RELAXED);
+}
+
+/**
+ * Accounts for a served request in the calling worker counters.
+ */
+static inline void metrics_count_response(int status, size_t bytes_in,
+                                          size_t bytes_out) {
+    worker_metrics_t *w = metrics_local;
+    int class = (status >= 100 && status < 600) ? status / 100 : 0;
+
+    metrics_add(&w->requests, 1);
+    metrics_add(&w->status[class], 1);
+    metrics_add(&w->bytes_in, bytes_in);
+    metrics_add(&w->bytes_out, bytes_out);
+}
+
+/**
+ * Returns a timestamp for stage timings, in clock ticks. It reads the
+ * time stamp counter where there is one, which is far cheaper than
+ * clock_gettime(2); the coarse clocks are cheap too but only tick every
+ * few milliseconds, more than most stages take.
+ */
+static inline uint64_t metrics_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+/**
+ * Returns the stage histogram bucket for a duration in nanoseconds.
+ * Buckets include their upper bound, as the "le" label says.
+ */
+static inline int metrics_stage_bucket(uint64_t ns) {
+    if (ns <= (1ull << STAGE_MIN_SHIFT))
+        return 0;
+
+    ns--;
+    int msb = 63 - __builtin_clzll(ns);
+    if (msb >= STAGE_MAX_SHIFT)
+        return STAGE_BUCKETS - 1;
+
+    int sub = (int) (ns >> (msb - STAGE_SUB_BITS)) & ((1 << STAGE_SUB_BITS) - 1);
+    return 1 + ((msb - STAGE_MIN_SHIFT) << STAGE_SUB_BITS) + sub;
+}
+
+/**
+ * Records that the given stage took from tick start to tick end, as
+ * returned by metrics_clock(), in the calling worker histograms.
+ */
+static inline void metrics_record_stage(int stage, uint64_t start, uint64_t end) {
+    worker_metrics_t *w = metrics_local;
+    uint64_t ns = (uint64_t) ((double) (end - start) * metrics_ns_per_tick);
+
+    metrics_add(&w->stage_counts[stage][metrics_stage_bucket(ns)], 1);
+    metrics_add(&w->stage_sum_ns[stage], ns);
+}
+
+
+#endif  // _HTTP_METRICS_H
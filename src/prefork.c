@@ -0,0 +1,121 @@
+#include "prefork.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Workers by slot. pid is 0 once exited for good, -1 while waiting to be
+ * restarted. */
+static struct {
+    pid_t  pid;
+    time_t started;
+} workers[PREFORK_MAX_WORKERS];
+
+
+/**
+ * Forks the worker in slot id. The child runs with the signal mask the
+ * master had before prefork_run() and never returns.
+ */
+static void spawn(int id, prefork_fn fn, void *arg, const sigset_t *mask) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("prefork: fork");
+        workers[id].pid = -1;  // retried later
+        workers[id].started = time(NULL);
+        return;
+    }
+    if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        sigprocmask(SIG_SETMASK, mask, NULL);
+        _exit(fn(id, arg));
+    }
+
+    workers[id].pid = pid;
+    workers[id].started = time(NULL);
+}
+
+static int find(pid_t pid, int nworkers) {
+    for (int i = 0; i < nworkers; i++) {
+        if (workers[i].pid == pid)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Forks nworkers processes running fn(id, arg) and supervises them until
+ * the master gets SIGTERM or SIGINT, which is passed on to the workers.
+ * Workers exiting with a signal or a non-zero status are restarted;
+ * those crashing within PREFORK_MIN_UPTIME of starting are restarted
+ * after that delay, so a crash loop does not eat the CPU. Returns 0 once
+ * all the workers have exited, or -1 on error.
+ */
+int prefork_run(int nworkers, prefork_fn fn, void *arg) {
+    if (nworkers < 1 || nworkers > PREFORK_MAX_WORKERS)
+        return -1;
+
+    // Signals are taken synchronously by sigtimedwait() below
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &set, &old) != 0)
+        return -1;
+
+    for (int i = 0; i < nworkers; i++)
+        spawn(i, fn, arg, &old);
+
+    int alive = nworkers, stopping = 0;
+    while (alive > 0) {
+        // Time out to retry the restarts that were delayed or failed
+        struct timespec tick = { PREFORK_MIN_UPTIME, 0 };
+        int sig = sigtimedwait(&set, NULL, &tick);
+
+        if ((sig == SIGTERM || sig == SIGINT) && !stopping) {
+            stopping = 1;
+            for (int i = 0; i < nworkers; i++) {
+                if (workers[i].pid > 0) {
+                    kill(workers[i].pid, SIGTERM);
+                } else if (workers[i].pid == -1) {
+                    workers[i].pid = 0;  // no longer restarted
+                    alive--;
+                }
+            }
+        }
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            int id = find(pid, nworkers);
+            if (id < 0)
+                continue;
+            workers[id].pid = 0;
+
+            int crashed = WIFSIGNALED(status) || (WIFEXITED(status) && WEXITSTATUS(status) != 0);
+            if (crashed && !stopping) {
+                fprintf(stderr, "prefork: worker %d (pid %d) %s %d, restarting\n", id, (int) pid,
+                        WIFSIGNALED(status) ? "killed by signal" : "exited with",
+                        WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+                workers[id].pid = -1;  // to restart
+            } else {
+                alive--;
+            }
+        }
+
+        if (stopping)
+            continue;
+        time_t now = time(NULL);
+        for (int i = 0; i < nworkers; i++) {
+            if (workers[i].pid == -1 && now - workers[i].started >= PREFORK_MIN_UPTIME)
+                spawn(i, fn, arg, &old);
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
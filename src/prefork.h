@@ -0,0 +1,25 @@
+#ifndef _HTTP_PREFORK_H
+#define _HTTP_PREFORK_H
+
+#define PREFORK_MAX_WORKERS 256
+#define PREFORK_MIN_UPTIME  1  // seconds; workers dying sooner are restarted slower
+
+/**
+ * Runs a worker process. id is its slot, from 0 to nworkers - 1, kept by
+ * the processes restarted in its place. Returns the exit status.
+ */
+typedef int (*prefork_fn)(int id, void *arg);
+
+/**
+ * Pre-fork multi-process mode: as an alternative to threads, a master
+ * process forks the workers and restarts any that crash, so a crash
+ * only takes down the connections of one worker.
+ *
+ * Everything set up before prefork_run() is shared by the workers: the
+ * listening sockets, and shared-memory caches such as shm_table_t
+ * (see shm_table.h). The master itself serves nothing.
+ */
+int prefork_run(int nworkers, prefork_fn fn, void *arg);
+
+
+#endif  // _HTTP_PREFORK_H
@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+#include "reload.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+#define MAX_ENV 1024
+
+
+/**
+ * Writes the given tables to a new memory-backed file, rewound and ready
+ * to be read by the new process. Returns its fd, or -1 on error.
+ */
+static int write_snapshot(hasht_t *const *tables, int ntables) {
+    int fd = memfd_create("http_snapshot", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    FILE *f = fdopen(dup(fd), "w");
+    int ok = (f != NULL);
+    for (int i = 0; ok && i < ntables; i++)
+        ok = hash_save(tables[i], f) == 0;
+    if (f != NULL && fclose(f) != 0)
+        ok = 0;
+
+    if (!ok || lseek(fd, 0, SEEK_SET) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Builds the environment of the new process: ours, minus any previous
+ * reload variables, plus the new ones. Done before fork(), as the child
+ * of a threaded process may only call async-signal-safe functions.
+ */
+static char **build_env(char *vars[3]) {
+    static char *env[MAX_ENV + 4];
+    static const char *names[] = { RELOAD_ENV_LISTEN_FDS "=", RELOAD_ENV_SNAPSHOT "=",
+                                   RELOAD_ENV_READY "=" };
+    int n = 0;
+
+    for (char **e = environ; *e != NULL && n < MAX_ENV; e++) {
+        int ours = 0;
+        for (int i = 0; i < 3; i++)
+            ours |= strncmp(*e, names[i], strlen(names[i])) == 0;
+        if (!ours)
+            env[n++] = *e;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (vars[i] != NULL)
+            env[n++] = vars[i];
+    }
+    env[n] = NULL;
+    return env;
+}
+
+/**
+ * Starts argv[0], passing it the listening sockets fds and a snapshot of
+ * the given cache tables, and fills in r. Returns 0, or -1 if it could
+ * not be started, in which case the caller just keeps serving.
+ *
+ * This does not wait for the new process: the caller adds r->ready_fd
+ * to its event loop and calls reload_finish() when it becomes readable,
+ * or reload_abort() if that takes too long.
+ *
+ * The snapshot is written to memory on the calling thread, though, in
+ * time proportional to the size of the tables. With large caches, call
+ * this from a thread other than an event loop, or the loop stalls.
+ */
+int reload_spawn(reload_t *r, char *const argv[], const int *fds, int nfds,
+                 hasht_t *const *tables, int ntables) {
+    if (nfds > RELOAD_MAX_FDS)
+        return -1;
+
+    int snap = -1;
+    if (ntables > 0 && (snap = write_snapshot(tables, ntables)) < 0)
+        return -1;
+
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) != 0) {
+        if (snap >= 0)
+            close(snap);
+        return -1;
+    }
+    fcntl(ready[0], F_SETFL, O_NONBLOCK);  // the new process gets a blocking end
+
+    // Environment variables, built before forking
+    char listen_var[32 + RELOAD_MAX_FDS * 12], snap_var[32], ready_var[32];
+    int off = snprintf(listen_var, sizeof(listen_var), "%s=", RELOAD_ENV_LISTEN_FDS);
+    for (int i = 0; i < nfds; i++)
+        off += snprintf(listen_var + off, sizeof(listen_var) - off, i ? ",%d" : "%d", fds[i]);
+    snprintf(snap_var, sizeof(snap_var), "%s=%d", RELOAD_ENV_SNAPSHOT, snap);
+    snprintf(ready_var, sizeof(ready_var), "%s=%d", RELOAD_ENV_READY, ready[1]);
+    char *vars[3] = { listen_var, (snap >= 0) ? snap_var : NULL, ready_var };
+    char **env = build_env(vars);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Keep the passed descriptors open across exec
+        for (int i = 0; i < nfds; i++)
+            fcntl(fds[i], F_SETFD, 0);
+        if (snap >= 0)
+            fcntl(snap, F_SETFD, 0);
+        fcntl(ready[1], F_SETFD, 0);
+
+        execve(argv[0], argv, env);
+        _exit(127);
+    }
+
+    close(ready[1]);
+    if (snap >= 0)
+        close(snap);
+    if (pid < 0) {
+        close(ready[0]);
+        return -1;
+    }
+
+    r->pid = pid;
+    r->ready_fd = ready[0];
+    return 0;
+}
+
+/**
+ * Checks whether the process started by reload_spawn() is ready, once
+ * r->ready_fd is readable. Returns 1 if it is: the caller should then
+ * stop accepting, drain its connections and exit. Returns 0 if not yet,
+ * on a spurious or interrupted wakeup. Returns -1 if it died before
+ * getting ready, in which case it is reaped and the caller just keeps
+ * serving. r->ready_fd is closed unless 0 is returned.
+ */
+int reload_finish(reload_t *r) {
+    char c;
+    ssize_t n = read(r->ready_fd, &c, 1);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+
+    if (n != 1) {
+        // EOF: the new process exited, or exec failed
+        reload_abort(r);
+        return -1;
+    }
+    close(r->ready_fd);
+    r->ready_fd = -1;
+    return 1;
+}
+
+/**
+ * Kills and reaps the process started by reload_spawn(), which did not
+ * get ready in time, and closes r->ready_fd. The caller keeps serving.
+ */
+void reload_abort(reload_t *r) {
+    close(r->ready_fd);
+    r->ready_fd = -1;
+    kill(r->pid, SIGKILL);
+    while (waitpid(r->pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+}
+
+/**
+ * Returns the number of listening sockets inherited from the previous
+ * process, storing them in fds, or 0 on a fresh start. Descriptors that
+ * are not listening sockets are skipped.
+ */
+int reload_inherited(int *fds, int max) {
+    const char *s = getenv(RELOAD_ENV_LISTEN_FDS);
+    int n = 0;
+
+    while (s != NULL && *s != '\0' && n < max) {
+        char *end;
+        long fd = strtol(s, &end, 10);
+        if (end == s)
+            break;
+
+        int listening = 0;
+        socklen_t len = sizeof(listening);
+        if (getsockopt((int) fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == 0 && listening) {
+            fcntl((int) fd, F_SETFD, FD_CLOEXEC);
+            fds[n++] = (int) fd;
+        }
+        s = (*end == ',') ? end + 1 : end;
+    }
+    unsetenv(RELOAD_ENV_LISTEN_FDS);
+
+    return n;
+}
+
+/**
+ * Returns the cache snapshot passed by the previous process, to be read
+ * with hash_load() and closed with fclose(), or NULL if there is none.
+ */
+FILE *reload_snapshot() {
+    const char *s = getenv(RELOAD_ENV_SNAPSHOT);
+    if (s == NULL)
+        return NULL;
+
+    int fd = atoi(s);
+    unsetenv(RELOAD_ENV_SNAPSHOT);
+    if (fcntl(fd, F_GETFD) < 0)
+        return NULL;
+    return fdopen(fd, "r");
+}
+
+/**
+ * Tells the previous process, if any, that this one is now serving, so
+ * it stops accepting and drains.
+ */
+void reload_ready() {
+    const char *s = getenv(RELOAD_ENV_READY);
+    if (s == NULL)
+        return;
+
+    int fd = atoi(s);
+    unsetenv(RELOAD_ENV_READY);
+    // Not fatal: the previous process times out and keeps serving
+    char c = 1;
+    if (write(fd, &c, 1) != 1)
+        perror("reload_ready");
+    close(fd);
+}
@@ -0,0 +1,51 @@
+#ifndef _HTTP_RELOAD_H
+#define _HTTP_RELOAD_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "hash_table.h"
+
+#define RELOAD_MAX_FDS 16
+
+/* Environment variables the old process passes to the new one */
+#define RELOAD_ENV_LISTEN_FDS "HTTP_LISTEN_FDS"    // "3,4": inherited listeners
+#define RELOAD_ENV_SNAPSHOT   "HTTP_SNAPSHOT_FD"   // cache tables, see hash_save()
+#define RELOAD_ENV_READY      "HTTP_READY_FD"      // write end of the ready pipe
+
+/**
+ * A new process started by reload_spawn(), not known to be ready yet.
+ */
+typedef struct {
+    pid_t pid;
+    int   ready_fd;  // non-blocking, readable once it is ready or died
+} reload_t;
+
+/**
+ * Zero-downtime binary reload.
+ *
+ * The running server, say on SIGUSR2, calls reload_spawn() with the new
+ * binary, its listening sockets and its cache tables. The new process
+ * inherits the sockets, so no connection attempt is ever refused, and
+ * the caches, so it does not start cold. Once it is serving it calls
+ * reload_ready(), which makes reload_t.ready_fd readable in the old
+ * process. The old process waits for that in its event loop, keeping
+ * on serving meanwhile. Once reload_finish() returns 1, it closes its
+ * listeners, finishes the requests in flight and exits.
+ *
+ * At startup a server calls reload_inherited() to tell a fresh start,
+ * which opens new listeners, from a reload, and loads the caches from
+ * reload_snapshot() in the order they were given to reload_spawn().
+ */
+
+int   reload_spawn(reload_t *r, char *const argv[], const int *fds, int nfds,
+                   hasht_t *const *tables, int ntables);
+int   reload_finish(reload_t *r);
+void  reload_abort(reload_t *r);
+
+int   reload_inherited(int *fds, int max);
+FILE *reload_snapshot(void);
+void  reload_ready(void);
+
+
+#endif  // _HTTP_RELOAD_H
@@ -0,0 +1,311 @@
+#include "scheduler.h"
+#include "xalloc.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEQUE_MASK    (SCHED_DEQUE_SIZE - 1)
+#define MAX_DEQUES    (2 * SCHED_MAX_WORKERS)  // workers and submitting threads
+#define STEAL_ROUNDS  64                       // failed steal rounds before sleeping
+
+struct scheduler {
+    int       nworkers;
+    pthread_t threads[SCHED_MAX_WORKERS];
+
+    // Deques of the workers and of every thread that submitted a task,
+    // freed with the scheduler
+    deque_t  *deques[MAX_DEQUES];
+    const void *owners[MAX_DEQUES];  // thread pushing to each, see local_deque()
+    int       ndeques;
+
+    int       nidle;  // workers asleep, or about to be
+    int       stop;
+    uint64_t  generation;  // tells schedulers apart, unlike their address
+    pthread_mutex_t idle_lock;
+    pthread_cond_t  idle_cond;
+};
+
+/* Deque of the calling thread, and generation of the scheduler it is
+ * registered with, see local_deque() */
+static _Thread_local deque_t *local;
+static _Thread_local uint64_t local_generation;
+
+static uint64_t next_generation = 1;
+
+
+/**
+ * Initializes an empty deque.
+ */
+void deque_init(deque_t *d) {
+    d->top = d->bottom = 0;
+    d->tasks = (task_t **) xcalloc(SCHED_DEQUE_SIZE, sizeof(task_t *));
+}
+
+void deque_free(deque_t *d) {
+    free(d->tasks);
+}
+
+/**
+ * Pushes t at the bottom of the deque. Owner only. Returns -1 if the
+ * deque is full, 0 otherwise.
+ */
+int deque_push(deque_t *d, task_t *t) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - top >= SCHED_DEQUE_SIZE)
+        return -1;
+
+    __atomic_store_n(&d->tasks[b & DEQUE_MASK], t, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * Takes the task at the bottom of the deque, the newest one. Owner
+ * only. Returns NULL if the deque is empty.
+ */
+task_t *deque_take(deque_t *d) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (top > b) {
+        // Empty
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    task_t *t = __atomic_load_n(&d->tasks[b & DEQUE_MASK], __ATOMIC_RELAXED);
+    if (top == b) {
+        // Last task: race the thieves for it
+        if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            t = NULL;
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return t;
+}
+
+/**
+ * Steals the task at the top of the deque, the oldest one, from any
+ * thread. Returns NULL if the deque is empty or another thread took
+ * the task first.
+ */
+task_t *deque_steal(deque_t *d) {
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (top >= b)
+        return NULL;
+
+    task_t *t = __atomic_load_n(&d->tasks[top & DEQUE_MASK], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return t;
+}
+
+
+/**
+ * Registers d, owned by the calling thread, with the scheduler, so
+ * workers steal from it.
+ */
+static void add_deque(scheduler_t *s, deque_t *d) {
+    int i = __atomic_fetch_add(&s->ndeques, 1, __ATOMIC_RELAXED);
+    if (i >= MAX_DEQUES)
+        fatal("scheduler: more than %d threads", MAX_DEQUES);
+    s->owners[i] = &local;
+    __atomic_store_n(&s->deques[i], d, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns the deque the calling thread registered with s, or NULL. The
+ * address of its own thread-local tells it apart from the live threads;
+ * one that ended may have had the same, and its deque is then reused.
+ */
+static deque_t *own_deque(scheduler_t *s) {
+    int n = __atomic_load_n(&s->ndeques, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n && i < MAX_DEQUES; i++) {
+        deque_t *d = __atomic_load_n(&s->deques[i], __ATOMIC_ACQUIRE);
+        if (d != NULL && s->owners[i] == &local)
+            return d;
+    }
+    return NULL;
+}
+
+/**
+ * Returns the deque of the calling thread, creating it on first use.
+ * The scheduler is recognized by its generation: a new one allocated at
+ * the address of a freed one must not get the freed deque. A thread
+ * going back and forth between schedulers finds its deque again in each.
+ */
+static deque_t *local_deque(scheduler_t *s) {
+    if (local_generation != s->generation) {
+        local = own_deque(s);
+        if (local == NULL) {
+            local = (deque_t *) xmalloc(sizeof(deque_t));
+            deque_init(local);
+            add_deque(s, local);
+        }
+        local_generation = s->generation;
+    }
+    return local;
+}
+
+/**
+ * Steals a task from any deque but own, starting at a random one.
+ */
+static task_t *steal_any(scheduler_t *s, deque_t *own, unsigned *seed) {
+    int n = __atomic_load_n(&s->ndeques, __ATOMIC_ACQUIRE);
+    if (n > MAX_DEQUES)
+        n = MAX_DEQUES;
+
+    int start = (n > 0) ? (int) (rand_r(seed) % n) : 0;
+    for (int i = 0; i < n; i++) {
+        deque_t *d = __atomic_load_n(&s->deques[(start + i) % n], __ATOMIC_ACQUIRE);
+        if (d == NULL || d == own)
+            continue;
+        task_t *t = deque_steal(d);
+        if (t != NULL)
+            return t;
+    }
+    return NULL;
+}
+
+static int any_work(scheduler_t *s) {
+    int n = __atomic_load_n(&s->ndeques, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n && i < MAX_DEQUES; i++) {
+        deque_t *d = __atomic_load_n(&s->deques[i], __ATOMIC_ACQUIRE);
+        if (d != NULL && __atomic_load_n(&d->top, __ATOMIC_RELAXED)
+                         < __atomic_load_n(&d->bottom, __ATOMIC_RELAXED))
+            return 1;
+    }
+    return 0;
+}
+
+static void run_task(task_t *t) {
+    t->run(t);
+    completion_post(t->cq, &t->done);
+}
+
+static void *worker(void *arg) {
+    scheduler_t *s = arg;
+    deque_t *own = local_deque(s);
+    unsigned seed = (unsigned) (uintptr_t) own;
+    int idle_rounds = 0;
+
+    for (;;) {
+        // Own tasks, pushed by the tasks run here, then stolen ones
+        task_t *t = deque_take(own);
+        if (t == NULL)
+            t = steal_any(s, own, &seed);
+        if (t != NULL) {
+            run_task(t);
+            idle_rounds = 0;
+            continue;
+        }
+        if (++idle_rounds < STEAL_ROUNDS)
+            continue;
+
+        // Announce going to sleep, then check for work once more: with
+        // the fence, either this sees a task pushed meanwhile or the
+        // submitter sees nidle and signals
+        pthread_mutex_lock(&s->idle_lock);
+        __atomic_add_fetch(&s->nidle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (!s->stop && !any_work(s))
+            pthread_cond_wait(&s->idle_cond, &s->idle_lock);
+        __atomic_sub_fetch(&s->nidle, 1, __ATOMIC_RELAXED);
+        // Submitters wake one worker per task at most: pass it on while
+        // there is more work than that
+        if (__atomic_load_n(&s->nidle, __ATOMIC_RELAXED) > 0 && any_work(s))
+            pthread_cond_signal(&s->idle_cond);
+        int stop = s->stop && !any_work(s);
+        pthread_mutex_unlock(&s->idle_lock);
+        if (stop) {
+            local = NULL;  // freed by scheduler_free()
+            local_generation = 0;
+            return NULL;
+        }
+        idle_rounds = 0;
+    }
+}
+
+/**
+ * Returns a new scheduler with nworkers threads, usually one per core
+ * not running an event loop.
+ */
+scheduler_t *scheduler_new(int nworkers) {
+    if (nworkers < 1)
+        nworkers = 1;
+    if (nworkers > SCHED_MAX_WORKERS)
+        nworkers = SCHED_MAX_WORKERS;
+
+    scheduler_t *s = (scheduler_t *) xcalloc(1, sizeof(scheduler_t));
+    s->nworkers = nworkers;
+    s->generation = __atomic_fetch_add(&next_generation, 1, __ATOMIC_RELAXED);
+    pthread_mutex_init(&s->idle_lock, NULL);
+    pthread_cond_init(&s->idle_cond, NULL);
+
+    for (int i = 0; i < nworkers; i++) {
+        int err = pthread_create(&s->threads[i], NULL, worker, s);
+        if (err != 0)
+            fatal("scheduler_new: %s", strerror(err));
+    }
+
+    return s;
+}
+
+/**
+ * Runs the tasks already submitted, then stops the workers and frees the
+ * scheduler with all the deques. No thread may submit to it any more;
+ * those that did get a new deque if they submit to another scheduler.
+ */
+void scheduler_free(scheduler_t *s) {
+    pthread_mutex_lock(&s->idle_lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->idle_cond);
+    pthread_mutex_unlock(&s->idle_lock);
+
+    for (int i = 0; i < s->nworkers; i++)
+        pthread_join(s->threads[i], NULL);
+
+    for (int i = 0; i < s->ndeques; i++) {
+        deque_free(s->deques[i]);
+        free(s->deques[i]);
+    }
+    if (local_generation == s->generation) {
+        local = NULL;
+        local_generation = 0;
+    }
+    pthread_mutex_destroy(&s->idle_lock);
+    pthread_cond_destroy(&s->idle_cond);
+    free(s);
+}
+
+/**
+ * Submits t, to be run on a worker; its completion is then posted to
+ * t->cq. The task goes to the calling thread's own deque, so submitting
+ * takes no lock, and idle workers steal it from there. Tasks can submit
+ * further tasks, which their worker runs next unless stolen.
+ *
+ * If the deque is full the task runs right away on the calling thread,
+ * slowing down the submitter rather than queueing without bound.
+ */
+void scheduler_submit(scheduler_t *s, task_t *t) {
+    if (deque_push(local_deque(s), t) != 0) {
+        run_task(t);
+        return;
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->nidle, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&s->idle_lock);
+        pthread_cond_signal(&s->idle_cond);
+        pthread_mutex_unlock(&s->idle_lock);
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef _HTTP_SCHEDULER_H
+#define _HTTP_SCHEDULER_H
+
+#include <stdint.h>
+
+#include "completion.h"
+
+#define SCHED_MAX_WORKERS 256
+#define SCHED_DEQUE_SIZE  4096  // tasks per worker deque, power of 2
+
+/**
+ * A CPU-heavy task, such as compressing or rendering a response. The
+ * submitter owns it and keeps it alive until done.fn runs on the thread
+ * draining cq, typically the event loop of the originating connection.
+ */
+typedef struct task {
+    completion_t        done;  // posted to cq once run() returned
+    completion_queue_t *cq;
+    void (*run)(struct task *t);  // the work, run on a scheduler worker
+} task_t;
+
+/**
+ * Work-stealing deque of one worker (Chase and Lev, "Dynamic Circular
+ * Work-Stealing Deque", with the C11 memory orders of Le et al.). Its
+ * owner pushes and takes at the bottom, with no atomic read-modify-write
+ * unless one task is left; thieves take from the top.
+ */
+typedef struct {
+    _Alignas(64) int64_t top;
+    _Alignas(64) int64_t bottom;
+    task_t **tasks;
+} deque_t;
+
+typedef struct scheduler scheduler_t;
+
+
+void    deque_init(deque_t *d);
+void    deque_free(deque_t *d);
+int     deque_push(deque_t *d, task_t *t);
+task_t *deque_take(deque_t *d);
+task_t *deque_steal(deque_t *d);
+
+scheduler_t *scheduler_new(int nworkers);
+void         scheduler_free(scheduler_t *s);
+void         scheduler_submit(scheduler_t *s, task_t *t);
+
+
+#endif  // _HTTP_SCHEDULER_H
@@ -0,0 +1,578 @@
+#define _GNU_SOURCE
+#include "shm_table.h"
+#include "hash_table.h"
+#include "xalloc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MIN_CLASS      5  // 32 byte blocks
+#define MIN_TABLE_SIZE 16
+#define READ_TRIES     4  // lock-free lookups before taking the lock
+
+#define AT(t, off) ((void *) ((t)->base + (off)))
+
+/* Where the blocks start, right after the region header */
+#define HEAP_START ((sizeof(shm_header_t) + 7) / 8 * 8)
+
+/* What a block holds, so the heap can be walked after a crash */
+enum { BLOCK_FREE, BLOCK_RAW, BLOCK_NODE, BLOCK_BUCKETS };
+
+/**
+ * Blocks start with their size class and kind; free ones also hold the
+ * offset of the next free block of their class.
+ */
+typedef struct {
+    uint32_t  cls;
+    uint32_t  kind;
+    shm_off_t next_free;
+} block_t;
+
+
+/**
+ * Stores an offset that makes a change visible, after all the stores
+ * building what it points to: a process dying at any point leaves either
+ * the old or the new state.
+ */
+static void publish(shm_off_t *link, shm_off_t off) {
+    __atomic_store_n(link, off, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns the size class for an allocation of size bytes, header
+ * included.
+ */
+static int size_class(size_t size) {
+    size_t need = size + sizeof(uint64_t);
+    int c = MIN_CLASS;
+    while (((size_t) 1 << c) < need)
+        c++;
+    return c;
+}
+
+static block_t *block_of(shm_table_t *t, shm_off_t off) {
+    return AT(t, off - sizeof(uint64_t));
+}
+
+/**
+ * Allocates size bytes in the region. Returns the offset of the memory,
+ * or 0 if the region is full. Called with the lock held.
+ */
+static shm_off_t shm_alloc(shm_table_t *t, size_t size, int kind) {
+    shm_header_t *h = t->hdr;
+    int c = size_class(size);
+    if (c >= SHM_TABLE_CLASSES)
+        return 0;
+
+    shm_off_t off = h->free_blocks[c];
+    block_t *b;
+    if (off != 0) {
+        b = AT(t, off);
+        b->kind = kind;
+        h->free_blocks[c] = b->next_free;
+    } else {
+        if (h->brk + ((uint64_t) 1 << c) > h->size)
+            return 0;
+        off = h->brk;
+        b = AT(t, off);
+        b->cls = c;
+        b->kind = kind;
+        // The header is written first, so walking the heap up to brk
+        // never meets an uninitialized block
+        __atomic_store_n(&h->brk, h->brk + ((uint64_t) 1 << c), __ATOMIC_RELEASE);
+    }
+
+    return off + sizeof(uint64_t);
+}
+
+/**
+ * Frees memory allocated by shm_alloc(). Called with the lock held.
+ */
+static void shm_dealloc(shm_table_t *t, shm_off_t off) {
+    shm_header_t *h = t->hdr;
+    block_t *b = block_of(t, off);
+
+    b->kind = BLOCK_FREE;
+    b->next_free = h->free_blocks[b->cls];
+    publish(&h->free_blocks[b->cls], off - sizeof(uint64_t));
+}
+
+/**
+ * Links every node of the region into the new bucket array and switches
+ * to it. Walking the heap rather than the chains makes it safe to redo
+ * from the start if a process died halfway. Called with the lock held.
+ */
+static void rebuild(shm_table_t *t) {
+    shm_header_t *h = t->hdr;
+    shm_off_t *buckets = AT(t, h->newbuckets);
+    memset(buckets, 0, (size_t) h->newm * sizeof(shm_off_t));
+
+    for (shm_off_t off = HEAP_START; off < h->brk; off += (uint64_t) 1 << ((block_t *) AT(t, off))->cls) {
+        block_t *b = AT(t, off);
+        if (b->kind != BLOCK_NODE)
+            continue;
+
+        shm_off_t noff = off + sizeof(uint64_t);
+        shm_node_t *n = AT(t, noff);
+        shm_off_t *slot = &buckets[(uint64_t) n->k % h->newm];
+        n->next = *slot;
+        *slot = noff;
+    }
+
+    shm_off_t old = (h->buckets != h->newbuckets) ? h->buckets : 0;
+    publish(&h->buckets, h->newbuckets);
+    h->m = h->newm;
+    __atomic_store_n(&h->resizing, 0, __ATOMIC_RELEASE);
+    if (old != 0)
+        shm_dealloc(t, old);
+}
+
+/**
+ * Doubles the table size. Returns -1 if the region is full, in which case
+ * the table keeps its size. Called with the lock held.
+ */
+static int grow(shm_table_t *t) {
+    shm_header_t *h = t->hdr;
+    if (h->m > UINT32_MAX / 2)
+        return -1;
+    uint32_t newm = 2 * h->m;
+    shm_off_t b = shm_alloc(t, (size_t) newm * sizeof(shm_off_t), BLOCK_BUCKETS);
+    if (b == 0)
+        return -1;
+
+    h->newbuckets = b;
+    h->newm = newm;
+    __atomic_store_n(&h->resizing, 1, __ATOMIC_RELEASE);
+    rebuild(t);
+    return 0;
+}
+
+/**
+ * Marks the start of a change for the readers, which retry their lookup
+ * if it overlaps one. Called with the lock held.
+ */
+static void write_begin(shm_table_t *t) {
+    __atomic_store_n(&t->hdr->seq, t->hdr->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(shm_table_t *t) {
+    __atomic_store_n(&t->hdr->seq, t->hdr->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Takes the table lock. If a process died holding it, the table is still
+ * consistent, at worst leaking a block, except during a resize, which is
+ * redone.
+ */
+static void lock(shm_table_t *t) {
+    int err = pthread_mutex_lock(&t->hdr->lock);
+    if (err == EOWNERDEAD) {
+        if (t->hdr->resizing)
+            rebuild(t);
+        if (t->hdr->seq & 1)
+            write_end(t);  // died mid-change, let the readers back in
+        pthread_mutex_consistent(&t->hdr->lock);
+    } else if (err != 0) {
+        fatal("shm_table: lock: %s", strerror(err));
+    }
+}
+
+static void unlock(shm_table_t *t) {
+    pthread_mutex_unlock(&t->hdr->lock);
+}
+
+static void init_lock(shm_header_t *h) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&h->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static shm_off_t *bucket(shm_table_t *t, int64_t k) {
+    shm_off_t *buckets = AT(t, t->hdr->buckets);
+    return &buckets[(uint64_t) k % t->hdr->m];
+}
+
+static char *node_key(shm_node_t *n) {
+    return (char *) (n + 1);
+}
+
+static char *node_value(shm_node_t *n) {
+    return (char *) (n + 1) + n->klen + 1;
+}
+
+/**
+ * Returns the link (bucket or next field) pointing to the node with the
+ * given key, or NULL if there is none. Called with the lock held.
+ */
+static shm_off_t *find(shm_table_t *t, const char *key, int64_t k, size_t klen) {
+    shm_off_t *link = bucket(t, k);
+    while (*link != 0) {
+        shm_node_t *n = AT(t, *link);
+        if (n->k == k && n->klen == klen && memcmp(node_key(n), key, klen) == 0)
+            return link;
+        link = &n->next;
+    }
+    return NULL;
+}
+
+/**
+ * Sets up an empty table of at least m slots in the region. Returns -1
+ * if the region is too small for it.
+ */
+static int format(shm_table_t *t, size_t size, int m) {
+    shm_header_t *h = t->hdr;
+    memset(h, 0, sizeof(shm_header_t));
+    h->size = size;
+    h->brk = HEAP_START;
+    h->n = 0;
+    init_lock(h);
+
+    h->newm = (m > MIN_TABLE_SIZE) ? m : MIN_TABLE_SIZE;
+    h->newbuckets = shm_alloc(t, (size_t) h->newm * sizeof(shm_off_t), BLOCK_BUCKETS);
+    if (h->newbuckets == 0)
+        return -1;
+    rebuild(t);
+
+    // Written last: a region without it is formatted again
+    __atomic_store_n(&h->magic, SHM_TABLE_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Returns a new table of m slots in a shared anonymous mapping of size
+ * bytes, or NULL on failure. Created before forking, the table is shared
+ * by the parent and all its children. Memory is only used as the table
+ * fills up, so size can be generous.
+ */
+shm_table_t *shm_table_create(size_t size, int m) {
+    if (size < HEAP_START)
+        return NULL;
+
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    shm_table_t *t = (shm_table_t *) xmalloc(sizeof(shm_table_t));
+    t->base = base;
+    t->hdr = (shm_header_t *) base;
+    t->fd = -1;
+
+    if (format(t, size, m) != 0) {
+        shm_table_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+/**
+ * Opens the table persisted in the file at path, creating a new one of m
+ * slots in size bytes if the file is empty. Returns NULL on failure, or
+ * if the file holds something else.
+ *
+ * Every process using the file holds a shared lock on it. The first one
+ * gets it exclusively first: it is then the only user, so it can safely
+ * reset the table lock and finish a resize interrupted by a crash.
+ *
+ * flock(2) drops the exclusive lock before taking the shared one, so
+ * openers also take a write lock on the first byte of the file for the
+ * whole setup: no other opener can take the exclusive lock in between
+ * and think it is first too.
+ */
+shm_table_t *shm_table_open(const char *path, size_t size, int m) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return NULL;
+
+    // Released by close(2) on the error paths
+    struct flock setup = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 1 };
+    int err;
+    while ((err = fcntl(fd, F_OFD_SETLKW, &setup)) != 0 && errno == EINTR)
+        ;
+    if (err != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    int first = flock(fd, LOCK_EX | LOCK_NB) == 0;
+    if (!first && flock(fd, LOCK_SH) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (st.st_size == 0 && (!first || ftruncate(fd, size) != 0))) {
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size != 0)
+        size = st.st_size;
+    if (size < HEAP_START) {
+        close(fd);
+        return NULL;
+    }
+
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    shm_table_t *t = (shm_table_t *) xmalloc(sizeof(shm_table_t));
+    t->base = base;
+    t->hdr = (shm_header_t *) base;
+    t->fd = fd;
+
+    shm_header_t *h = t->hdr;
+    int ok;
+    if (!first) {
+        ok = h->magic == SHM_TABLE_MAGIC && h->size == size;
+    } else if (st.st_size == 0 || h->magic == 0) {
+        ok = format(t, size, m) == 0;
+    } else {
+        ok = h->magic == SHM_TABLE_MAGIC && h->size == size;
+        if (ok) {
+            init_lock(h);
+            if (h->resizing)
+                rebuild(t);
+            h->seq += h->seq & 1;
+        }
+    }
+
+    if (!ok) {
+        munmap(base, size);
+        close(fd);
+        free(t);
+        return NULL;
+    }
+    if (first)
+        flock(fd, LOCK_SH);  // let the others in
+    setup.l_type = F_UNLCK;
+    fcntl(fd, F_OFD_SETLK, &setup);
+    return t;
+}
+
+/**
+ * Writes a file-backed table to disk. Returns 0 on success, -1 on error.
+ * Changes reach the file anyway, this only makes them durable now.
+ */
+int shm_table_sync(shm_table_t *t) {
+    if (t->fd < 0)
+        return 0;
+    return msync(t->base, t->hdr->size, MS_SYNC);
+}
+
+/**
+ * Unmaps the region from this process and frees the handle. The table
+ * lives on while other processes have it mapped, and in its file if it
+ * has one.
+ */
+void shm_table_free(shm_table_t *t) {
+    munmap(t->base, t->hdr->size);
+    if (t->fd >= 0)
+        close(t->fd);
+    free(t);
+}
+
+/**
+ * Returns 1 if the block of len bytes at off lies in the allocated part
+ * of the region, which ends at brk.
+ */
+static int in_heap(shm_off_t off, uint64_t len, uint64_t brk) {
+    return off >= HEAP_START && off <= brk && len <= brk - off;
+}
+
+/**
+ * Looks key up without the lock. Writers may change the table meanwhile,
+ * so every offset is checked before use, and the result only counts if
+ * seq did not change. Returns 1 if the key is there, storing a copy of
+ * its value in *value unless value is NULL, 0 if it is not, or -1 if a
+ * writer got in the way.
+ */
+static int read_optimistic(shm_table_t *t, const char *key, int64_t k, size_t klen,
+                           char **value) {
+    shm_header_t *h = t->hdr;
+    uint64_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+        return -1;
+
+    uint64_t brk = __atomic_load_n(&h->brk, __ATOMIC_ACQUIRE);
+    uint32_t m = __atomic_load_n(&h->m, __ATOMIC_RELAXED);
+    shm_off_t buckets = __atomic_load_n(&h->buckets, __ATOMIC_RELAXED);
+    if (m == 0 || !in_heap(buckets, (uint64_t) m * sizeof(shm_off_t), brk))
+        return -1;
+
+    shm_off_t *slot = AT(t, buckets);
+    shm_off_t off = __atomic_load_n(&slot[(uint64_t) k % m], __ATOMIC_RELAXED);
+    char *copy = NULL;
+    int found = 0;
+    // A chain changed under our feet may loop: no chain is longer than
+    // the number of blocks
+    for (uint64_t steps = 0; off != 0; steps++) {
+        if (steps > (brk >> MIN_CLASS) || !in_heap(off, sizeof(shm_node_t), brk))
+            return -1;
+
+        shm_node_t *n = AT(t, off);
+        if (__atomic_load_n(&n->k, __ATOMIC_RELAXED) == k
+            && __atomic_load_n(&n->klen, __ATOMIC_RELAXED) == klen
+            && in_heap(off, sizeof(shm_node_t) + klen + 1, brk)
+            && memcmp(node_key(n), key, klen) == 0) {
+            found = 1;
+            if (value != NULL) {
+                uint32_t vlen = __atomic_load_n(&n->vlen, __ATOMIC_RELAXED);
+                if (!in_heap(off, sizeof(shm_node_t) + klen + vlen + 2, brk))
+                    return -1;
+                copy = (char *) xmalloc((size_t) vlen + 1);
+                memcpy(copy, node_key(n) + klen + 1, vlen);
+                copy[vlen] = '\0';
+            }
+            break;
+        }
+        off = __atomic_load_n(&n->next, __ATOMIC_RELAXED);
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) != seq) {
+        free(copy);
+        return -1;
+    }
+    if (value != NULL)
+        *value = copy;
+    return found;
+}
+
+/**
+ * Looks key up, storing a copy of its value in *value unless value is
+ * NULL. Returns 1 if the key is there, 0 otherwise.
+ *
+ * Lookups take no lock, so they do not contend with each other. Only
+ * when writers keep getting in the way, or one died mid-change, do they
+ * fall back to the lock, which waits for the writers or recovers from
+ * the dead one.
+ */
+static int lookup(shm_table_t *t, const char *key, char **value) {
+    int64_t k = hash_prehash(key);
+    size_t klen = strlen(key);
+
+    for (int i = 0; i < READ_TRIES; i++) {
+        int found = read_optimistic(t, key, k, klen, value);
+        if (found >= 0)
+            return found;
+    }
+
+    lock(t);
+    shm_off_t *link = find(t, key, k, klen);
+    if (link != NULL && value != NULL) {
+        shm_node_t *n = AT(t, *link);
+        *value = (char *) xmalloc((size_t) n->vlen + 1);
+        memcpy(*value, node_value(n), (size_t) n->vlen + 1);
+    }
+    unlock(t);
+
+    return link != NULL;
+}
+
+/**
+ * Returns 1 if the key is in the table, 0 otherwise.
+ */
+int shm_table_contains(shm_table_t *t, const char *key) {
+    return lookup(t, key, NULL);
+}
+
+/**
+ * Returns a copy of the value stored with key, which must be freed(2),
+ * or NULL if there is none: other processes may change the table as
+ * soon as the lookup returns.
+ */
+char *shm_table_search(shm_table_t *t, const char *key) {
+    char *value = NULL;
+    lookup(t, key, &value);
+    return value;
+}
+
+/**
+ * Stores a copy of key and value, overriding the value if the key was
+ * already there. Returns 0 on success, -1 if the region is full.
+ *
+ * The table doubles when it has as many elements as slots, like hasht_t;
+ * if the region has no room left for that, chains just get longer.
+ */
+int shm_table_insert(shm_table_t *t, const char *key, const char *value) {
+    int64_t k = hash_prehash(key);
+    size_t klen = strlen(key), vlen = strlen(value);
+    if (klen > UINT32_MAX || vlen > UINT32_MAX)
+        return -1;
+
+    lock(t);
+    shm_off_t off = shm_alloc(t, sizeof(shm_node_t) + klen + vlen + 2, BLOCK_RAW);
+    if (off == 0) {
+        unlock(t);
+        return -1;
+    }
+
+    shm_node_t *n = AT(t, off);
+    n->k = k;
+    n->klen = klen;
+    n->vlen = vlen;
+    memcpy(node_key(n), key, klen + 1);
+    memcpy(node_value(n), value, vlen + 1);
+
+    write_begin(t);
+    shm_off_t *link = find(t, key, k, klen);
+    if (link != NULL) {
+        // Replace the old node in its chain
+        shm_off_t old = *link;
+        block_of(t, old)->kind = BLOCK_RAW;
+        n->next = ((shm_node_t *) AT(t, old))->next;
+        block_of(t, off)->kind = BLOCK_NODE;
+        publish(link, off);
+        shm_dealloc(t, old);
+    } else {
+        if (t->hdr->n >= t->hdr->m)
+            grow(t);
+        link = bucket(t, k);
+        n->next = *link;
+        block_of(t, off)->kind = BLOCK_NODE;
+        publish(link, off);
+        t->hdr->n++;
+    }
+    write_end(t);
+    unlock(t);
+
+    return 0;
+}
+
+/**
+ * Removes the key from the table. Returns 1 if it was there, 0 if not.
+ */
+int shm_table_remove(shm_table_t *t, const char *key) {
+    int64_t k = hash_prehash(key);
+
+    lock(t);
+    shm_off_t *link = find(t, key, k, strlen(key));
+    if (link != NULL) {
+        // Unmarked before unlinking, as when replacing: a resize redone
+        // after a crash here must not link the node back
+        shm_off_t off = *link;
+        write_begin(t);
+        block_of(t, off)->kind = BLOCK_RAW;
+        publish(link, ((shm_node_t *) AT(t, off))->next);
+        t->hdr->n--;
+        shm_dealloc(t, off);
+        write_end(t);
+    }
+    unlock(t);
+
+    return link != NULL;
+}
@@ -0,0 +1,73 @@
+#ifndef _HTTP_SHM_TABLE_H
+#define _HTTP_SHM_TABLE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_TABLE_MAGIC   0x32534854  // "THS2"
+#define SHM_TABLE_CLASSES 40          // allocator size classes, powers of 2
+
+/**
+ * Offset of an object from the start of the region, so that the region
+ * can be mapped at a different address in every process. 0 is the null
+ * offset: the region header lives there.
+ */
+typedef uint64_t shm_off_t;
+
+/**
+ * Element of a chain, like node_t but pointer-free. The key and value
+ * follow it, each null-terminated.
+ */
+typedef struct {
+    shm_off_t next;
+    int64_t   k;     // hash_prehash() of the key
+    uint32_t  klen;
+    uint32_t  vlen;
+} shm_node_t;
+
+/**
+ * Start of the region. Everything else is reached through offsets from
+ * it: the bucket array and the nodes, carved from the rest of the region
+ * by a size-class allocator.
+ *
+ * Writers take the lock; readers do not, and check seq instead, which is
+ * odd while a writer changes the table (a seqlock).
+ */
+typedef struct {
+    uint32_t        magic;
+    uint32_t        m;         // table size
+    uint64_t        size;      // region size
+    uint64_t        n;         // number of elements stored in the table
+    uint64_t        brk;       // end of the allocated part of the region
+    shm_off_t       free_blocks[SHM_TABLE_CLASSES];
+    shm_off_t       buckets;   // array of m chains
+    uint32_t        resizing;  // set while moving the nodes to newbuckets
+    uint32_t        newm;
+    shm_off_t       newbuckets;
+    uint64_t        seq;       // bumped before and after every change
+    pthread_mutex_t lock;      // process-shared, robust
+} shm_header_t;
+
+/**
+ * A process' handle to a table in a shared region.
+ */
+typedef struct {
+    char         *base;
+    shm_header_t *hdr;
+    int           fd;  // backing file, -1 if anonymous
+} shm_table_t;
+
+
+shm_table_t *shm_table_create(size_t size, int m);
+shm_table_t *shm_table_open(const char *path, size_t size, int m);
+int          shm_table_sync(shm_table_t *t);
+void         shm_table_free(shm_table_t *t);
+
+int   shm_table_contains(shm_table_t *t, const char *key);
+char *shm_table_search(shm_table_t *t, const char *key);
+int   shm_table_insert(shm_table_t *t, const char *key, const char *value);
+int   shm_table_remove(shm_table_t *t, const char *key);
+
+
+#endif  // _HTTP_SHM_TABLE_H
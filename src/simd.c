@@ -0,0 +1,415 @@
+#include "simd.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Hash: eight 32 bit lanes each take one word of every 32 byte block, in
+ * rounds like xxHash32's, so the lanes fit in one AVX2 register or two
+ * SSE2 ones. The remaining bytes and the lanes are then folded into a
+ * 64 bit value by the scalar code shared by all implementations.
+ */
+#define HASH_LANES 8
+#define HASH_BLOCK (HASH_LANES * 4)
+#define HASH_P1    0x9E3779B1u
+#define HASH_P2    0x85EBCA77u
+#define HASH_M64   0x9E3779B97F4A7C15ull
+
+
+static inline uint32_t rotl32(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+static inline uint32_t load32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t load64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * Initial lane values.
+ */
+static void hash_lanes_init(uint32_t v[HASH_LANES]) {
+    for (int i = 0; i < HASH_LANES; i++)
+        v[i] = HASH_P1 * (uint32_t) (i + 1);
+}
+
+/**
+ * Folds the lanes (when len spans at least one block) and the last
+ * left bytes at p into the final hash.
+ */
+static uint64_t hash_finish(const uint32_t v[HASH_LANES], const char *p,
+                            size_t left, size_t len) {
+    uint64_t h = (uint64_t) len * HASH_M64;
+
+    if (len >= HASH_BLOCK) {
+        for (int i = 0; i < HASH_LANES; i++)
+            h = (h ^ v[i]) * HASH_M64;
+    }
+    while (left >= 8) {
+        h = (h ^ load64(p)) * HASH_M64;
+        h ^= h >> 29;
+        p += 8;
+        left -= 8;
+    }
+    if (left > 0) {
+        uint64_t w = 0;
+        memcpy(&w, p, left);
+        h = (h ^ w) * HASH_M64;
+    }
+
+    // Final avalanche, from MurmurHash3
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline char ascii_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? (char) (c + ('a' - 'A')) : c;
+}
+
+
+/* Scalar implementations */
+
+static size_t scan_header_scalar(const char *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] == ':' || p[i] == '\r' || p[i] == '\n')
+            return i;
+    }
+    return len;
+}
+
+static uint64_t hash_scalar(const char *p, size_t len) {
+    uint32_t v[HASH_LANES];
+    hash_lanes_init(v);
+
+    size_t i = 0;
+    for (; i + HASH_BLOCK <= len; i += HASH_BLOCK) {
+        for (int l = 0; l < HASH_LANES; l++)
+            v[l] = rotl32(v[l] + load32(p + i + 4 * l) * HASH_P2, 13) * HASH_P1;
+    }
+
+    return hash_finish(v, p + i, len - i, len);
+}
+
+static int caseeq_scalar(const char *a, const char *b, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (ascii_lower(a[i]) != ascii_lower(b[i]))
+            return 0;
+    }
+    return 1;
+}
+
+static void xor_mask_scalar(char *p, size_t len, const uint8_t key[4]) {
+    size_t i = 0;
+    if (len >= 8) {
+        uint64_t k = (uint64_t) load32((const char *) key) * 0x100000001ull;
+        for (; i + 8 <= len; i += 8) {
+            uint64_t w = load64(p + i) ^ k;
+            memcpy(p + i, &w, 8);
+        }
+    }
+    for (; i < len; i++)
+        p[i] ^= key[i & 3];
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+/* SSE2 implementations */
+
+__attribute__((target("sse2")))
+static size_t scan_header_sse2(const char *p, size_t len) {
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (p + i));
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, colon),
+                                              _mm_cmpeq_epi8(x, cr)),
+                                 _mm_cmpeq_epi8(x, lf));
+        int mask = _mm_movemask_epi8(m);
+        if (mask != 0)
+            return i + (size_t) __builtin_ctz((unsigned) mask);
+    }
+
+    return i + scan_header_scalar(p + i, len - i);
+}
+
+/**
+ * Low 32 bits of the lane products, which SSE2 lacks an instruction for.
+ */
+__attribute__((target("sse2")))
+static inline __m128i mullo32_sse2(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i round_sse2(__m128i v, __m128i w) {
+    const __m128i p1 = _mm_set1_epi32((int) HASH_P1);
+    const __m128i p2 = _mm_set1_epi32((int) HASH_P2);
+
+    v = _mm_add_epi32(v, mullo32_sse2(w, p2));
+    v = _mm_or_si128(_mm_slli_epi32(v, 13), _mm_srli_epi32(v, 19));
+    return mullo32_sse2(v, p1);
+}
+
+__attribute__((target("sse2")))
+static uint64_t hash_sse2(const char *p, size_t len) {
+    uint32_t v[HASH_LANES];
+    hash_lanes_init(v);
+
+    size_t i = 0;
+    if (len >= HASH_BLOCK) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *) v);
+        __m128i v1 = _mm_loadu_si128((const __m128i *) (v + 4));
+        for (; i + HASH_BLOCK <= len; i += HASH_BLOCK) {
+            v0 = round_sse2(v0, _mm_loadu_si128((const __m128i *) (p + i)));
+            v1 = round_sse2(v1, _mm_loadu_si128((const __m128i *) (p + i + 16)));
+        }
+        _mm_storeu_si128((__m128i *) v, v0);
+        _mm_storeu_si128((__m128i *) (v + 4), v1);
+    }
+
+    return hash_finish(v, p + i, len - i, len);
+}
+
+/**
+ * Sets the 0x20 bit of the upper case ASCII letters in x.
+ */
+__attribute__((target("sse2")))
+static inline __m128i lower_sse2(__m128i x) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), x));
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+__attribute__((target("sse2")))
+static int caseeq_sse2(const char *a, const char *b, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = lower_sse2(_mm_loadu_si128((const __m128i *) (a + i)));
+        __m128i y = lower_sse2(_mm_loadu_si128((const __m128i *) (b + i)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF)
+            return 0;
+    }
+
+    return caseeq_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static void xor_mask_sse2(char *p, size_t len, const uint8_t key[4]) {
+    const __m128i k = _mm_set1_epi32((int) load32((const char *) key));
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (p + i));
+        _mm_storeu_si128((__m128i *) (p + i), _mm_xor_si128(x, k));
+    }
+
+    // i is a multiple of 4, so the key lines up again
+    xor_mask_scalar(p + i, len - i, key);
+}
+
+
+/* AVX2 implementations */
+
+__attribute__((target("avx2")))
+static size_t scan_header_avx2(const char *p, size_t len) {
+    const __m256i colon = _mm256_set1_epi8(':');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (p + i));
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, colon),
+                                                    _mm256_cmpeq_epi8(x, cr)),
+                                    _mm256_cmpeq_epi8(x, lf));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(m);
+        if (mask != 0)
+            return i + (size_t) __builtin_ctz(mask);
+    }
+
+    return i + scan_header_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static uint64_t hash_avx2(const char *p, size_t len) {
+    uint32_t v[HASH_LANES];
+    hash_lanes_init(v);
+
+    size_t i = 0;
+    if (len >= HASH_BLOCK) {
+        const __m256i p1 = _mm256_set1_epi32((int) HASH_P1);
+        const __m256i p2 = _mm256_set1_epi32((int) HASH_P2);
+
+        __m256i acc = _mm256_loadu_si256((const __m256i *) v);
+        for (; i + HASH_BLOCK <= len; i += HASH_BLOCK) {
+            __m256i w = _mm256_loadu_si256((const __m256i *) (p + i));
+            acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(w, p2));
+            acc = _mm256_or_si256(_mm256_slli_epi32(acc, 13), _mm256_srli_epi32(acc, 19));
+            acc = _mm256_mullo_epi32(acc, p1);
+        }
+        _mm256_storeu_si256((__m256i *) v, acc);
+    }
+
+    return hash_finish(v, p + i, len - i, len);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i lower_avx2(__m256i x) {
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+    return _mm256_or_si256(x, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static int caseeq_avx2(const char *a, const char *b, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = lower_avx2(_mm256_loadu_si256((const __m256i *) (a + i)));
+        __m256i y = lower_avx2(_mm256_loadu_si256((const __m256i *) (b + i)));
+        if ((unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != 0xFFFFFFFFu)
+            return 0;
+    }
+
+    return caseeq_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void xor_mask_avx2(char *p, size_t len, const uint8_t key[4]) {
+    const __m256i k = _mm256_set1_epi32((int) load32((const char *) key));
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (p + i));
+        _mm256_storeu_si256((__m256i *) (p + i), _mm256_xor_si256(x, k));
+    }
+
+    xor_mask_scalar(p + i, len - i, key);
+}
+
+
+/* AVX-512 implementations. Masked loads handle the tail without ever
+ * reading past the end of the strings. */
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __mmask64 tail_mask(size_t left) {
+    return (left >= 64) ? ~(__mmask64) 0 : (((__mmask64) 1 << left) - 1);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t scan_header_avx512(const char *p, size_t len) {
+    const __m512i colon = _mm512_set1_epi8(':');
+    const __m512i cr = _mm512_set1_epi8('\r');
+    const __m512i lf = _mm512_set1_epi8('\n');
+
+    for (size_t i = 0; i < len; i += 64) {
+        __mmask64 k = tail_mask(len - i);
+        __m512i x = _mm512_maskz_loadu_epi8(k, p + i);
+        __mmask64 m = (_mm512_cmpeq_epi8_mask(x, colon) | _mm512_cmpeq_epi8_mask(x, cr)
+                       | _mm512_cmpeq_epi8_mask(x, lf)) & k;
+        if (m != 0)
+            return i + (size_t) __builtin_ctzll(m);
+    }
+
+    return len;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i lower_avx512(__m512i x) {
+    __mmask64 upper = _mm512_cmple_epu8_mask(_mm512_sub_epi8(x, _mm512_set1_epi8('A')),
+                                             _mm512_set1_epi8('Z' - 'A'));
+    return _mm512_mask_blend_epi8(upper, x, _mm512_or_si512(x, _mm512_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int caseeq_avx512(const char *a, const char *b, size_t len) {
+    for (size_t i = 0; i < len; i += 64) {
+        __mmask64 k = tail_mask(len - i);
+        __m512i x = lower_avx512(_mm512_maskz_loadu_epi8(k, a + i));
+        __m512i y = lower_avx512(_mm512_maskz_loadu_epi8(k, b + i));
+        if (_mm512_cmpneq_epi8_mask(x, y) != 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void xor_mask_avx512(char *p, size_t len, const uint8_t key[4]) {
+    const __m512i k = _mm512_set1_epi32((int) load32((const char *) key));
+
+    for (size_t i = 0; i < len; i += 64) {
+        __mmask64 m = tail_mask(len - i);
+        __m512i x = _mm512_maskz_loadu_epi8(m, p + i);
+        _mm512_mask_storeu_epi8(p + i, m, _mm512_xor_si512(x, k));
+    }
+}
+
+#endif  // HAVE_X86_SIMD
+
+
+const simd_impl_t simd_impls[] = {
+    { "scalar", NULL, scan_header_scalar, hash_scalar, caseeq_scalar, xor_mask_scalar },
+#ifdef HAVE_X86_SIMD
+    { "sse2", "sse2", scan_header_sse2, hash_sse2, caseeq_sse2, xor_mask_sse2 },
+    { "avx2", "avx2", scan_header_avx2, hash_avx2, caseeq_avx2, xor_mask_avx2 },
+    // The hash lanes fill an AVX2 register; wider ones do not help it
+    { "avx512", "avx512bw", scan_header_avx512, hash_avx2, caseeq_avx512, xor_mask_avx512 },
+#endif
+};
+const int simd_nimpls = sizeof(simd_impls) / sizeof(simd_impls[0]);
+
+const simd_impl_t *simd = &simd_impls[0];
+
+
+/**
+ * Returns 1 if the running CPU can run the given implementation.
+ */
+int simd_supported(const simd_impl_t *impl) {
+    if (impl->cpu_feature == NULL)
+        return 1;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (strcmp(impl->cpu_feature, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+    if (strcmp(impl->cpu_feature, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (strcmp(impl->cpu_feature, "avx512bw") == 0)
+        return __builtin_cpu_supports("avx512bw");
+#endif
+    return 0;
+}
+
+/**
+ * Selects the widest implementation the CPU supports. Should be called
+ * once at startup, before other threads use the kernels.
+ */
+void init_simd(void) {
+    for (int i = simd_nimpls - 1; i >= 0; i--) {
+        if (simd_supported(&simd_impls[i])) {
+            simd = &simd_impls[i];
+            return;
+        }
+    }
+}
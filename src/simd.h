@@ -0,0 +1,56 @@
+#ifndef _HTTP_SIMD_H
+#define _HTTP_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * String kernels with SIMD implementations, picked at run time by
+ * init_simd() for the CPU at hand. Every implementation returns exactly
+ * the same results as the scalar one, so tables built on one machine
+ * hash the same way on any other.
+ */
+typedef struct {
+    const char *name;
+    const char *cpu_feature;  // for __builtin_cpu_supports, NULL if none needed
+
+    // Returns the index of the first ':', '\r' or '\n' in p, or len if none.
+    size_t   (*scan_header)(const char *p, size_t len);
+    // Returns a 64 bit hash of the len bytes at p.
+    uint64_t (*hash)(const char *p, size_t len);
+    // Returns 1 if a and b are equal ignoring ASCII case, 0 otherwise.
+    int      (*caseeq)(const char *a, const char *b, size_t len);
+    // XORs the len bytes at p in place with the 4 byte key repeated, key
+    // byte i % 4 going to p[i] (WebSocket masking).
+    void     (*xor_mask)(char *p, size_t len, const uint8_t key[4]);
+} simd_impl_t;
+
+/* Implementations, from the scalar fallback to the widest one */
+extern const simd_impl_t simd_impls[];
+extern const int         simd_nimpls;
+
+/* Selected implementation, the scalar one until init_simd() is called */
+extern const simd_impl_t *simd;
+
+
+void init_simd(void);
+int  simd_supported(const simd_impl_t *impl);
+
+static inline size_t scan_header(const char *p, size_t len) {
+    return simd->scan_header(p, len);
+}
+
+static inline uint64_t str_hash(const char *p, size_t len) {
+    return simd->hash(p, len);
+}
+
+static inline int str_caseeq(const char *a, const char *b, size_t len) {
+    return simd->caseeq(a, b, len);
+}
+
+static inline void str_xor_mask(char *p, size_t len, const uint8_t key[4]) {
+    simd->xor_mask(p, len, key);
+}
+
+
+#endif  // _HTTP_SIMD_H
@@ -0,0 +1,182 @@
+#include "sse.h"
+#include "xalloc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_SUBS 16
+
+
+/**
+ * Writes the response headers opening an event stream to buf. Returns
+ * their length, or -1 if size is too small.
+ */
+int sse_response(char *buf, size_t size) {
+    int n = snprintf(buf, size,
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: " SSE_CONTENT_TYPE "\r\n"
+                     "Cache-Control: no-cache\r\n"
+                     "Connection: keep-alive\r\n"
+                     "\r\n");
+    return (n < 0 || (size_t) n >= size) ? -1 : n;
+}
+
+/**
+ * Appends "name: value\n" at p, returning the end. value has no newline.
+ */
+static char *put_field(char *p, const char *name, const char *value, size_t len) {
+    size_t nlen = strlen(name);
+    memcpy(p, name, nlen);
+    p += nlen;
+    *p++ = ':';
+    *p++ = ' ';
+    memcpy(p, value, len);
+    p += len;
+    *p++ = '\n';
+    return p;
+}
+
+/**
+ * Returns the start of the line after the one ending at s, on a CRLF, CR
+ * or LF as text/event-stream allows, or NULL if s is the end of data.
+ */
+static const char *next_line(const char *s) {
+    if (*s == '\0')
+        return NULL;
+    return (s[0] == '\r' && s[1] == '\n') ? s + 2 : s + 1;
+}
+
+/**
+ * Encodes an event in the text/event-stream format, ready to be
+ * published to any number of channels. event and id may be NULL; data
+ * may have several lines, ended by CRLF, CR or LF: each becomes a data
+ * field, so no line break can smuggle in another field. The caller holds
+ * the returned reference.
+ * Returns NULL if event or id have a line break, which the format cannot
+ * carry.
+ */
+sbuf_t *sse_encode(const char *event, const char *id, const char *data) {
+    if ((event != NULL && strpbrk(event, "\r\n") != NULL)
+        || (id != NULL && strpbrk(id, "\r\n") != NULL))
+        return NULL;
+
+    // Every line of data gets its own "data: " field
+    size_t dlen = strlen(data), lines = 1;
+    for (const char *s = data + strcspn(data, "\r\n"); (s = next_line(s)) != NULL;
+         s += strcspn(s, "\r\n"))
+        lines++;
+    size_t len = dlen + lines * sizeof("data: ") + 1;
+    if (event != NULL)
+        len += strlen(event) + sizeof("event: ");
+    if (id != NULL)
+        len += strlen(id) + sizeof("id: ");
+
+    sbuf_t *b = sbuf_new(len);
+    char *p = b->data;
+    if (event != NULL)
+        p = put_field(p, "event", event, strlen(event));
+    if (id != NULL)
+        p = put_field(p, "id", id, strlen(id));
+    for (const char *s = data; s != NULL;) {
+        size_t l = strcspn(s, "\r\n");
+        p = put_field(p, "data", s, l);
+        s = next_line(s + l);
+    }
+    *p++ = '\n';  // a blank line dispatches the event
+
+    b->len = p - b->data;
+    return b;
+}
+
+/**
+ * Initializes an empty channel. Subscribers with more than max_queued
+ * bytes waiting, 0 for SSE_MAX_QUEUED, are dropped and passed to
+ * on_drop.
+ */
+void sse_channel_init(sse_channel_t *ch, size_t max_queued, sse_drop_fn on_drop, void *arg) {
+    ch->subs = NULL;
+    ch->n = ch->cap = 0;
+    ch->max_queued = (max_queued > 0) ? max_queued : SSE_MAX_QUEUED;
+    ch->on_drop = on_drop;
+    ch->arg = arg;
+    ch->published = ch->dropped = 0;
+}
+
+/**
+ * Frees the channel. Its subscribers are left alone: they should have
+ * been unsubscribed as their connections were closed.
+ */
+void sse_channel_free(sse_channel_t *ch) {
+    free(ch->subs);
+    ch->subs = NULL;
+    ch->n = ch->cap = 0;
+}
+
+/**
+ * Subscribes the connection on fd, once its response headers were sent.
+ */
+void sse_subscribe(sse_channel_t *ch, sse_sub_t *sub, int fd) {
+    if (ch->n == ch->cap) {
+        int cap = (ch->cap > 0) ? 2 * ch->cap : MIN_SUBS;
+        ch->subs = (sse_sub_t **) xrealloc(ch->subs, cap * sizeof(sse_sub_t *));
+        ch->cap = cap;
+    }
+
+    wqueue_init(&sub->q, fd);
+    sub->index = ch->n;
+    ch->subs[ch->n++] = sub;
+}
+
+/**
+ * Unsubscribes sub, as when its connection is closed. Events already
+ * queued on it stay there.
+ */
+void sse_unsubscribe(sse_channel_t *ch, sse_sub_t *sub) {
+    if (sub->index < 0)
+        return;
+
+    // Move the last subscriber to the free spot
+    sse_sub_t *last = ch->subs[--ch->n];
+    ch->subs[sub->index] = last;
+    last->index = sub->index;
+    sub->index = -1;
+}
+
+static void drop(sse_channel_t *ch, sse_sub_t *sub) {
+    sse_unsubscribe(ch, sub);
+    wqueue_clear(&sub->q);
+    ch->dropped++;
+    if (ch->on_drop != NULL)
+        ch->on_drop(sub, ch->arg);
+}
+
+/**
+ * Queues the event from sse_encode() on all the subscribers, sharing the
+ * buffer, and writes it right away to those that have nothing pending.
+ * Subscribers that lag too far behind or fail are dropped. Returns the
+ * number of subscribers the event was queued on.
+ */
+int sse_publish(sse_channel_t *ch, sbuf_t *ev) {
+    int queued = 0;
+    ch->published++;
+
+    // Backwards, as dropping moves the last subscriber in its place
+    for (int i = ch->n - 1; i >= 0; i--) {
+        sse_sub_t *sub = ch->subs[i];
+        int idle = sub->q.count == 0;
+
+        if (sub->q.bytes + ev->len > ch->max_queued || wqueue_push(&sub->q, ev) != 0) {
+            drop(ch, sub);
+            continue;
+        }
+        // Others wait for EPOLLOUT: their socket buffer is still full
+        if (idle && wqueue_flush(&sub->q) < 0) {
+            drop(ch, sub);
+            continue;
+        }
+        queued++;
+    }
+
+    return queued;
+}
@@ -0,0 +1,57 @@
+#ifndef _HTTP_SSE_H
+#define _HTTP_SSE_H
+
+#include "wqueue.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SSE_CONTENT_TYPE "text/event-stream"
+#define SSE_MAX_QUEUED   (256 << 10)  // default bytes a subscriber may lag behind
+
+struct sse_sub;
+
+/**
+ * Called when a subscriber is dropped for not keeping up, or because
+ * writing to it failed. It is already unsubscribed; the callback should
+ * close its connection.
+ */
+typedef void (*sse_drop_fn)(struct sse_sub *sub, void *arg);
+
+/**
+ * A connection subscribed to a channel. Embedded by the caller in its
+ * connection state; the queue is flushed by the caller on EPOLLOUT.
+ */
+typedef struct sse_sub {
+    wqueue_t q;
+    int      index;  // in the channel subscribers, -1 if not subscribed
+} sse_sub_t;
+
+/**
+ * Server-Sent Events channel: events published to it are encoded once
+ * and queued on all its subscribers. A channel and its subscribers are
+ * owned by one event loop thread.
+ */
+typedef struct {
+    sse_sub_t **subs;
+    int         n, cap;
+    size_t      max_queued;  // subscribers lagging more are dropped
+    sse_drop_fn on_drop;
+    void       *arg;
+
+    uint64_t published;
+    uint64_t dropped;
+} sse_channel_t;
+
+
+int  sse_response(char *buf, size_t size);
+sbuf_t *sse_encode(const char *event, const char *id, const char *data);
+
+void sse_channel_init(sse_channel_t *ch, size_t max_queued, sse_drop_fn on_drop, void *arg);
+void sse_channel_free(sse_channel_t *ch);
+void sse_subscribe(sse_channel_t *ch, sse_sub_t *sub, int fd);
+void sse_unsubscribe(sse_channel_t *ch, sse_sub_t *sub);
+int  sse_publish(sse_channel_t *ch, sbuf_t *ev);
+
+
+#endif  // _HTTP_SSE_H
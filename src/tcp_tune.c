@@ -0,0 +1,58 @@
+#include "tcp_tune.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+
+static int set_opt(int fd, int opt, int on) {
+    return setsockopt(fd, IPPROTO_TCP, opt, &on, sizeof(on));
+}
+
+/**
+ * Sets up a newly accepted connection: TCP_NODELAY on, so that small
+ * interactive responses are never held back by Nagle's algorithm
+ * waiting for the ACK of the previous one. Returns 0 on success, -1
+ * with errno set otherwise.
+ */
+int tcp_tune_init(tcp_tune_t *t, int fd) {
+    t->corked = 0;
+    return set_opt(fd, TCP_NODELAY, 1);
+}
+
+/**
+ * Prepares the socket for writing a response of the given shape.
+ *
+ * Responses written in several pieces (headers then sendfile(2), or
+ * large bodies) are corked, so the headers share their packet with the
+ * start of the body instead of leaving as a packet of their own, and
+ * the body goes out in full-sized segments. Small responses, expected
+ * to be written in one go, are left uncorked so they leave at once.
+ *
+ * Must be followed by tcp_response_end() once the whole response is
+ * written. Returns 0 on success, -1 with errno set otherwise.
+ */
+int tcp_response_begin(tcp_tune_t *t, int fd, const tcp_shape_t *shape) {
+    int cork = shape->sendfile || shape->header_len + shape->body_len > TCP_SMALL_RESPONSE;
+
+    if (cork && !t->corked) {
+        if (set_opt(fd, TCP_CORK, 1) != 0)
+            return -1;
+        t->corked = 1;
+    }
+    return 0;
+}
+
+/**
+ * Flushes the response: uncorking sends the last partial segment right
+ * away, as TCP_NODELAY is on. Keep-alive connections stay uncorked
+ * between responses, so the next small one is not delayed.
+ */
+int tcp_response_end(tcp_tune_t *t, int fd) {
+    if (!t->corked)
+        return 0;
+    if (set_opt(fd, TCP_CORK, 0) != 0)
+        return -1;
+    t->corked = 0;
+    return 0;
+}
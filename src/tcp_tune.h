@@ -0,0 +1,36 @@
+#ifndef _HTTP_TCP_TUNE_H
+#define _HTTP_TCP_TUNE_H
+
+#include <stddef.h>
+
+/**
+ * Responses that fit in a single write of at most this many bytes are
+ * "small": written with one writev() on a TCP_NODELAY socket, they go
+ * out at once in as few packets as their size allows.
+ */
+#define TCP_SMALL_RESPONSE (16 * 1024)
+
+/**
+ * Per connection socket option state, so options are only changed when
+ * needed: one setsockopt() is a syscall.
+ */
+typedef struct {
+    int corked;
+} tcp_tune_t;
+
+/**
+ * Shape of a response, as the writer is about to send it.
+ */
+typedef struct {
+    size_t header_len;
+    size_t body_len;
+    int    sendfile;  // the body goes out with sendfile(2), after the headers
+} tcp_shape_t;
+
+
+int tcp_tune_init(tcp_tune_t *t, int fd);
+int tcp_response_begin(tcp_tune_t *t, int fd, const tcp_shape_t *shape);
+int tcp_response_end(tcp_tune_t *t, int fd);
+
+
+#endif  // _HTTP_TCP_TUNE_H
@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+#include "topology.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+#define MPOL_PREFERRED 1  // from <numaif.h>, to avoid needing libnuma
+#define MAX_NODE_ID    1024  // kernel limit on node numbers (NODES_SHIFT of 10)
+#define MASK_BITS      (8 * sizeof(unsigned long))
+
+#define NODE_SYSFS "/sys/devices/system/node"
+
+_Static_assert(TOPO_MAX_CPUS <= CPU_SETSIZE, "CPU numbers must fit in a cpu_set_t");
+
+static int nnodes = 1;
+static int cpu_node[TOPO_MAX_CPUS];          // node of every CPU
+static cpu_set_t node_cpus[TOPO_MAX_NODES];  // CPUs of every node
+static int node_ids[TOPO_MAX_NODES];         // kernel node numbers, may have holes
+
+
+/**
+ * Parses a kernel CPU or node list such as "0-3,8,10-11", calling add
+ * for every number in it. Returns -1 if the list cannot be parsed.
+ */
+static int parse_list(const char *s, void (*add)(int n, void *arg), void *arg) {
+    while (*s != '\0' && *s != '\n') {
+        char *end;
+        long lo = strtol(s, &end, 10);
+        if (end == s)
+            return -1;
+        long hi = lo;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s)
+                return -1;
+        }
+        for (long n = lo; n <= hi; n++)
+            add((int) n, arg);
+        s = (*end == ',') ? end + 1 : end;
+    }
+    return 0;
+}
+
+static int read_line(const char *path, char *buf, size_t len) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    char *ok = fgets(buf, len, f);
+    fclose(f);
+    return (ok == NULL) ? -1 : 0;
+}
+
+static void add_node(int n, void *arg) {
+    (void) arg;
+    // Numbers may have holes, so the limit is on them, not on nnodes only
+    if (n >= 0 && n < MAX_NODE_ID && nnodes < TOPO_MAX_NODES)
+        node_ids[nnodes++] = n;
+}
+
+static void add_cpu(int cpu, void *arg) {
+    int node = *(int *) arg;
+    if (cpu < 0 || cpu >= TOPO_MAX_CPUS)
+        return;
+    cpu_node[cpu] = node;
+    CPU_SET(cpu, &node_cpus[node]);
+}
+
+/**
+ * Falls back to a single node holding every CPU.
+ */
+static void single_node(void) {
+    nnodes = 1;
+    node_ids[0] = 0;
+    CPU_ZERO(&node_cpus[0]);
+    long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (long c = 0; c < ncpus && c < TOPO_MAX_CPUS; c++) {
+        cpu_node[c] = 0;
+        CPU_SET(c, &node_cpus[0]);
+    }
+}
+
+/**
+ * Initializes the library, reading the NUMA topology from sysfs. Should
+ * be called only once, before starting the workers. Returns the number
+ * of nodes.
+ */
+int init_topology(void) {
+    char buf[4096], path[128];
+
+    nnodes = 0;
+    if (read_line(NODE_SYSFS "/online", buf, sizeof(buf)) != 0
+            || parse_list(buf, add_node, NULL) != 0 || nnodes == 0) {
+        single_node();
+        return nnodes;
+    }
+
+    // Nodes are numbered 0..nnodes-1 here, whatever the kernel numbers
+    for (int i = 0; i < nnodes; i++) {
+        CPU_ZERO(&node_cpus[i]);
+        snprintf(path, sizeof(path), NODE_SYSFS "/node%d/cpulist", node_ids[i]);
+        if (read_line(path, buf, sizeof(buf)) != 0 || parse_list(buf, add_cpu, &i) != 0) {
+            single_node();
+            return nnodes;
+        }
+    }
+
+    return nnodes;
+}
+
+int topo_nodes() {
+    return nnodes;
+}
+
+/**
+ * Returns the number of CPUs of the given node.
+ */
+int topo_node_cpus(int node) {
+    if (node < 0 || node >= nnodes)
+        return 0;
+    return CPU_COUNT(&node_cpus[node]);
+}
+
+/**
+ * Returns the node of the given CPU, 0 if unknown.
+ */
+int topo_cpu_node(int cpu) {
+    if (cpu < 0 || cpu >= TOPO_MAX_CPUS)
+        return 0;
+    return cpu_node[cpu];
+}
+
+/**
+ * Returns the node worker number worker, out of nworkers, should run
+ * on: workers are split between nodes in proportion to their CPUs, in
+ * contiguous runs, so neighbouring workers share a node.
+ */
+int topo_worker_node(int worker, int nworkers) {
+    int total = 0;
+    for (int n = 0; n < nnodes; n++)
+        total += topo_node_cpus(n);
+    if (total == 0 || nworkers <= 0)
+        return 0;
+
+    int seen = 0;
+    for (int n = 0; n < nnodes; n++) {
+        seen += topo_node_cpus(n);
+        if ((long) worker * total < (long) seen * nworkers)
+            return n;
+    }
+    return nnodes - 1;
+}
+
+/**
+ * Pins the calling thread to the CPUs of the given node and makes the
+ * node preferred for the memory it allocates from now on. Returns 0 on
+ * success, -1 on failure with errno set; a thread left unpinned still
+ * works, only slower.
+ */
+int topo_pin_thread(int node) {
+    if (node < 0 || node >= nnodes) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // pthread functions return the error instead of setting errno
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node_cpus[node]);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+
+    if (nnodes > 1) {
+        unsigned long mask[MAX_NODE_ID / MASK_BITS] = { 0 };
+        int id = node_ids[node];  // below MAX_NODE_ID, see add_node()
+        mask[id / MASK_BITS] |= 1UL << (id % MASK_BITS);
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, 8 * sizeof(mask)) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Returns the node of the CPU that processed the packets of the given
+ * connected socket, that is, the node whose NIC queue received it, or
+ * -1 if unknown. A listener can use it to hand the connection to a
+ * worker on that node.
+ */
+int topo_socket_node(int fd) {
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0 || cpu < 0)
+        return -1;
+    return topo_cpu_node(cpu);
+}
@@ -0,0 +1,33 @@
+#ifndef _HTTP_TOPOLOGY_H
+#define _HTTP_TOPOLOGY_H
+
+#define TOPO_MAX_NODES 64
+#define TOPO_MAX_CPUS  1024
+
+/**
+ * NUMA placement of worker threads.
+ *
+ * A worker pinned with topo_pin_thread() runs only on the CPUs of its
+ * node and prefers the node's memory for everything it allocates from
+ * then on: its buffers, its hasht_t instances, and bucket arrays from
+ * huge_calloc(), all of which are placed when first touched. Workers
+ * should therefore be pinned before they allocate anything.
+ *
+ * Connections are best served by a worker on the node whose NIC queue
+ * received them; topo_socket_node() tells which one that was, given
+ * the NIC queue interrupts are steered to the CPUs of the right node
+ * (irqbalance or /proc/irq/N/smp_affinity_list).
+ *
+ * On machines without NUMA, or without /sys, everything is node 0.
+ */
+
+int  init_topology(void);
+int  topo_nodes(void);
+int  topo_node_cpus(int node);
+int  topo_cpu_node(int cpu);
+int  topo_worker_node(int worker, int nworkers);
+int  topo_pin_thread(int node);
+int  topo_socket_node(int fd);
+
+
+#endif  // _HTTP_TOPOLOGY_H
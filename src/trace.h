@@ -0,0 +1,60 @@
+#ifndef _HTTP_TRACE_H
+#define _HTTP_TRACE_H
+
+/**
+ * Static tracepoints (USDT) for bpftrace, perf and SystemTap.
+ *
+ * Each probe compiles to a single nop plus a note in the binary, so it
+ * costs nothing until a tracer attaches to it, e.g.
+ *
+ *   bpftrace -e 'usdt:./http_server:http_server:hash__resize { @[arg2] = count(); }'
+ *
+ * Probes, with their arguments:
+ *   conn__accept        fd
+ *   request__parsed     fd, method, target
+ *   handler__dispatch   fd, target
+ *   response__done      fd, status, bytes sent
+ *   cache__hit          key
+ *   cache__miss         key
+ *   hash__resize        table, old size, new size, elements
+ *
+ * Probes are only compiled in with HTTP_TRACE defined (make TRACE=1),
+ * which needs <sys/sdt.h> from systemtap-sdt-dev; otherwise they compile
+ * to nothing. The header is not written for -pedantic, so its warnings
+ * are silenced around it and around each probe.
+ */
+#ifdef HTTP_TRACE
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#include <sys/sdt.h>
+#pragma GCC diagnostic pop
+
+#define TRACE_BEGIN _Pragma("GCC diagnostic push") \
+                    _Pragma("GCC diagnostic ignored \"-Wpedantic\"")
+#define TRACE_END   _Pragma("GCC diagnostic pop")
+
+#define TRACE1(name, a) \
+    do { TRACE_BEGIN DTRACE_PROBE1(http_server, name, a); TRACE_END } while (0)
+#define TRACE2(name, a, b) \
+    do { TRACE_BEGIN DTRACE_PROBE2(http_server, name, a, b); TRACE_END } while (0)
+#define TRACE3(name, a, b, c) \
+    do { TRACE_BEGIN DTRACE_PROBE3(http_server, name, a, b, c); TRACE_END } while (0)
+#define TRACE4(name, a, b, c, d) \
+    do { TRACE_BEGIN DTRACE_PROBE4(http_server, name, a, b, c, d); TRACE_END } while (0)
+#else
+#define TRACE1(name, a)          do { } while (0)
+#define TRACE2(name, a, b)       do { } while (0)
+#define TRACE3(name, a, b, c)    do { } while (0)
+#define TRACE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#define TRACE_CONN_ACCEPT(fd)                  TRACE1(conn__accept, fd)
+#define TRACE_REQUEST_PARSED(fd, method, tgt)  TRACE3(request__parsed, fd, method, tgt)
+#define TRACE_HANDLER_DISPATCH(fd, tgt)        TRACE2(handler__dispatch, fd, tgt)
+#define TRACE_RESPONSE_DONE(fd, status, bytes) TRACE3(response__done, fd, status, bytes)
+#define TRACE_CACHE_HIT(key)                   TRACE1(cache__hit, key)
+#define TRACE_CACHE_MISS(key)                  TRACE1(cache__miss, key)
+#define TRACE_HASH_RESIZE(ht, oldm, newm, n)   TRACE4(hash__resize, ht, oldm, newm, n)
+
+
+#endif  // _HTTP_TRACE_H
@@ -0,0 +1,235 @@
+#include "websocket.h"
+#include "base64.h"
+#include "headers.h"
+#include "simd.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define SHA1_LEN 20
+
+/* Prehashes of the handshake header names, see init_websocket() */
+static int64_t upgrade_k, connection_k, version_k, key_k;
+
+
+/**
+ * Computes the SHA-1 digest of len bytes of src. Only used for the
+ * handshake, where it is required by the protocol, not for security.
+ */
+static void sha1(const unsigned char *src, size_t len, unsigned char out[SHA1_LEN]) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    uint64_t bits = (uint64_t) len * 8;
+
+    // Message blocks, the last one or two with the padding and length
+    size_t nblocks = (len + 8) / 64 + 1;
+    for (size_t blk = 0; blk < nblocks; blk++) {
+        unsigned char block[64];
+        for (int i = 0; i < 64; i++) {
+            size_t pos = blk * 64 + i;
+            if (pos < len)
+                block[i] = src[pos];
+            else if (pos == len)
+                block[i] = 0x80;
+            else if (blk == nblocks - 1 && i >= 56)
+                block[i] = (unsigned char) (bits >> (8 * (63 - i)));
+            else
+                block[i] = 0;
+        }
+
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16
+                   | (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+        for (int i = 16; i < 80; i++) {
+            uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = (x << 1) | (x >> 31);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    for (int i = 0; i < 5; i++) {
+        out[4 * i] = (unsigned char) (h[i] >> 24);
+        out[4 * i + 1] = (unsigned char) (h[i] >> 16);
+        out[4 * i + 2] = (unsigned char) (h[i] >> 8);
+        out[4 * i + 3] = (unsigned char) h[i];
+    }
+}
+
+/**
+ * Computes the header name prehashes. Must be called once at startup,
+ * after init_hash().
+ */
+void init_websocket(void) {
+    upgrade_k = hash_prehash("upgrade");
+    connection_k = hash_prehash("connection");
+    version_k = hash_prehash("sec-websocket-version");
+    key_k = hash_prehash("sec-websocket-key");
+}
+
+/**
+ * Checks the headers of a GET request, names in lower case, for a
+ * WebSocket upgrade (RFC 6455 section 4.2.1) and writes the 101 response
+ * accepting it to response. Returns the response length, or -1 if the
+ * request is not a valid upgrade or size is too small; the caller then
+ * answers 400 as for any bad request.
+ */
+int ws_handshake(hasht_t *headers, char *response, size_t size) {
+    const char *upgrade = hash_get_prehashed(headers, "upgrade", upgrade_k);
+    const char *connection = hash_get_prehashed(headers, "connection", connection_k);
+    const char *version = hash_get_prehashed(headers, "sec-websocket-version", version_k);
+    const char *key = hash_get_prehashed(headers, "sec-websocket-key", key_k);
+
+    if (upgrade == NULL || !header_has_token(upgrade, "websocket") || connection == NULL
+        || !header_has_token(connection, "upgrade") || version == NULL || strcmp(version, "13") != 0
+        || key == NULL || strlen(key) != BASE64_LEN(16))
+        return -1;
+
+    // Accept value: base64(SHA-1(key + GUID))
+    char buf[BASE64_LEN(16) + sizeof(WS_GUID)];
+    memcpy(buf, key, BASE64_LEN(16));
+    memcpy(buf + BASE64_LEN(16), WS_GUID, sizeof(WS_GUID) - 1);
+    unsigned char digest[SHA1_LEN];
+    sha1((const unsigned char *) buf, BASE64_LEN(16) + sizeof(WS_GUID) - 1, digest);
+    char accept[BASE64_LEN(SHA1_LEN) + 1];
+    base64_encode(digest, SHA1_LEN, accept);
+
+    int n = snprintf(response, size,
+                     "HTTP/1.1 101 Switching Protocols\r\n"
+                     "Upgrade: websocket\r\n"
+                     "Connection: Upgrade\r\n"
+                     "Sec-WebSocket-Accept: %s\r\n"
+                     "\r\n", accept);
+    return (n < 0 || (size_t) n >= size) ? -1 : n;
+}
+
+/**
+ * Parses the frame at the start of the len bytes of buf, as sent by a
+ * client, unmasking its payload in place. Returns the length of the
+ * frame, 0 if buf does not hold all of it yet, or -1 on a protocol error,
+ * after which the connection should be closed.
+ */
+int ws_parse_frame(char *buf, size_t len, ws_frame_t *f) {
+    const uint8_t *p = (const uint8_t *) buf;
+    if (len < 2)
+        return 0;
+
+    f->fin = p[0] >> 7;
+    f->opcode = p[0] & 0x0F;
+    int masked = p[1] >> 7;
+    uint64_t plen = p[1] & 0x7F;
+    size_t hlen = 2;
+
+    // No extensions are negotiated, so the reserved bits must be clear
+    if ((p[0] & 0x70) != 0 || !masked)
+        return -1;
+    if (f->opcode >= WS_CLOSE) {
+        if (f->opcode > WS_PONG || !f->fin || plen > WS_MAX_CONTROL)
+            return -1;
+    } else if (f->opcode > WS_BINARY) {
+        return -1;
+    }
+
+    if (plen == 126) {
+        if (len < 4)
+            return 0;
+        plen = (uint64_t) p[2] << 8 | p[3];
+        hlen = 4;
+    } else if (plen == 127) {
+        if (len < 10)
+            return 0;
+        plen = 0;
+        for (int i = 0; i < 8; i++)
+            plen = plen << 8 | p[2 + i];
+        hlen = 10;
+    }
+    if (plen > WS_MAX_FRAME)
+        return -1;
+
+    if (len < hlen + 4 + plen)
+        return 0;
+    f->payload = buf + hlen + 4;
+    f->len = plen;
+    str_xor_mask(f->payload, plen, p + hlen);
+
+    return (int) (hlen + 4 + plen);
+}
+
+/**
+ * Writes the header of an unmasked frame, as sent by a server, with a
+ * payload of len bytes. Returns the header length.
+ */
+size_t ws_frame_header(uint8_t hdr[WS_MAX_HEADER], int fin, int opcode, uint64_t len) {
+    hdr[0] = (uint8_t) ((fin ? 0x80 : 0) | (opcode & 0x0F));
+    if (len < 126) {
+        hdr[1] = (uint8_t) len;
+        return 2;
+    }
+    if (len <= 0xFFFF) {
+        hdr[1] = 126;
+        hdr[2] = (uint8_t) (len >> 8);
+        hdr[3] = (uint8_t) len;
+        return 4;
+    }
+    hdr[1] = 127;
+    for (int i = 0; i < 8; i++)
+        hdr[2 + i] = (uint8_t) (len >> (8 * (7 - i)));
+    return 10;
+}
+
+/**
+ * Encodes a whole message as a single frame, ready to be queued as is on
+ * any number of connections. The caller holds the returned reference.
+ */
+sbuf_t *ws_message(int opcode, const void *payload, size_t len) {
+    uint8_t hdr[WS_MAX_HEADER];
+    size_t hlen = ws_frame_header(hdr, 1, opcode, len);
+
+    sbuf_t *b = sbuf_new(hlen + len);
+    memcpy(b->data, hdr, hlen);
+    memcpy(b->data + hlen, payload, len);
+    return b;
+}
+
+/**
+ * Sends a message from ws_message() to n connections, queueing the same
+ * buffer on all of them and writing what their sockets take right away.
+ * If status is not NULL, status[i] gets the wqueue_flush() result for
+ * queues[i], or -1 if its queue was full.
+ */
+void ws_broadcast(sbuf_t *msg, wqueue_t *const *queues, int n, int *status) {
+    for (int i = 0; i < n; i++) {
+        int r = -1;
+        if (wqueue_push(queues[i], msg) == 0)
+            r = wqueue_flush(queues[i]);
+        if (status != NULL)
+            status[i] = r;
+    }
+}
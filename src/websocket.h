@@ -0,0 +1,48 @@
+#ifndef _HTTP_WEBSOCKET_H
+#define _HTTP_WEBSOCKET_H
+
+#include "hash_table.h"
+#include "wqueue.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WS_GUID        "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_MAX_HEADER  14              // bytes of the longest frame header
+#define WS_MAX_CONTROL 125             // payload limit of control frames
+#define WS_MAX_FRAME   (16 << 20)      // larger frames are refused
+
+/* Frame opcodes, RFC 6455 section 5.2 */
+enum {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT         = 0x1,
+    WS_BINARY       = 0x2,
+    WS_CLOSE        = 0x8,
+    WS_PING         = 0x9,
+    WS_PONG         = 0xA,
+};
+
+/**
+ * A frame parsed by ws_parse_frame(). The payload points into the parsed
+ * buffer, already unmasked: no copy is made. Fragmented messages come as
+ * a first frame with fin unset, then WS_CONTINUATION frames.
+ */
+typedef struct {
+    int      fin;
+    int      opcode;
+    char    *payload;
+    uint64_t len;
+} ws_frame_t;
+
+
+void init_websocket(void);
+
+int    ws_handshake(hasht_t *headers, char *response, size_t size);
+int    ws_parse_frame(char *buf, size_t len, ws_frame_t *f);
+size_t ws_frame_header(uint8_t hdr[WS_MAX_HEADER], int fin, int opcode, uint64_t len);
+
+sbuf_t *ws_message(int opcode, const void *payload, size_t len);
+void    ws_broadcast(sbuf_t *msg, wqueue_t *const *queues, int n, int *status);
+
+
+#endif  // _HTTP_WEBSOCKET_H
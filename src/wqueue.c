@@ -0,0 +1,112 @@
+#include "wqueue.h"
+#include "xalloc.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/**
+ * Returns a new buffer of len bytes, with one reference held by the
+ * caller, to be filled before it is shared.
+ */
+sbuf_t *sbuf_new(size_t len) {
+    sbuf_t *b = (sbuf_t *) xmalloc(sizeof(sbuf_t) + len);
+    b->refs = 1;
+    b->len = len;
+    return b;
+}
+
+/**
+ * Takes a reference on b, which may be shared with other threads.
+ */
+sbuf_t *sbuf_ref(sbuf_t *b) {
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+/**
+ * Drops a reference on b, freeing it with the last one.
+ */
+void sbuf_unref(sbuf_t *b) {
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(b);
+}
+
+void wqueue_init(wqueue_t *q, int fd) {
+    q->fd = fd;
+    q->head = q->count = 0;
+    q->off = q->bytes = 0;
+}
+
+/**
+ * Queues b, taking a reference on it. Nothing is written: see
+ * wqueue_flush(). Returns -1 if the queue is full, which means the peer
+ * is not keeping up.
+ */
+int wqueue_push(wqueue_t *q, sbuf_t *b) {
+    if (q->count == WQUEUE_MAX)
+        return -1;
+    q->bufs[(q->head + q->count) % WQUEUE_MAX] = sbuf_ref(b);
+    q->count++;
+    q->bytes += b->len;
+    return 0;
+}
+
+/**
+ * Writes as much of the queue as the socket takes, with one sendmsg(2)
+ * for several buffers. Returns 1 once the queue is empty, 0 if the socket
+ * is full (wait for EPOLLOUT and call again), -1 on error.
+ */
+int wqueue_flush(wqueue_t *q) {
+    while (q->count > 0) {
+        struct iovec iov[WQUEUE_MAX];
+        int n = 0;
+        for (; n < q->count; n++) {
+            sbuf_t *b = q->bufs[(q->head + n) % WQUEUE_MAX];
+            size_t skip = (n == 0) ? q->off : 0;
+            iov[n].iov_base = b->data + skip;
+            iov[n].iov_len = b->len - skip;
+        }
+
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t w = sendmsg(q->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        // Release the buffers written in full
+        q->bytes -= w;
+        size_t left = w;
+        while (q->count > 0) {
+            sbuf_t *b = q->bufs[q->head];
+            if (q->off + left < b->len) {
+                q->off += left;
+                break;
+            }
+            left -= b->len - q->off;
+            q->off = 0;
+            q->head = (q->head + 1) % WQUEUE_MAX;
+            q->count--;
+            sbuf_unref(b);
+        }
+    }
+    return 1;
+}
+
+/**
+ * Drops everything queued, as when the connection is closed.
+ */
+void wqueue_clear(wqueue_t *q) {
+    while (q->count > 0) {
+        sbuf_unref(q->bufs[q->head]);
+        q->head = (q->head + 1) % WQUEUE_MAX;
+        q->count--;
+    }
+    q->off = q->bytes = 0;
+}
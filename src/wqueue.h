@@ -0,0 +1,43 @@
+#ifndef _HTTP_WQUEUE_H
+#define _HTTP_WQUEUE_H
+
+#include <stddef.h>
+
+#define WQUEUE_MAX 64  // buffers queued per connection, at most IOV_MAX
+
+/**
+ * Reference-counted, immutable buffer. Encoded once, the same buffer can
+ * be queued on any number of connections: each holds a reference until
+ * it has written it all.
+ */
+typedef struct {
+    int    refs;
+    size_t len;
+    char   data[];
+} sbuf_t;
+
+/**
+ * Write queue of a connection: buffers waiting to be written to fd, in
+ * order, the first one possibly in part.
+ */
+typedef struct {
+    int     fd;
+    int     head;   // index of the first buffer in bufs
+    int     count;
+    size_t  off;    // bytes of the first buffer already written
+    size_t  bytes;  // bytes queued and not yet written
+    sbuf_t *bufs[WQUEUE_MAX];
+} wqueue_t;
+
+
+sbuf_t *sbuf_new(size_t len);
+sbuf_t *sbuf_ref(sbuf_t *b);
+void    sbuf_unref(sbuf_t *b);
+
+void wqueue_init(wqueue_t *q, int fd);
+int  wqueue_push(wqueue_t *q, sbuf_t *b);
+int  wqueue_flush(wqueue_t *q);
+void wqueue_clear(wqueue_t *q);
+
+
+#endif  // _HTTP_WQUEUE_H
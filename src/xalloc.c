@@ -0,0 +1,41 @@
+#include "xalloc.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Prints the formatted message and exits.
+ */
+void fatal(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+
+    // TODO: treat it as a daemon, errors should be committed
+    // to syslog, and not exit with error.
+    exit(1);
+}
+
+void *xmalloc(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL)
+        fatal("out of memory allocating %zu bytes", size);
+    return p;
+}
+
+void *xcalloc(size_t nmemb, size_t size) {
+    void *p = calloc(nmemb, size);
+    if (p == NULL)
+        fatal("out of memory allocating %zu bytes", nmemb * size);
+    return p;
+}
+
+void *xrealloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (p == NULL)
+        fatal("out of memory allocating %zu bytes", size);
+    return p;
+}
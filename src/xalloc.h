@@ -0,0 +1,18 @@
+#ifndef _HTTP_XALLOC_H
+#define _HTTP_XALLOC_H
+
+#include <stddef.h>
+
+/*
+ * Allocations that cannot fail, for the paths that have no way to report
+ * the error to their caller: the process exits instead, see fatal().
+ */
+
+void *xmalloc(size_t size);
+void *xcalloc(size_t nmemb, size_t size);
+void *xrealloc(void *p, size_t size);
+
+void fatal(const char *fmt, ...) __attribute__((noreturn, format(printf, 1, 2)));
+
+
+#endif  // _HTTP_XALLOC_H
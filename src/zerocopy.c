@@ -0,0 +1,159 @@
+#include "zerocopy.h"
+
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+
+/**
+ * Initializes the zero-copy state of socket fd, enabling SO_ZEROCOPY on
+ * it. Sends of at least threshold bytes will use it, 0 meaning
+ * ZC_DEFAULT_THRESHOLD. Returns 1 if zero-copy is enabled, 0 if the
+ * socket or kernel does not support it, in which case zc_send() just
+ * copies.
+ */
+int zc_init(zc_sock_t *zc, int fd, size_t threshold) {
+    memset(zc, 0, sizeof(*zc));
+    zc->threshold = (threshold > 0) ? threshold : ZC_DEFAULT_THRESHOLD;
+
+    int one = 1;
+    zc->enabled = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    return zc->enabled;
+}
+
+/**
+ * Sends up to len bytes of buf on non-blocking socket fd, like send(2).
+ * release(arg) is called once the kernel is done with buf: right away
+ * for copied sends, from zc_reap() for zero-copy ones. It
+ * is not called when nothing was sent (-1 is returned), so the caller
+ * keeps ownership and retries later.
+ *
+ * On a partial send the rest must be sent by another call, with its
+ * own release callback: the caller typically holds a reference to the
+ * buffer per call.
+ */
+ssize_t zc_send(zc_sock_t *zc, int fd, const void *buf, size_t len,
+                zc_release_fn release, void *arg) {
+    int flags = MSG_NOSIGNAL;
+    int zerocopy = zc->enabled && len >= zc->threshold && zc->npending < ZC_MAX_PENDING;
+    if (zerocopy)
+        flags |= MSG_ZEROCOPY;
+
+    ssize_t n = send(fd, buf, len, flags);
+    if (n < 0 && zerocopy && errno == ENOBUFS) {
+        // Out of locked memory for pinned pages, copy instead
+        zerocopy = 0;
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+    }
+    if (n < 0)
+        return n;
+
+    if (!zerocopy) {
+        if (release != NULL)
+            release(arg);
+        return n;
+    }
+
+    // Every successful zero-copy send takes the next notification id,
+    // first_id + npending
+    int slot = (zc->first_id + zc->npending) % ZC_MAX_PENDING;
+    zc->pending[slot].release = release;
+    zc->pending[slot].arg = arg;
+    zc->npending++;
+    zc->zerocopy_sends++;
+    return n;
+}
+
+/**
+ * Releases the pending sends with ids up to and including hi.
+ */
+static void release_through(zc_sock_t *zc, uint32_t hi) {
+    while (zc->npending > 0 && (int32_t) (hi - zc->first_id) >= 0) {
+        int slot = zc->first_id % ZC_MAX_PENDING;
+        if (zc->pending[slot].release != NULL)
+            zc->pending[slot].release(zc->pending[slot].arg);
+        zc->first_id++;
+        zc->npending--;
+    }
+}
+
+/**
+ * Processes the completion notifications queued on socket fd, calling
+ * the release callbacks of the sends they cover. Should be called when
+ * epoll reports EPOLLERR on the socket. Returns the number of pending
+ * sends left, or -1 if reading the error queue failed with an error
+ * other than it being empty.
+ */
+int zc_reap(zc_sock_t *zc, int fd) {
+    char control[128];
+
+    while (zc->npending > 0) {
+        struct msghdr msg = { 0 };
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err ee;
+            if (cm->cmsg_len < CMSG_LEN(sizeof(ee)))
+                continue;
+            memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+            if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee.ee_errno != 0)
+                continue;
+
+            // Notifications cover the id range [ee_info, ee_data]; ids
+            // complete in order on a TCP socket
+            if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->copied_sends += ee.ee_data - ee.ee_info + 1;
+            release_through(zc, ee.ee_data);
+        }
+    }
+
+    return zc->npending;
+}
+
+/**
+ * Closes socket fd, once the kernel is done with the buffers of its
+ * zero-copy sends. Returns 0 when closed, all release callbacks having
+ * run.
+ *
+ * Pages of pending sends may still be read by the NIC after close(2),
+ * even after a reset, from packets already queued to the device, and
+ * only the socket error queue tells when it is done. So while sends are
+ * pending the socket is only shut down, and their number is returned:
+ * the caller keeps the socket in its epoll set, edge-triggered as it
+ * now reports EPOLLHUP, calls zc_reap() on EPOLLERR, and calls this
+ * again. Completions arrive as the peer acknowledges the data, or once
+ * TCP gives up on an unresponsive peer.
+ */
+int zc_close(zc_sock_t *zc, int fd) {
+    if (zc->npending > 0) {
+        zc_reap(zc, fd);
+        if (zc->npending > 0) {
+            shutdown(fd, SHUT_RDWR);
+            return zc->npending;
+        }
+    }
+    close(fd);
+    return 0;
+}
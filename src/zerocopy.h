@@ -0,0 +1,53 @@
+#ifndef _HTTP_ZEROCOPY_H
+#define _HTTP_ZEROCOPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define ZC_DEFAULT_THRESHOLD (16 * 1024)  // below this, copying is cheaper
+#define ZC_MAX_PENDING       256          // zero-copy sends in flight per socket
+
+/**
+ * Called once the kernel no longer needs the buffer given to zc_send(),
+ * which may then be reused or freed.
+ */
+typedef void (*zc_release_fn)(void *arg);
+
+/**
+ * Zero-copy send state of one socket.
+ *
+ * Sends of at least threshold bytes use MSG_ZEROCOPY: the kernel pins
+ * the pages and reads them while transmitting, so the buffer must stay
+ * untouched until its release callback runs. Completions arrive on the
+ * socket error queue, signalled by EPOLLERR, and are processed by
+ * zc_reap(). Smaller sends, or all of them when the socket does not
+ * support zero-copy, are plain sends released right away.
+ */
+typedef struct {
+    int      enabled;
+    size_t   threshold;
+
+    // Ring of sends awaiting completion, in id order
+    struct {
+        zc_release_fn release;
+        void         *arg;
+    } pending[ZC_MAX_PENDING];
+    uint32_t first_id;  // id of the oldest pending send
+    int      npending;
+
+    // Statistics: sends the kernel ended up copying anyway (e.g. over
+    // loopback) mean the threshold is not paying off
+    uint64_t zerocopy_sends;
+    uint64_t copied_sends;
+} zc_sock_t;
+
+
+int     zc_init(zc_sock_t *zc, int fd, size_t threshold);
+ssize_t zc_send(zc_sock_t *zc, int fd, const void *buf, size_t len,
+                zc_release_fn release, void *arg);
+int     zc_reap(zc_sock_t *zc, int fd);
+int     zc_close(zc_sock_t *zc, int fd);
+
+
+#endif  // _HTTP_ZEROCOPY_H